@@ -9,164 +9,249 @@
 #include <windows.h>
 #include <process.h>
 typedef HANDLE th_hander;
+typedef CRITICAL_SECTION th_mutex;
+#define th_mutex_init(m) InitializeCriticalSection(m)
+#define th_mutex_lock(m) EnterCriticalSection(m)
+#define th_mutex_trylock(m) (TryEnterCriticalSection(m) ? 0 : -1)
+#define th_mutex_unlock(m) LeaveCriticalSection(m)
+#define th_mutex_delete(m) DeleteCriticalSection(m)
+typedef DWORD th_key;
+#define th_key_create(k) ((*(k) = TlsAlloc()) == TLS_OUT_OF_INDEXES ? -1 : 0)
+#define th_key_delete(k) TlsFree(k)
+#define th_key_set(k,v) TlsSetValue(k,v)
+#define th_key_get(k) TlsGetValue(k)
+#define th_barrier() MemoryBarrier()
+#define th_atomic_inc(v) InterlockedIncrement(v)
+#define th_atomic_dec(v) InterlockedDecrement(v)
+#define th_local __declspec(thread)
+typedef LPVOID fiber_ctx;
 #else
 #include <pthread.h>
 #include <unistd.h>
+#include <ucontext.h>
 typedef pthread_t th_hander;
+typedef pthread_mutex_t th_mutex;
+#define th_mutex_init(m) pthread_mutex_init(m,NULL)
+#define th_mutex_lock(m) pthread_mutex_lock(m)
+#define th_mutex_trylock(m) (pthread_mutex_trylock(m) == 0 ? 0 : -1)
+#define th_mutex_unlock(m) pthread_mutex_unlock(m)
+#define th_mutex_delete(m) pthread_mutex_destroy(m)
+typedef pthread_key_t th_key;
+#define th_key_create(k) pthread_key_create(k,NULL)
+#define th_key_delete(k) pthread_key_delete(k)
+#define th_key_set(k,v) pthread_setspecific(k,v)
+#define th_key_get(k) pthread_getspecific(k)
+#define th_barrier() __sync_synchronize()
+#define th_atomic_inc(v) __sync_add_and_fetch((v),1)
+#define th_atomic_dec(v) __sync_sub_and_fetch((v),1)
+#define th_local __thread
+typedef ucontext_t fiber_ctx;
 #endif
 
+/* Concurrency limiter tuning. The queue estimation is compared against
+ * ALPHA and BETA , and the no load latency is measured again after every
+ * PROBE samples so it follows a shifted workload */
+#define MRPC_LIMITER_INITIAL 8
+#define MRPC_LIMITER_ALPHA 3
+#define MRPC_LIMITER_BETA 6
+#define MRPC_LIMITER_PROBE 1000
+
 struct mrpc_service_entry;
 struct mrpc_service_table;
+struct mrpc_service_pool;
+struct mrpc_service_th;
+
+/* Vegas like concurrency limiter of a method , guarded by the service lock.
+ * It is owned by the service , the copies of an entry share it */
+struct mrpc_limiter {
+    struct mrpc_limiter* next;
+    int limit;
+    int min_limit;
+    int max_limit;
+    int inflight;
+    int noload; /* minimum latency observed , -1 means not known yet */
+    int samples;
+};
+
+/* Where the response of a batched request goes */
+struct mrpc_batch_slot {
+    void* key;
+    struct mrpc_limiter* limiter; /* the one the request acquired , NULL for none */
+};
+
+/* Pending requests of a batch method , guarded by the service lock. It is
+ * owned by the service , the copies of an entry share it */
+struct mrpc_batch {
+    struct mrpc_batch* next;
+    mrpc_service_batch_cb func;
+    size_t max;
+    int window;
+    size_t size;
+    int collecting; /* a worker is waiting for the batch to fill up */
+    struct mrpc_request* reqs;
+    struct mrpc_batch_slot* slots; /* one per request */
+};
 
 struct mrpc_service_entry {
     char method_name[ MRPC_MAX_METHOD_NAME_LEN ];
+    size_t method_name_len;
     void* udata;
-    mrpc_service_cb func;
-    struct mrpc_service_entry* next;
-    int fhash;
+    mrpc_service_cb func; /* NULL for the async and the batch methods */
+    unsigned int hash;
+    int id; /* method id , -1 when the ids are used up */
+    int priority;
+    struct mrpc_service_pool* pool; /* NULL means the shared pool */
+    struct mrpc_limiter* limiter; /* NULL means unlimited */
+    int inline_exec; /* executed on the IO thread */
+    mrpc_service_async_cb async_func; /* the method is async when it is set */
+    int fiber; /* func runs on a fiber */
+    struct mrpc_batch* batch; /* the method is batched when it is set */
+    int key_par; /* parameter picking the worker queue , -1 means none */
+    int view; /* parsed as a view */
+    int lazy; /* parameters decoded on demand */
+    unsigned int version; /* of the table that replaced it , see _mrpc_service_reclaim */
+    struct mrpc_service_entry* retired; /* replaced entries */
 };
 
+/* Open addressing table of the entries with linear probing , the capacity is
+ * a power of 2. A published table is never changed , an update builds a new
+ * one , so the readers go without any lock. See _mrpc_service_publish */
 struct mrpc_service_table {
-    struct mrpc_service_entry* array;
+    struct mrpc_service_entry** slots;
     size_t cap;
     size_t size;
+    struct mrpc_service_entry** ids; /* indexed by the method id */
+    size_t id_sz;
+    unsigned int version; /* of the table that replaced it , see _mrpc_service_reclaim */
+    struct mrpc_service_table* retired; /* replaced tables */
 };
 
 static
-int _mrpc_stbl_calc_hash( const char* key , size_t len ) {
-    int val = 0;
-    size_t i ;
-    for( i = 0 ; i < len ; ++i ) {
-        val = val ^ ((val<<5)+(val>>2)+(int)key[i]);
-    }
-    return val;
+struct mrpc_service_table*
+mrpc_stbl_create( size_t cap ) {
+    struct mrpc_service_table* tbl = malloc(sizeof(*tbl));
+    VERIFY(tbl);
+    tbl->slots = malloc(sizeof(struct mrpc_service_entry*)*cap);
+    VERIFY(tbl->slots);
+    memset(tbl->slots,0,sizeof(struct mrpc_service_entry*)*cap);
+    tbl->cap = cap;
+    tbl->size = 0;
+    tbl->ids = NULL;
+    tbl->id_sz = 0;
+    tbl->version = 0;
+    tbl->retired = NULL;
+    return tbl;
 }
 
 static
-void mrpc_stbl_init( struct mrpc_service_table* tbl , size_t cap ) {
-    tbl->array = malloc( sizeof(struct mrpc_service_entry) * cap );
-    VERIFY(tbl->array);
-    tbl->cap = cap;
-    tbl->size= 0;
-    memset(tbl->array,0,sizeof(struct mrpc_service_entry)*cap);
+void
+mrpc_stbl_put( struct mrpc_service_table* tbl , struct mrpc_service_entry* ent ) {
+    size_t idx = ent->hash & (tbl->cap-1);
+    while( tbl->slots[idx] != NULL )
+        idx = (idx+1) & (tbl->cap-1);
+    tbl->slots[idx] = ent;
+    ++tbl->size;
 }
 
+/* Build the id index of the entries put in */
 static
-int _mrpc_stbl_query_slot( const struct mrpc_service_table* tbl , const struct mrpc_service_entry* entry ) {
-    int idx = entry->fhash % tbl->cap;
-    struct mrpc_service_entry* tar;
-
-    if( tbl->array[idx].func == NULL ) {
-        tar = tbl->array + idx;
-    } else {
-        struct mrpc_service_entry* ent;
-        int h = entry->fhash;
-
-        /* find out where we should insert such entry */
-        ent = (tbl->array+idx);
-        while( ent->next != NULL ) {
-            if( strcmp(ent->method_name,entry->method_name) == 0 )
-                return -1;
-            ent = ent->next;
+void
+mrpc_stbl_index( struct mrpc_service_table* tbl ) {
+    size_t i;
+    for( i = 0 ; i < tbl->cap ; ++i ) {
+        if( tbl->slots[i] != NULL && tbl->slots[i]->id >= 0 )
+            tbl->id_sz = MAX(tbl->id_sz,CAST(size_t,tbl->slots[i]->id)+1);
+    }
+    if( tbl->id_sz != 0 ) {
+        tbl->ids = malloc(sizeof(struct mrpc_service_entry*)*tbl->id_sz);
+        VERIFY(tbl->ids);
+        memset(tbl->ids,0,sizeof(struct mrpc_service_entry*)*tbl->id_sz);
+        for( i = 0 ; i < tbl->cap ; ++i ) {
+            if( tbl->slots[i] != NULL && tbl->slots[i]->id >= 0 )
+                tbl->ids[tbl->slots[i]->id] = tbl->slots[i];
         }
-        if( strcmp(ent->method_name,entry->method_name) == 0 )
-            return -1;
-
-        /* probing to where we should insert this entry */
-        while( tbl->array[ ++h % tbl->cap ].func != NULL ) {}
-        tar = tbl->array + (h % tbl->cap);
-        ent->next = tar;
     }
-
-    /* do the insertion here */
-    memcpy(tar,entry,sizeof(*entry));
-    tar->next = NULL;
-    return tar-(tbl->array);
 }
 
+/* A copy of src with add put in and drop left out , either one can be NULL.
+ * The load factor is kept under 1/2 */
 static
-void
-_mrpc_stbl_rehash( struct mrpc_service_table* tbl ) {
-    struct mrpc_service_table tmp_tb;
-    int idx;
+struct mrpc_service_table*
+mrpc_stbl_rebuild( const struct mrpc_service_table* src , struct mrpc_service_entry* add ,
+                   const struct mrpc_service_entry* drop , size_t min_cap ) {
+    struct mrpc_service_table* tbl;
+    size_t cap = 1;
     size_t i;
 
-    assert(tbl->cap == tbl->size);
-
-    mrpc_stbl_init(&tmp_tb,tbl->cap*2);
-
-    for( i = 0 ; i < tbl->size ; ++i ) {
-        idx = _mrpc_stbl_query_slot(tbl,tbl->array+i);
-        assert( idx >= 0 );
+    while( cap < min_cap || cap < (src->size+1)*2 )
+        cap <<= 1;
+    tbl = mrpc_stbl_create(cap);
+    for( i = 0 ; i < src->cap ; ++i ) {
+        if( src->slots[i] != NULL && src->slots[i] != drop )
+            mrpc_stbl_put(tbl,src->slots[i]);
     }
-    tbl->cap = tmp_tb.cap;
-    tbl->array = tmp_tb.array;
-    free(tbl->array);
+    if( add != NULL )
+        mrpc_stbl_put(tbl,add);
+    mrpc_stbl_index(tbl);
+    return tbl;
 }
 
+/* A copy of src holding copies of its entries , it shares nothing with src */
 static
-int mrpc_stbl_insert( struct mrpc_service_table* tbl ,
-    mrpc_service_cb cb , const char* method_name , void* udata ) {
-    struct mrpc_service_entry tmp_ent;
-    size_t len = strlen(method_name);
-    int idx;
-
-    if( len >= MRPC_MAX_METHOD_NAME_LEN )
-        return -1;
-    strcpy(tmp_ent.method_name,method_name);
-    tmp_ent.fhash = _mrpc_stbl_calc_hash(method_name,len);
-    tmp_ent.func = cb;
-    tmp_ent.next = NULL;
-    tmp_ent.udata = udata;
-
-    /* checking if we need to rehash the hash table here */
-    if( tbl->size == tbl->cap )
-        _mrpc_stbl_rehash(tbl);
-    assert(tbl->size < tbl->cap);
-
-    idx = _mrpc_stbl_query_slot(tbl,&tmp_ent);
-    if( idx < 0 )
-        return -1;
-
-    /* since mrpc_stbl_query_slot accept a const table
-       pointer , so we need to bump its size */
-    ++(tbl->size);
-
-    return 0;
+struct mrpc_service_table*
+mrpc_stbl_replica( const struct mrpc_service_table* src ) {
+    struct mrpc_service_table* tbl = mrpc_stbl_create(src->cap);
+    size_t i;
+    for( i = 0 ; i < src->cap ; ++i ) {
+        if( src->slots[i] != NULL ) {
+            struct mrpc_service_entry* ent = malloc(sizeof(*ent));
+            VERIFY(ent);
+            *ent = *(src->slots[i]);
+            mrpc_stbl_put(tbl,ent);
+        }
+    }
+    mrpc_stbl_index(tbl);
+    return tbl;
 }
 
 static
-const struct mrpc_service_entry*
-mrpc_stbl_query( struct mrpc_service_table* tbl , const char* method_name ) {
-    int len = strlen(method_name);
-    int fhash ;
-    int idx ;
+struct mrpc_service_entry*
+mrpc_stbl_query_h( const struct mrpc_service_table* tbl , const char* method_name ,
+                   size_t len , unsigned int hash ) {
+    size_t idx = hash & (tbl->cap-1);
     struct mrpc_service_entry* ent;
-
-    if( len >= MRPC_MAX_METHOD_NAME_LEN )
-        return NULL;
-
-    fhash = _mrpc_stbl_calc_hash(method_name,len);
-    idx = fhash % tbl->cap;
-    ent = tbl->array + idx;
-
-    if( ent->func == NULL )
-        return NULL;
-    else {
-        while( ent->fhash != fhash || strcmp(ent->method_name,method_name) != 0 ) {
-            ent = ent->next;
-            if( ent == NULL )
-                return NULL;
-        }
-        return ent;
+    while( (ent = tbl->slots[idx]) != NULL ) {
+        if( ent->hash == hash && ent->method_name_len == len &&
+            memcmp(ent->method_name,method_name,len) == 0 )
+            return ent;
+        idx = (idx+1) & (tbl->cap-1);
     }
+    return NULL;
+}
+
+static
+struct mrpc_service_entry*
+mrpc_stbl_query( const struct mrpc_service_table* tbl , const char* method_name ) {
+    size_t len = strlen(method_name);
+    return mrpc_stbl_query_h(tbl,method_name,len,mrpc_hash(method_name,len));
 }
 
 static
 void
 mrpc_stbl_destroy( struct mrpc_service_table* tbl ) {
-    free(tbl->array);
-    tbl->cap = tbl->size = 0;
+    free(tbl->ids);
+    free(tbl->slots);
+    free(tbl);
+}
+
+/* Destroy a table along with its entries */
+static
+void
+mrpc_stbl_destroy_all( struct mrpc_service_table* tbl ) {
+    size_t i;
+    for( i = 0 ; i < tbl->cap ; ++i )
+        free(tbl->slots[i]);
+    mrpc_stbl_destroy(tbl);
 }
 
 /* thread utility */
@@ -175,9 +260,31 @@ struct th_pool {
     size_t th_sz;
 };
 
+/* slot state of an elastic pool */
+#define TH_SLOT_EMPTY 0
+#define TH_SLOT_RUNNING 1
+#define TH_SLOT_EXITED 2 /* the thread is retired but not joined yet */
+
+struct mrpc_service_core;
+
+/* A worker reading the service table , see _mrpc_service_reclaim */
+struct mrpc_reader {
+    volatile unsigned int version; /* of the service when it entered , 0 when out */
+    struct mrpc_reader* next;
+};
+
 struct mrpc_service_th {
     int exit; /* This one is used to release the thread when error happened */
     struct mrpc_service* service;
+    struct mrpc_queue* queue; /* NULL means the default request queue */
+    int elastic;
+    int once; /* mrpc_service_run_once , it never blocks */
+    int state; /* TH_SLOT_XXX , only for the elastic pool */
+    struct mrpc_service_core* core; /* only for the thread per core mode */
+    fiber_ctx sched; /* the worker context while it runs a fiber */
+    void* local; /* state of the handlers on this worker , kept across respawns */
+    th_mutex state_lock; /* held while the worker runs a request or sets local */
+    struct mrpc_reader reader;
 };
 
 typedef void (*th_cb)(void*);
@@ -206,6 +313,50 @@ _th_pool_entry( void* p ) {
 }
 #endif /* _WIN32 */
 
+static
+int
+th_pool_spawn( struct th_pool* pool , size_t idx , struct th_data* data ) {
+#ifdef _WIN32
+    pool->handles[idx] =  (th_hander)_beginthreadex(
+    NULL,
+    0,
+    _th_pool_entry,
+    data,
+    0,
+    NULL);
+    if( pool->handles[idx] == 0 ) {
+        return -1;
+    }
+#else
+    int pthread_ret =
+        pthread_create(&(pool->handles[idx]),NULL,_th_pool_entry,data);
+    if( pthread_ret != 0 ) {
+        return -1;
+    }
+#endif /* _WIN32 */
+    return 0;
+}
+
+static
+int
+th_pool_join_one( struct th_pool* pool , size_t idx ) {
+#ifdef _WIN32
+    DWORD dwRet = WaitForSingleObject(pool->handles[idx],INFINITE);
+    CloseHandle(pool->handles[idx]);
+    return dwRet == WAIT_OBJECT_0 ? 0 : -1;
+#else
+    return pthread_join( pool->handles[idx] , NULL ) == 0 ? 0 : -1;
+#endif /* _WIN32 */
+}
+
+static
+void
+th_pool_init( struct th_pool* pool , size_t th_sz ) {
+    pool->handles = malloc(th_sz*sizeof(th_hander));
+    VERIFY(pool->handles);
+    pool->th_sz = th_sz;
+}
+
 static
 int
 th_pool_create( struct th_pool* pool , size_t th_sz , th_cb cb ,
@@ -213,31 +364,12 @@ th_pool_create( struct th_pool* pool , size_t th_sz , th_cb cb ,
     size_t i;
 
     *created_sz = 0;
-    pool->handles = malloc(th_sz*sizeof(th_hander));
-    VERIFY(pool->handles);
-    pool->th_sz = th_sz;
+    th_pool_init(pool,th_sz);
 
     for( i = 0 ; i < th_sz ; ++i ) {
-#ifdef _WIN32
-        pool->handles[i] =  (th_hander)_beginthreadex(
-        NULL,
-        0,
-        _th_pool_entry,
-        data+i,
-        0,
-        NULL);
-        if( pool->handles[i] == INVALID_HANDLE_VALUE ) {
+        if( th_pool_spawn(pool,i,data+i) != 0 )
             return -1;
-        }
-        ++*created_sz;
-#else
-        int pthread_ret =
-            pthread_create(&(pool->handles[i]),NULL,_th_pool_entry,data+i);
-        if( pthread_ret != 0 ) {
-            return -1;
-        }
         ++*created_sz;
-#endif /* _WIN32 */
     }
 
     return 0;
@@ -252,8 +384,9 @@ th_pool_join( struct th_pool* pool , int cnt ) {
     int offset = 0;
 
     DWORD dwRet;
-    assert(pool->th_sz !=0);
-    assert(pool->th_sz > (size_t)cnt);
+    assert(pool->th_sz >= (size_t)cnt);
+    if( cnt == 0 )
+        return 0;
     do {
         wait_batch = MIN(MAXIMUM_WAIT_OBJECTS,left_wait);
         dwRet = WaitForMultipleObjects(
@@ -275,9 +408,10 @@ th_pool_join( struct th_pool* pool , int cnt ) {
 
 #else
     /* Pthread doesn't comes with pthread_multi_join , so we just join each thread */
-    assert( cnt < pool->th_sz );
-    for( ; cnt != 0 ; --cnt ) {
-        int ret = pthread_join( pool->handles[cnt] , NULL );
+    int i;
+    assert( (size_t)cnt <= pool->th_sz );
+    for( i = 0 ; i < cnt ; ++i ) {
+        int ret = pthread_join( pool->handles[i] , NULL );
         if( ret != 0 )
             return -1;
     }
@@ -293,180 +427,1707 @@ th_pool_destroy( struct th_pool* pool ) {
     pool->th_sz = 0;
 }
 
+/* A dedicated pool , it owns a request queue and the threads draining it */
+struct mrpc_service_pool {
+    char name[ MRPC_MAX_METHOD_NAME_LEN ];
+    struct mrpc_queue* queue; /* destroyed by mrpc_clean */
+    int thread_sz;
+    struct th_data* th_data;
+    struct th_pool th_pool;
+    struct mrpc_queue** th_queues; /* one per thread in the key affinity mode */
+    size_t th_queue_sz;
+    struct mrpc_service_pool* next;
+};
+
+/* A core of the thread per core mode , the table replica is built by the
+ * core thread itself so it lives on the memory local to that thread */
+struct mrpc_service_core {
+    struct mrpc_service* service;
+    struct mrpc_service_table* stable;
+    unsigned int version; /* of the service table the replica is built from */
+    struct mrpc_core* core;
+    size_t index;
+};
+
+/* Pending execution of an async method */
+struct mrpc_service_token {
+    struct mrpc_service* service;
+    struct mrpc_request req; /* copy , the worker stack is gone by then */
+    void* key;
+    struct mrpc_limiter* limiter;
+};
+
+/* What a fiber asks its worker for when it switches out */
+#define FIBER_DONE 0
+#define FIBER_CALL 1
+#define FIBER_YIELD 2
+
+/* A downstream call of a fiber , it lives on the fiber stack */
+struct mrpc_fiber_call {
+    struct mrpc_response* res;
+    int timeout;
+    const char* addr;
+    int method_type;
+    const char* method_name;
+    const char* par_fmt;
+    va_list* args;
+    int ret;
+};
+
+/* Execution of a fiber method */
+struct mrpc_fiber {
+    struct mrpc_request req; /* copy , the worker stack is gone by then */
+    fiber_ctx ctx;
+    void* stack; /* NULL on windows , the fiber owns its stack */
+    struct mrpc_service* service;
+    struct mrpc_service_th* th; /* the worker running the fiber now */
+    struct mrpc_queue* queue; /* where the fiber is posted to go on */
+    mrpc_service_cb func; /* copied , the entry may be freed while it runs */
+    void* udata;
+    struct mrpc_limiter* limiter;
+    void* key;
+    int state; /* FIBER_XXX */
+    struct mrpc_fiber_call* call;
+    int error_code;
+    struct mrpc_val result;
+    struct mrpc_fiber* next; /* free list of the service */
+};
+
 /* MRPC service implementation */
 struct mrpc_service {
     void* udata;
-    struct mrpc_service_table stable;
+    struct mrpc_service_table* stable; /* published table , read without lock */
+    struct mrpc_service_table* retired; /* replaced tables not freed yet */
+    struct mrpc_service_entry* retired_entries; /* replaced entries not freed yet */
+    struct mrpc_reader* readers; /* the workers , see _mrpc_service_reclaim */
+    volatile long guests; /* readers out of the workers */
+    struct mrpc_limiter* limiters; /* every limiter ever set , freed with the service */
+    struct mrpc_batch* batches; /* every batch , freed with the service */
+    size_t stable_cap; /* initial capacity */
+    volatile unsigned int version; /* bumped on each publication , never 0 */
     struct th_data* th_data; /* the size of this data is same as thread pool th_sz */
     struct th_pool th_pool;
-    size_t min_slp_tm; /* min sleep timeout */
-    size_t max_slp_tm; /* max sleep timeout */
+    struct mrpc_service_pool* pools; /* dedicated pools */
+    th_mutex lock; /* guards the limiters , the elastic pool and the table updates */
+    int th_live; /* running threads of the elastic pool */
+    int th_min;
+    int quit;
+    int cpus[MRPC_MAX_AFFINITY_CPU]; /* affinity of the workers */
+    size_t cpu_sz;
+    int follow_io; /* use the affinity of the IO thread */
+    struct mrpc_service_core* cores; /* thread per core mode */
+    size_t core_sz;
+    struct th_data* core_th_data;
+    struct th_pool core_th_pool;
+    size_t min_slp_tm; /* queueing delay that grows the elastic pool */
+    size_t max_slp_tm; /* idle time that shrinks the elastic pool */
+    struct mrpc_fiber* fibers; /* free fibers , guarded by the lock */
+    struct mrpc_queue** th_queues; /* one per shared thread in the key affinity mode */
+    size_t th_queue_sz;
+    mrpc_service_state_init_cb state_init; /* per worker state */
+    mrpc_service_state_cb state_destroy;
+    void* state_data;
+    th_key state_key; /* state of the calling worker */
 };
 
-/* Thread creation is typically a memory barrier , so after creating thread
- * all the data that is visible to this thread, but not including the data
- * modification happens right after the thread creation */
+/* The published table , see _mrpc_service_publish */
+#define mrpc_service_table(service) \
+    (*CAST(struct mrpc_service_table* volatile*,&((service)->stable)))
+
+/* The tables and the entries replaced by a publication are not freed at once ,
+ * a reader may still hold them. They are tagged with the version of the
+ * service right after the publication. A worker records the version it sees
+ * when it takes a request and clears it once the request is done , anything
+ * tagged no later than the oldest version recorded is out of reach. The
+ * threads that are not workers , like the IO thread running the router , are
+ * counted as guests and nothing is freed while one of them is in */
+static
+const struct mrpc_service_table*
+_mrpc_service_enter( struct mrpc_service* service , struct mrpc_reader* r ) {
+    if( r != NULL )
+        r->version = service->version;
+    else
+        th_atomic_inc(&(service->guests));
+    th_barrier();
+    return mrpc_service_table(service);
+}
 
 static
 void
-_mrpc_service_th_cb( void* par ) {
-    struct mrpc_service_th* th = CAST( struct mrpc_service_th* , par );
-    while(!th->exit) {
-        void* key;
-        struct mrpc_request req;
-        const struct mrpc_service_entry* func_entry;
-        int ret = mrpc_request_recv(&req,&key);
-
-        if( ret <0 )
-            continue;
-
-        /* when we get the notification that MRPC is interrupted, we just
-         * return from the thread callback and user needs to call mrpc_service_quit
-         * to join all the allocated thread */
-
-        else if( ret == 1 )
-            return;
+_mrpc_service_leave( struct mrpc_service* service , struct mrpc_reader* r ) {
+    th_barrier();
+    if( r != NULL )
+        r->version = 0;
+    else
+        th_atomic_dec(&(service->guests));
+}
 
-        /* look up the service and then start to execute */
-        func_entry = mrpc_stbl_query( &(th->service->stable), req.method_name );
-        if( func_entry == NULL ) {
+/* Register a worker as a reader , its record lives as long as the service */
+static
+void
+_mrpc_service_register( struct mrpc_service* service , struct mrpc_reader* r ) {
+    r->version = 0;
+    th_mutex_lock(&(service->lock));
+    r->next = service->readers;
+    service->readers = r;
+    th_mutex_unlock(&(service->lock));
+}
 
-            mrpc_response_send(
-                CAST(const struct mrpc_request*,&req),
-                key,
-                NULL,
-                MRPC_EC_FUNCTION_NOT_FOUND);
+static
+void
+_mrpc_service_unregister( struct mrpc_service* service , struct mrpc_reader* r ) {
+    struct mrpc_reader** p;
+    th_mutex_lock(&(service->lock));
+    for( p = &(service->readers) ; *p != NULL ; p = &((*p)->next) ) {
+        if( *p == r ) {
+            *p = r->next;
+            break;
+        }
+    }
+    th_mutex_unlock(&(service->lock));
+}
 
+/* Free what the readers have moved past , called with the lock held */
+static
+void
+_mrpc_service_reclaim( struct mrpc_service* service ) {
+    unsigned int oldest = service->version;
+    const struct mrpc_reader* r;
+    struct mrpc_service_table** tbl;
+    struct mrpc_service_entry** ent;
+
+    th_barrier();
+    if( service->guests != 0 )
+        return;
+    for( r = service->readers ; r != NULL ; r = r->next ) {
+        unsigned int v = r->version;
+        if( v != 0 && CAST(int,v - oldest) < 0 )
+            oldest = v;
+    }
+    for( tbl = &(service->retired) ; *tbl != NULL ; ) {
+        struct mrpc_service_table* t = *tbl;
+        if( CAST(int,t->version - oldest) <= 0 ) {
+            *tbl = t->retired;
+            mrpc_stbl_destroy(t);
         } else {
-            int error_code;
-            struct mrpc_val result;
-
-            func_entry->func(
-                th->service,
-                &req,
-                func_entry->udata,
-                &error_code,
-                &result);
-            /* sending the response to the MRPC out band queue */
-            mrpc_response_send(
-                &req,
-                key,
-                &result,
-                error_code);
+            tbl = &(t->retired);
+        }
+    }
+    for( ent = &(service->retired_entries) ; *ent != NULL ; ) {
+        struct mrpc_service_entry* e = *ent;
+        if( CAST(int,e->version - oldest) <= 0 ) {
+            *ent = e->retired;
+            free(e);
+        } else {
+            ent = &(e->retired);
         }
     }
 }
 
-struct mrpc_service*
-mrpc_service_create( size_t sz , size_t min_slp_time , size_t max_slp_time , void* opaque ) {
-    struct mrpc_service* ret = malloc(sizeof(*ret));
-
-    VERIFY(ret);
-    VERIFY(sz !=0);
-
-    mrpc_stbl_init(&ret->stable,sz);
-
-    ret->th_data = NULL;
-    ret->th_pool.handles = NULL;
-    ret->th_pool.th_sz = 0;
-
-    ret->udata = opaque;
-    ret->max_slp_tm = max_slp_time;
-    ret->min_slp_tm = min_slp_time;
-
+static
+int
+_mrpc_limiter_acquire( struct mrpc_service* service , struct mrpc_limiter* lm ) {
+    int ret = -1;
+    th_mutex_lock(&(service->lock));
+    if( lm->inflight < lm->limit ) {
+        ++lm->inflight;
+        ret = 0;
+    }
+    th_mutex_unlock(&(service->lock));
     return ret;
 }
 
-void mrpc_service_destroy( struct mrpc_service* service ) {
-    if( service->th_data != NULL ) {
-        free(service->th_data);
+/* The latency covers the queueing delay , so a backlog in front of the
+ * workers shrinks the limit as well. The estimated number of queued
+ * requests is limit * ( 1 - noload / latency ) */
+static
+void
+_mrpc_limiter_release( struct mrpc_service* service , struct mrpc_limiter* lm , int latency ) {
+    int queued;
+    /* the clock is in milliseconds , fast handlers take 0 */
+    ++latency;
+    th_mutex_lock(&(service->lock));
+    --lm->inflight;
+    if( ++lm->samples >= MRPC_LIMITER_PROBE ) {
+        lm->samples = 0;
+        lm->noload = -1;
     }
-    if( service->th_pool.th_sz != 0 ) {
-        th_pool_destroy(&(service->th_pool));
+    if( lm->noload < 0 || latency < lm->noload )
+        lm->noload = latency;
+    queued = lm->limit - lm->limit * lm->noload / latency;
+    if( queued < MRPC_LIMITER_ALPHA ) {
+        /* only grow when the limit is actually being used */
+        if( lm->inflight * 2 >= lm->limit && lm->limit < lm->max_limit )
+            ++lm->limit;
+    } else if( queued > MRPC_LIMITER_BETA ) {
+        if( lm->limit > lm->min_limit )
+            --lm->limit;
     }
-    mrpc_stbl_destroy(&(service->stable));
-    free(service);
+    th_mutex_unlock(&(service->lock));
 }
 
-int mrpc_service_add( struct mrpc_service* service , mrpc_service_cb cb , const char* method_name , void* udata ) {
-    return mrpc_stbl_insert( &(service->stable), cb , method_name , udata );
+/* Struct copy of a value , a short varchar points into its own buffer */
+static
+void
+_mrpc_val_rebase( struct mrpc_val* dst , const struct mrpc_val* src ) {
+    if( src->type == MRPC_VARCHAR && src->value.varchar.val == src->value.varchar.buf )
+        dst->value.varchar.val = dst->value.varchar.buf;
 }
 
-void mrpc_service_run_once( struct mrpc_service* service ) {
-    void* key;
-    struct mrpc_request req;
-    const struct mrpc_service_entry* func_entry;
-    if( mrpc_request_try_recv(&req,&key) == 0 ) {
-        /* look up the service and then start to execute */
-        func_entry = mrpc_stbl_query( &(service->stable), req.method_name );
-        if( func_entry == NULL ) {
+static
+void
+_mrpc_request_copy( struct mrpc_request* dst , const struct mrpc_request* src ) {
+    size_t i;
+    *dst = *src;
+    if( src->method == src->method_name )
+        dst->method = dst->method_name;
+    for( i = 0 ; i < src->par_size ; ++i )
+        _mrpc_val_rebase(dst->par+i,src->par+i);
+}
 
-            mrpc_response_send(
-                &req,
-                key,
-                NULL,
-                MRPC_EC_FUNCTION_NOT_FOUND);
+/* Switch back to the worker , it returns once the fiber is resumed */
+static
+void
+_mrpc_fiber_suspend( struct mrpc_fiber* f , int state ) {
+    f->state = state;
+#ifdef _WIN32
+    SwitchToFiber(f->th->sched);
+#else
+    swapcontext(&(f->ctx),&(f->th->sched));
+#endif /* _WIN32 */
+}
 
-        } else {
-            int error_code;
-            struct mrpc_val result;
-
-            func_entry->func(
-                service,
-                &req,
-                func_entry->udata,
-                &error_code,
-                &result);
-            /* sending the response to the MRPC out band queue */
-            mrpc_response_send(
-                &req,
-                key,
-                &result,
-                error_code);
-        }
+/* A fiber never returns , it is kept in the free list and runs the next
+ * method it is given from the top of the loop */
+static
+void
+_mrpc_fiber_main( struct mrpc_fiber* f ) {
+    for( ;; ) {
+        f->func(
+            f->service,
+            &(f->req),
+            f->udata,
+            &(f->error_code),
+            &(f->result));
+        _mrpc_fiber_suspend(f,FIBER_DONE);
     }
 }
 
-void mrpc_service_run( struct mrpc_service* service ) {
-    struct mrpc_service_th th;
-    th.service = service;
-    _mrpc_service_th_cb(&th);
+#ifdef _WIN32
+static
+void
+WINAPI
+_mrpc_fiber_entry( LPVOID p ) {
+    _mrpc_fiber_main(CAST(struct mrpc_fiber*,p));
+}
+#else
+/* makecontext only passes int arguments , the pointer is split into 2 */
+static
+void
+_mrpc_fiber_entry( unsigned int hi , unsigned int lo ) {
+    uintptr_t p = (CAST(uintptr_t,hi) << 16 << 16) | CAST(uintptr_t,lo);
+    _mrpc_fiber_main(CAST(struct mrpc_fiber*,p));
 }
+#endif /* _WIN32 */
 
-int mrpc_service_run_remote( struct mrpc_service* service, int thread_sz ) {
-    int i;
-    int created_sz;
-    int ret;
+static
+struct mrpc_fiber*
+_mrpc_fiber_alloc( struct mrpc_service* service ) {
+    struct mrpc_fiber* f;
+    th_mutex_lock(&(service->lock));
+    f = service->fibers;
+    if( f != NULL )
+        service->fibers = f->next;
+    th_mutex_unlock(&(service->lock));
+    if( f != NULL )
+        return f;
+
+    f = malloc(sizeof(*f));
+    VERIFY(f);
+    f->service = service;
+#ifdef _WIN32
+    f->stack = NULL;
+    f->ctx = CreateFiber(MRPC_FIBER_STACK_SIZE,_mrpc_fiber_entry,f);
+    VERIFY(f->ctx);
+#else
+    f->stack = malloc(MRPC_FIBER_STACK_SIZE);
+    VERIFY(f->stack);
+    getcontext(&(f->ctx));
+    f->ctx.uc_stack.ss_sp = f->stack;
+    f->ctx.uc_stack.ss_size = MRPC_FIBER_STACK_SIZE;
+    f->ctx.uc_link = NULL;
+    makecontext(&(f->ctx),CAST(void (*)(void),_mrpc_fiber_entry),2,
+                CAST(unsigned int,CAST(uintptr_t,f) >> 16 >> 16),
+                CAST(unsigned int,CAST(uintptr_t,f)));
+#endif /* _WIN32 */
+    return f;
+}
 
-    service->th_data = malloc(sizeof(*service->th_data)*thread_sz);
-    VERIFY(service->th_data);
-    for( i = 0 ; i < thread_sz ; ++i ) {
-        service->th_data[i].p.service = service;
-        service->th_data[i].cb = _mrpc_service_th_cb;
-        service->th_data[i].p.exit = 0;
-    }
+static
+void
+_mrpc_fiber_free( struct mrpc_service* service , struct mrpc_fiber* f ) {
+    th_mutex_lock(&(service->lock));
+    f->next = service->fibers;
+    service->fibers = f;
+    th_mutex_unlock(&(service->lock));
+}
 
-    ret=th_pool_create(&(service->th_pool),thread_sz,
-                   _mrpc_service_th_cb,
-                   service->th_data,
-                   &created_sz);
+/* The fiber the calling worker is running , NULL outside of a fiber. It is
+ * set by the worker around each switch , a parked fiber may be resumed by
+ * another worker */
+static th_local struct mrpc_fiber* MRPC_CURRENT_FIBER;
 
-    if( ret != 0 ) {
-        /* rollback to no thread creation status */
-        for( i = 0 ; i < created_sz ; ++i ) {
-            service->th_data[i].p.exit = 1;
-        }
-        th_pool_join(&(service->th_pool),created_sz);
-        return -1;
+/* Called on the IO thread , the fiber goes on with the first free worker */
+static
+void
+_mrpc_fiber_on_response( const struct mrpc_response* res , void* data ) {
+    struct mrpc_fiber* f = CAST(struct mrpc_fiber*,data);
+    if( res == NULL ) {
+        f->call->ret = -1;
+    } else {
+        *(f->call->res) = *res;
+        _mrpc_val_rebase(&(f->call->res->result),&(res->result));
+        f->call->ret = 0;
     }
+    mrpc_queue_post(f->queue,f);
+}
 
-    return 0;
+/* Run the fiber on the worker until it parks or finishes. The call is issued
+ * by the worker after the switch , so the response can't resume the fiber
+ * while its context is still being saved */
+static
+void
+_mrpc_fiber_resume( struct mrpc_service_th* th , struct mrpc_fiber* f ) {
+    struct mrpc_fiber_call* call;
+    for( ;; ) {
+        f->th = th;
+        MRPC_CURRENT_FIBER = f;
+#ifdef _WIN32
+        th->sched = IsThreadAFiber() ? GetCurrentFiber() : ConvertThreadToFiber(NULL);
+        SwitchToFiber(f->ctx);
+#else
+        swapcontext(&(th->sched),&(f->ctx));
+#endif /* _WIN32 */
+        MRPC_CURRENT_FIBER = NULL;
+        switch( f->state ) {
+        case FIBER_YIELD:
+            mrpc_queue_post(f->queue,f);
+            return;
+        case FIBER_CALL:
+            call = f->call;
+            if( mrpc_request_vasync(_mrpc_fiber_on_response,f,call->timeout,call->addr,
+                                    call->method_type,call->method_name,call->par_fmt,
+                                    *(call->args)) == 0 )
+                return;
+            call->ret = -1;
+            break;
+        default:
+            if( f->limiter != NULL )
+                _mrpc_limiter_release(f->service,f->limiter,mrpc_request_elapsed(&(f->req)));
+            mrpc_response_send(
+                &(f->req),
+                f->key,
+                &(f->result),
+                f->error_code);
+            _mrpc_fiber_free(f->service,f);
+            return;
+        }
+    }
 }
 
-int mrpc_service_quit( struct mrpc_service* service ) {
-    return th_pool_join(&(service->th_pool),service->th_pool.th_sz);
+/* The fiber running the request , NULL when the caller is not a fiber method */
+static
+struct mrpc_fiber*
+_mrpc_fiber_of( const struct mrpc_request* req ) {
+    struct mrpc_fiber* f = MRPC_CURRENT_FIBER;
+    return f != NULL && &(f->req) == req ? f : NULL;
+}
+
+static
+void
+mrpc_service_dispatch( struct mrpc_service* service , const struct mrpc_service_table* tbl ,
+                       const struct mrpc_request* req , void* key ,
+                       struct mrpc_service_th* th );
+
+/* Take the pending requests out of a batch , called with the lock held */
+static
+size_t
+_mrpc_batch_take( struct mrpc_batch* b , struct mrpc_request** reqs ,
+                  struct mrpc_batch_slot** slots ) {
+    size_t n = b->size;
+    *reqs = b->reqs;
+    *slots = b->slots;
+    b->reqs = malloc(sizeof(struct mrpc_request)*b->max);
+    VERIFY(b->reqs);
+    b->slots = malloc(sizeof(struct mrpc_batch_slot)*b->max);
+    VERIFY(b->slots);
+    b->size = 0;
+    return n;
+}
+
+static
+void
+_mrpc_batch_run( struct mrpc_service* service , const struct mrpc_service_entry* ent ,
+                 struct mrpc_request* reqs , struct mrpc_batch_slot* slots , size_t n ) {
+    int* ecs = malloc(sizeof(int)*n);
+    struct mrpc_val* results = malloc(sizeof(struct mrpc_val)*n);
+    size_t i;
+
+    VERIFY(ecs);
+    VERIFY(results);
+    ent->batch->func(service,reqs,n,ent->udata,ecs,results);
+    for( i = 0 ; i < n ; ++i ) {
+        if( slots[i].limiter != NULL )
+            _mrpc_limiter_release(service,slots[i].limiter,mrpc_request_elapsed(reqs+i));
+        mrpc_response_send(
+            reqs+i,
+            slots[i].key,
+            results+i,
+            ecs[i]);
+    }
+    free(results);
+    free(ecs);
+    free(reqs);
+    free(slots);
+}
+
+/* The worker that opened the batch serves its queue until the batch is full
+ * or the window of the oldest request is over. mrpc_service_run_once never
+ * blocks , it only takes the requests already queued and runs the batch once
+ * the queue is empty */
+static
+void
+_mrpc_batch_collect( struct mrpc_service_th* th , const struct mrpc_service_entry* ent ) {
+    struct mrpc_service* service = th->service;
+    struct mrpc_batch* b = ent->batch;
+    struct mrpc_request* reqs;
+    struct mrpc_batch_slot* slots;
+    size_t n;
+
+    for( ;; ) {
+        struct mrpc_request req;
+        void* key;
+        int left;
+        int ret;
+
+        th_mutex_lock(&(service->lock));
+        /* the batch is already taken since it got full */
+        if( b->size == 0 ) {
+            b->collecting = 0;
+            th_mutex_unlock(&(service->lock));
+            return;
+        }
+        left = b->window - mrpc_request_elapsed(b->reqs);
+        th_mutex_unlock(&(service->lock));
+        if( left <= 0 || th->exit )
+            break;
+
+        if( th->once ) {
+            ret = mrpc_request_try_recv(&req,&key);
+            if( ret < 0 )
+                break;
+        } else {
+            ret = th->queue == NULL ? mrpc_request_timed_recv(&req,&key,left) :
+                                      mrpc_queue_timed_recv(th->queue,&req,&key,left);
+        }
+        /* the worker is still in the table it took the batch from , see
+         * _mrpc_service_reclaim , so the one loaded here can't go away */
+        if( ret == 0 )
+            mrpc_service_dispatch(service,mrpc_service_table(service),&req,key,th);
+        else if( ret == 3 )
+            _mrpc_fiber_resume(th,CAST(struct mrpc_fiber*,key));
+        else if( ret == 1 )
+            /* run what is collected , the worker exits right after */
+            th->exit = 1;
+    }
+
+    th_mutex_lock(&(service->lock));
+    n = _mrpc_batch_take(b,&reqs,&slots);
+    b->collecting = 0;
+    th_mutex_unlock(&(service->lock));
+    if( n != 0 )
+        _mrpc_batch_run(service,ent,reqs,slots,n);
+    else {
+        free(reqs);
+        free(slots);
+    }
+}
+
+static
+void
+_mrpc_batch_add( struct mrpc_service* service , struct mrpc_service_th* th ,
+                 const struct mrpc_service_entry* ent , struct mrpc_limiter* limiter ,
+                 const struct mrpc_request* req , void* key ) {
+    struct mrpc_batch* b = ent->batch;
+    struct mrpc_request* reqs;
+    struct mrpc_batch_slot* slots;
+    size_t n = 0;
+    int collect = 0;
+
+    /* an inline executor has nothing to wait for , it runs its own request
+     * alone and leaves the batch shared by the workers untouched */
+    if( th == NULL ) {
+        reqs = malloc(sizeof(struct mrpc_request));
+        VERIFY(reqs);
+        slots = malloc(sizeof(struct mrpc_batch_slot));
+        VERIFY(slots);
+        _mrpc_request_copy(reqs,req);
+        slots[0].key = key;
+        slots[0].limiter = limiter;
+        _mrpc_batch_run(service,ent,reqs,slots,1);
+        return;
+    }
+
+    th_mutex_lock(&(service->lock));
+    _mrpc_request_copy(b->reqs + b->size,req);
+    b->slots[b->size].key = key;
+    b->slots[b->size].limiter = limiter;
+    ++b->size;
+    if( b->size == b->max )
+        n = _mrpc_batch_take(b,&reqs,&slots);
+    else if( !b->collecting )
+        collect = b->collecting = 1;
+    th_mutex_unlock(&(service->lock));
+
+    if( n != 0 )
+        _mrpc_batch_run(service,ent,reqs,slots,n);
+    else if( collect )
+        _mrpc_batch_collect(th,ent);
+}
+
+/* Look up the request and execute it , the response is always sent back. The
+ * th is NULL for an inline or a core executor */
+static
+void
+mrpc_service_dispatch( struct mrpc_service* service , const struct mrpc_service_table* tbl ,
+                       const struct mrpc_request* req , void* key ,
+                       struct mrpc_service_th* th ) {
+    const struct mrpc_service_entry* func_entry;
+
+    /* the caller has given up already , don't waste the execution */
+    if( mrpc_request_expired(req) ) {
+        mrpc_response_send(
+            req,
+            key,
+            NULL,
+            MRPC_EC_DEADLINE_EXCEEDED);
+        return;
+    }
+
+    /* look up the service and then start to execute */
+    if( req->method_id >= 0 ) {
+        func_entry = CAST(size_t,req->method_id) < tbl->id_sz ? tbl->ids[req->method_id] : NULL;
+    } else {
+        func_entry = mrpc_stbl_query_h(tbl,req->method,req->method_name_len,req->method_hash);
+    }
+    if( func_entry == NULL ) {
+
+        mrpc_response_send(
+            req,
+            key,
+            NULL,
+            MRPC_EC_FUNCTION_NOT_FOUND);
+
+    } else if( th == NULL && ( func_entry->async_func != NULL || func_entry->fiber ) ) {
+
+        /* a deferred completion has no way back to an inline executor */
+        mrpc_response_send(
+            req,
+            key,
+            NULL,
+            MRPC_EC_FUNCTION_NOT_SUPPORTED);
+
+    } else {
+        int error_code;
+        struct mrpc_val result;
+
+        /* an inline executor runs one request at a time , the limiter has
+         * nothing to bound there and taking it would share service->lock */
+        if( th != NULL && func_entry->limiter != NULL &&
+            _mrpc_limiter_acquire(service,func_entry->limiter) != 0 ) {
+            mrpc_response_send(
+                req,
+                key,
+                NULL,
+                MRPC_EC_OVERLOADED);
+            return;
+        }
+
+        if( func_entry->async_func != NULL ) {
+            struct mrpc_service_token* token = malloc(sizeof(*token));
+            VERIFY(token);
+            token->service = service;
+            _mrpc_request_copy(&(token->req),req);
+            token->key = key;
+            token->limiter = func_entry->limiter;
+            func_entry->async_func(service,&(token->req),func_entry->udata,token);
+            return;
+        }
+
+        if( func_entry->batch != NULL ) {
+            _mrpc_batch_add(service,th,func_entry,th != NULL ? func_entry->limiter : NULL,req,key);
+            return;
+        }
+
+        if( func_entry->fiber ) {
+            struct mrpc_fiber* f = _mrpc_fiber_alloc(service);
+            _mrpc_request_copy(&(f->req),req);
+            f->func = func_entry->func;
+            f->udata = func_entry->udata;
+            f->limiter = func_entry->limiter;
+            f->key = key;
+            f->queue = th->queue;
+            _mrpc_fiber_resume(th,f);
+            return;
+        }
+
+        func_entry->func(
+            service,
+            req,
+            func_entry->udata,
+            &error_code,
+            &result);
+
+        if( th != NULL && func_entry->limiter != NULL )
+            _mrpc_limiter_release(service,func_entry->limiter,mrpc_request_elapsed(req));
+        /* sending the response to the MRPC out band queue */
+        mrpc_response_send(
+            req,
+            key,
+            &result,
+            error_code);
+    }
+}
+
+/* Spawn one more worker of the elastic pool when there is a free slot */
+static
+void
+_mrpc_service_grow( struct mrpc_service* service ) {
+    size_t i;
+    th_mutex_lock(&(service->lock));
+    if( !service->quit && CAST(size_t,service->th_live) < service->th_pool.th_sz ) {
+        for( i = 0 ; i < service->th_pool.th_sz ; ++i ) {
+            struct th_data* d = service->th_data + i;
+            if( d->p.state == TH_SLOT_RUNNING )
+                continue;
+            if( d->p.state == TH_SLOT_EXITED )
+                th_pool_join_one(&(service->th_pool),i);
+            d->p.state = TH_SLOT_RUNNING;
+            if( th_pool_spawn(&(service->th_pool),i,d) != 0 ) {
+                d->p.state = TH_SLOT_EMPTY;
+            } else {
+                ++service->th_live;
+            }
+            break;
+        }
+    }
+    th_mutex_unlock(&(service->lock));
+}
+
+/* Return 1 if the idle worker should exit */
+static
+int
+_mrpc_service_retire( struct mrpc_service* service , struct mrpc_service_th* th ) {
+    int ret = 0;
+    th_mutex_lock(&(service->lock));
+    if( service->th_live > service->th_min ) {
+        --service->th_live;
+        th->state = TH_SLOT_EXITED;
+        ret = 1;
+    }
+    th_mutex_unlock(&(service->lock));
+    return ret;
+}
+
+/* Thread creation is typically a memory barrier , so after creating thread
+ * all the data that is visible to this thread, but not including the data
+ * modification happens right after the thread creation */
+
+static
+void
+_mrpc_service_th_cb( void* par ) {
+    struct mrpc_service_th* th = CAST( struct mrpc_service_th* , par );
+    while(!th->exit) {
+        void* key;
+        struct mrpc_request req;
+        int ret;
+
+        if( th->elastic ) {
+            ret = mrpc_request_timed_recv(&req,&key,CAST(int,th->service->max_slp_tm));
+            if( ret == 2 ) {
+                if( _mrpc_service_retire(th->service,th) )
+                    return;
+                continue;
+            }
+        } else {
+            ret = th->queue == NULL ? mrpc_request_recv(&req,&key) :
+                                      mrpc_queue_recv(th->queue,&req,&key);
+        }
+
+        if( ret <0 )
+            continue;
+
+        /* when we get the notification that MRPC is interrupted, we just
+         * return from the thread callback and user needs to call mrpc_service_quit
+         * to join all the allocated thread */
+
+        else if( ret == 1 )
+            return;
+
+        /* a parked fiber is ready to go on */
+        else if( ret == 3 ) {
+            th_mutex_lock(&(th->state_lock));
+            _mrpc_fiber_resume(th,CAST(struct mrpc_fiber*,key));
+            th_mutex_unlock(&(th->state_lock));
+            continue;
+        }
+
+        /* the workers fall behind , call for help */
+        if( th->elastic && mrpc_request_elapsed(&req) > CAST(int,th->service->min_slp_tm) )
+            _mrpc_service_grow(th->service);
+
+        /* the handlers touch the state of this worker */
+        th_mutex_lock(&(th->state_lock));
+        mrpc_service_dispatch(th->service,_mrpc_service_enter(th->service,&(th->reader)),&req,key,th);
+        _mrpc_service_leave(th->service,&(th->reader));
+        th_mutex_unlock(&(th->state_lock));
+
+        /* free what is retired on the way , a busy lock means it is being done */
+        if( th->service->retired != NULL && th_mutex_trylock(&(th->service->lock)) == 0 ) {
+            _mrpc_service_reclaim(th->service);
+            th_mutex_unlock(&(th->service->lock));
+        }
+    }
+}
+
+/* Pin the calling thread to the service CPUs , a core thread takes a
+ * single CPU out of them by its index */
+static
+void
+_mrpc_service_pin( struct mrpc_service* service , const struct mrpc_service_core* core ) {
+    int io_cpus[MRPC_MAX_AFFINITY_CPU];
+    const int* cpus = service->cpus;
+    size_t n = service->cpu_sz;
+
+    if( service->follow_io ) {
+        n = mrpc_get_io_affinity(io_cpus,MRPC_MAX_AFFINITY_CPU);
+        cpus = io_cpus;
+    }
+    if( n == 0 )
+        return;
+    if( core != NULL )
+        mrpc_set_thread_affinity(cpus + core->index % n,1);
+    else
+        mrpc_set_thread_affinity(cpus,n);
+}
+
+/* Create the worker state on its own thread and make it the state of the thread */
+static
+void
+_mrpc_service_state_enter( struct mrpc_service_th* th ) {
+    struct mrpc_service* service = th->service;
+    th_mutex_lock(&(th->state_lock));
+    if( service->state_init != NULL && th->local == NULL )
+        th->local = service->state_init(service,service->state_data);
+    th_mutex_unlock(&(th->state_lock));
+    th_key_set(service->state_key,th->local);
+}
+
+/* Entry of the threads started by the service */
+static
+void
+_mrpc_service_worker_cb( void* par ) {
+    struct mrpc_service_th* th = CAST( struct mrpc_service_th* , par );
+    /* pin before anything is touched so the stack pages land on the local node */
+    _mrpc_service_pin(th->service,NULL);
+    _mrpc_service_state_enter(th);
+    _mrpc_service_th_cb(par);
+}
+
+/* Rebuild the replica of a core once the service table is updated , it is
+ * built on the core thread so it lives on the memory local to it */
+static
+void
+_mrpc_service_core_sync( struct mrpc_service_core* core ) {
+    unsigned int version = core->service->version;
+    const struct mrpc_service_table* tbl;
+    if( core->stable != NULL && core->version == version )
+        return;
+    /* the replica copies the entries , they are freed with the service table */
+    tbl = _mrpc_service_enter(core->service,NULL);
+    if( core->stable != NULL )
+        mrpc_stbl_destroy_all(core->stable);
+    core->stable = mrpc_stbl_replica(tbl);
+    _mrpc_service_leave(core->service,NULL);
+    core->version = version;
+}
+
+static
+void
+_mrpc_service_core_exec( const struct mrpc_request* req , void* key , void* udata ) {
+    struct mrpc_service_core* core = CAST(struct mrpc_service_core*,udata);
+    struct mrpc_service_th* th = &(core->service->core_th_data[core->index].p);
+    _mrpc_service_core_sync(core);
+    th_mutex_lock(&(th->state_lock));
+    mrpc_service_dispatch(core->service,core->stable,req,key,NULL);
+    th_mutex_unlock(&(th->state_lock));
+}
+
+static
+void
+_mrpc_service_core_cb( void* par ) {
+    struct mrpc_service_th* th = CAST( struct mrpc_service_th* , par );
+    _mrpc_service_pin(th->service,th->core);
+    _mrpc_service_state_enter(th);
+    _mrpc_service_core_sync(th->core);
+    mrpc_core_run(th->core->core);
+}
+
+struct mrpc_service*
+mrpc_service_create( size_t sz , size_t min_slp_time , size_t max_slp_time , void* opaque ) {
+    struct mrpc_service* ret = malloc(sizeof(*ret));
+
+    VERIFY(ret);
+    VERIFY(sz !=0);
+
+    ret->stable = mrpc_stbl_create(1);
+    ret->retired = NULL;
+    ret->retired_entries = NULL;
+    ret->readers = NULL;
+    ret->guests = 0;
+    ret->limiters = NULL;
+    ret->batches = NULL;
+    ret->stable_cap = sz;
+    ret->version = 1;
+
+    ret->th_data = NULL;
+    ret->th_pool.handles = NULL;
+    ret->th_pool.th_sz = 0;
+    ret->pools = NULL;
+    th_mutex_init(&(ret->lock));
+    ret->th_live = 0;
+    ret->th_min = 0;
+    ret->quit = 0;
+    ret->cpu_sz = 0;
+    ret->follow_io = 0;
+    ret->cores = NULL;
+    ret->core_sz = 0;
+    ret->core_th_data = NULL;
+    ret->core_th_pool.handles = NULL;
+    ret->core_th_pool.th_sz = 0;
+
+    ret->udata = opaque;
+    ret->max_slp_tm = max_slp_time;
+    ret->min_slp_tm = min_slp_time;
+    ret->fibers = NULL;
+    ret->th_queues = NULL;
+    ret->th_queue_sz = 0;
+    ret->state_init = NULL;
+    ret->state_destroy = NULL;
+    ret->state_data = NULL;
+    VERIFY(th_key_create(&(ret->state_key)) == 0);
+
+    return ret;
+}
+
+static
+void
+_mrpc_service_th_data_free( struct th_data* th_data , size_t th_sz ) {
+    size_t i;
+    if( th_data == NULL )
+        return;
+    for( i = 0 ; i < th_sz ; ++i )
+        th_mutex_delete(&(th_data[i].p.state_lock));
+    free(th_data);
+}
+
+void mrpc_service_destroy( struct mrpc_service* service ) {
+    size_t i;
+    if( service->state_destroy != NULL )
+        mrpc_service_foreach_state(service,service->state_destroy,service->state_data);
+    th_key_delete(service->state_key);
+    for( i = 0 ; i < service->core_sz ; ++i ) {
+        if( service->cores[i].stable != NULL )
+            mrpc_stbl_destroy_all(service->cores[i].stable);
+    }
+    free(service->cores);
+    _mrpc_service_th_data_free(service->core_th_data,service->core_sz);
+    if( service->core_th_pool.th_sz != 0 )
+        th_pool_destroy(&(service->core_th_pool));
+    while( service->retired_entries != NULL ) {
+        struct mrpc_service_entry* ent = service->retired_entries;
+        service->retired_entries = ent->retired;
+        free(ent);
+    }
+    while( service->limiters != NULL ) {
+        struct mrpc_limiter* lm = service->limiters;
+        service->limiters = lm->next;
+        free(lm);
+    }
+    while( service->batches != NULL ) {
+        struct mrpc_batch* b = service->batches;
+        service->batches = b->next;
+        free(b->reqs);
+        free(b->slots);
+        free(b);
+    }
+    while( service->retired != NULL ) {
+        struct mrpc_service_table* tbl = service->retired;
+        service->retired = tbl->retired;
+        mrpc_stbl_destroy(tbl);
+    }
+    th_mutex_delete(&(service->lock));
+    while( service->fibers != NULL ) {
+        struct mrpc_fiber* f = service->fibers;
+        service->fibers = f->next;
+#ifdef _WIN32
+        DeleteFiber(f->ctx);
+#else
+        free(f->stack);
+#endif /* _WIN32 */
+        free(f);
+    }
+    while( service->pools != NULL ) {
+        struct mrpc_service_pool* pool = service->pools;
+        service->pools = pool->next;
+        _mrpc_service_th_data_free(pool->th_data,pool->th_pool.th_sz);
+        free(pool->th_queues);
+        if( pool->th_pool.th_sz != 0 )
+            th_pool_destroy(&(pool->th_pool));
+        free(pool);
+    }
+    _mrpc_service_th_data_free(service->th_data,service->th_pool.th_sz);
+    free(service->th_queues);
+    if( service->th_pool.th_sz != 0 ) {
+        th_pool_destroy(&(service->th_pool));
+    }
+    mrpc_stbl_destroy_all(service->stable);
+    free(service);
+}
+
+/* Publish a new table in place of the old one , called with the lock held.
+ * The old table and the entry it replaces , if any , are retired and freed
+ * once no reader can see them , see _mrpc_service_reclaim */
+static
+void
+_mrpc_service_publish( struct mrpc_service* service , struct mrpc_service_table* tbl ,
+                       const struct mrpc_service_entry* replaced ) {
+    struct mrpc_service_table* old = service->stable;
+    /* the table is complete before it can be seen */
+    th_barrier();
+    service->stable = tbl;
+    th_barrier();
+    if( ++service->version == 0 )
+        service->version = 1;
+    old->version = service->version;
+    old->retired = service->retired;
+    service->retired = old;
+    if( replaced != NULL ) {
+        struct mrpc_service_entry* ent = CAST(struct mrpc_service_entry*,replaced);
+        ent->version = service->version;
+        ent->retired = service->retired_entries;
+        service->retired_entries = ent;
+    }
+    _mrpc_service_reclaim(service);
+}
+
+static
+struct mrpc_service_entry*
+_mrpc_service_entry_create( mrpc_service_cb cb , const char* method_name , void* udata ) {
+    struct mrpc_service_entry* ent;
+    size_t len = strlen(method_name);
+
+    if( len >= MRPC_MAX_METHOD_NAME_LEN )
+        return NULL;
+    ent = malloc(sizeof(*ent));
+    VERIFY(ent);
+    strcpy(ent->method_name,method_name);
+    ent->method_name_len = len;
+    ent->hash = mrpc_hash(method_name,len);
+    ent->id = -1;
+    ent->func = cb;
+    ent->udata = udata;
+    ent->priority = MRPC_PRIORITY_NORMAL;
+    ent->pool = NULL;
+    ent->limiter = NULL;
+    ent->inline_exec = 0;
+    ent->async_func = NULL;
+    ent->fiber = 0;
+    ent->batch = NULL;
+    ent->key_par = -1;
+    ent->view = 0;
+    ent->lazy = 0;
+    ent->version = 0;
+    ent->retired = NULL;
+    return ent;
+}
+
+/* The entry is owned by the service once it is added , it fails if the method
+ * is there already */
+static
+int
+_mrpc_service_insert( struct mrpc_service* service , struct mrpc_service_entry* ent ) {
+    th_mutex_lock(&(service->lock));
+    if( mrpc_stbl_query_h(service->stable,ent->method_name,ent->method_name_len,ent->hash) != NULL ) {
+        th_mutex_unlock(&(service->lock));
+        return -1;
+    }
+    ent->id = mrpc_method_id(ent->method_name);
+    if( ent->batch != NULL ) {
+        ent->batch->next = service->batches;
+        service->batches = ent->batch;
+    }
+    _mrpc_service_publish(service,
+        mrpc_stbl_rebuild(service->stable,ent,NULL,service->stable_cap),NULL);
+    th_mutex_unlock(&(service->lock));
+    return 0;
+}
+
+int mrpc_service_add( struct mrpc_service* service , mrpc_service_cb cb , const char* method_name , void* udata ) {
+    struct mrpc_service_entry* ent = _mrpc_service_entry_create(cb,method_name,udata);
+    if( ent == NULL )
+        return -1;
+    if( _mrpc_service_insert(service,ent) != 0 ) {
+        free(ent);
+        return -1;
+    }
+    return 0;
+}
+
+int mrpc_service_remove( struct mrpc_service* service , const char* method_name ) {
+    const struct mrpc_service_entry* ent;
+    th_mutex_lock(&(service->lock));
+    ent = mrpc_stbl_query(service->stable,method_name);
+    if( ent != NULL ) {
+        _mrpc_service_publish(service,
+            mrpc_stbl_rebuild(service->stable,NULL,ent,service->stable_cap),ent);
+    }
+    th_mutex_unlock(&(service->lock));
+    return ent == NULL ? -1 : 0;
+}
+
+/* The options of a published entry are never changed in place , the readers
+ * don't lock. A setter edits a copy of the entry , which is published in a new
+ * table by _mrpc_service_commit , the requests being served go on with the
+ * old one. The copy is returned with the lock held , or NULL without the lock
+ * when there is no such method */
+static
+struct mrpc_service_entry*
+_mrpc_service_edit( struct mrpc_service* service , const char* method_name ,
+                    const struct mrpc_service_entry** old ) {
+    struct mrpc_service_entry* ent;
+    th_mutex_lock(&(service->lock));
+    *old = mrpc_stbl_query(service->stable,method_name);
+    if( *old == NULL ) {
+        th_mutex_unlock(&(service->lock));
+        return NULL;
+    }
+    ent = malloc(sizeof(*ent));
+    VERIFY(ent);
+    *ent = **old;
+    return ent;
+}
+
+/* Publish the edited copy in place of old and release the lock */
+static
+void
+_mrpc_service_commit( struct mrpc_service* service , struct mrpc_service_entry* ent ,
+                      const struct mrpc_service_entry* old ) {
+    _mrpc_service_publish(service,
+        mrpc_stbl_rebuild(service->stable,ent,old,service->stable_cap),old);
+    th_mutex_unlock(&(service->lock));
+}
+
+int mrpc_service_add_async( struct mrpc_service* service , mrpc_service_async_cb cb , const char* method_name , void* udata ) {
+    struct mrpc_service_entry* ent = _mrpc_service_entry_create(NULL,method_name,udata);
+    if( ent == NULL )
+        return -1;
+    ent->async_func = cb;
+    if( _mrpc_service_insert(service,ent) != 0 ) {
+        free(ent);
+        return -1;
+    }
+    return 0;
+}
+
+void mrpc_service_complete( struct mrpc_service_token* token , const struct mrpc_val* result , int error_code ) {
+    if( token->limiter != NULL )
+        _mrpc_limiter_release(token->service,token->limiter,mrpc_request_elapsed(&(token->req)));
+    if( token->req.method_type == MRPC_NOTIFICATION )
+        mrpc_response_done(token->key);
+    else
+        mrpc_response_send(&(token->req),token->key,result,error_code);
+    free(token);
+}
+
+int mrpc_service_add_batch( struct mrpc_service* service , mrpc_service_batch_cb cb , const char* method_name ,
+                            size_t max_batch , int window , void* udata ) {
+    struct mrpc_service_entry* ent;
+    struct mrpc_batch* b;
+    if( max_batch == 0 || window < 0 )
+        return -1;
+    ent = _mrpc_service_entry_create(NULL,method_name,udata);
+    if( ent == NULL )
+        return -1;
+    b = malloc(sizeof(*b));
+    VERIFY(b);
+    b->func = cb;
+    b->max = max_batch;
+    b->window = window;
+    b->size = 0;
+    b->collecting = 0;
+    b->reqs = malloc(sizeof(struct mrpc_request)*max_batch);
+    VERIFY(b->reqs);
+    b->slots = malloc(sizeof(struct mrpc_batch_slot)*max_batch);
+    VERIFY(b->slots);
+    ent->batch = b;
+    if( _mrpc_service_insert(service,ent) != 0 ) {
+        free(b->reqs);
+        free(b->slots);
+        free(b);
+        free(ent);
+        return -1;
+    }
+    return 0;
+}
+
+int mrpc_service_add_fiber( struct mrpc_service* service , mrpc_service_cb cb , const char* method_name , void* udata ) {
+    struct mrpc_service_entry* ent = _mrpc_service_entry_create(cb,method_name,udata);
+    if( ent == NULL )
+        return -1;
+    ent->fiber = 1;
+    if( _mrpc_service_insert(service,ent) != 0 ) {
+        free(ent);
+        return -1;
+    }
+    return 0;
+}
+
+int mrpc_service_fiber_request( const struct mrpc_request* req , struct mrpc_response* res ,
+                                int timeout , const char* addr , int method_type ,
+                                const char* method_name , const char* par_fmt , ... ) {
+    struct mrpc_fiber* f = _mrpc_fiber_of(req);
+    struct mrpc_fiber_call call;
+    va_list vlist;
+
+    if( f == NULL )
+        return -1;
+    va_start(vlist,par_fmt);
+    call.res = res;
+    call.timeout = timeout;
+    call.addr = addr;
+    call.method_type = method_type;
+    call.method_name = method_name;
+    call.par_fmt = par_fmt;
+    call.args = &vlist;
+    f->call = &call;
+    _mrpc_fiber_suspend(f,FIBER_CALL);
+    va_end(vlist);
+    return call.ret;
+}
+
+void mrpc_service_fiber_yield( const struct mrpc_request* req ) {
+    struct mrpc_fiber* f = _mrpc_fiber_of(req);
+    if( f != NULL )
+        _mrpc_fiber_suspend(f,FIBER_YIELD);
+}
+
+static
+void
+_mrpc_service_inline( const struct mrpc_request* req , void* key , void* udata ) {
+    struct mrpc_service* service = CAST(struct mrpc_service*,udata);
+    mrpc_service_dispatch(service,_mrpc_service_enter(service,NULL),req,key,NULL);
+    _mrpc_service_leave(service,NULL);
+}
+
+/* Router installed into MRPC once a method has a non default route. It runs
+ * on the IO thread as a guest reader of the table */
+static
+void
+_mrpc_service_route( const char* method_name , size_t len , struct mrpc_route* route , void* udata ) {
+    struct mrpc_service* service = CAST(struct mrpc_service*,udata);
+    const struct mrpc_service_entry* ent =
+        mrpc_stbl_query_h(_mrpc_service_enter(service,NULL),method_name,len,route->method_hash);
+    struct mrpc_queue** queues = service->th_queues;
+    size_t queue_sz = service->th_queue_sz;
+    if( ent != NULL ) {
+        route->lane = ent->priority;
+        if( ent->pool != NULL ) {
+            route->queue = ent->pool->queue;
+            queues = ent->pool->th_queues;
+            queue_sz = ent->pool->th_queue_sz;
+        }
+        if( ent->inline_exec ) {
+            route->exec = _mrpc_service_inline;
+            route->exec_data = service;
+        }
+        route->view = ent->view;
+        route->lazy = ent->lazy;
+    }
+    /* the threads of the pool don't share a queue , an unkeyed request goes to
+     * the shortest one */
+    if( queue_sz != 0 ) {
+        if( ent != NULL && ent->key_par >= 0 ) {
+            route->key_par = ent->key_par;
+            route->key_queues = queues;
+            route->key_queue_sz = queue_sz;
+        } else {
+            size_t i;
+            size_t min_sz = mrpc_queue_size(queues[0]);
+            route->queue = queues[0];
+            for( i = 1 ; i < queue_sz && min_sz != 0 ; ++i ) {
+                size_t sz = mrpc_queue_size(queues[i]);
+                if( sz < min_sz ) {
+                    min_sz = sz;
+                    route->queue = queues[i];
+                }
+            }
+        }
+    }
+    _mrpc_service_leave(service,NULL);
+}
+
+int mrpc_service_set_priority( struct mrpc_service* service , const char* method_name , int priority ) {
+    const struct mrpc_service_entry* old;
+    struct mrpc_service_entry* ent;
+    if( priority < 0 || priority >= MRPC_PRIORITY_SIZE )
+        return -1;
+    ent = _mrpc_service_edit(service,method_name,&old);
+    if( ent == NULL )
+        return -1;
+    ent->priority = priority;
+    _mrpc_service_commit(service,ent,old);
+    mrpc_set_router(_mrpc_service_route,service);
+    return 0;
+}
+
+int mrpc_service_add_pool( struct mrpc_service* service , const char* pool_name , int thread_sz ) {
+    struct mrpc_service_pool* pool;
+    if( thread_sz <= 0 || strlen(pool_name) >= MRPC_MAX_METHOD_NAME_LEN )
+        return -1;
+    for( pool = service->pools ; pool != NULL ; pool = pool->next ) {
+        if( strcmp(pool->name,pool_name) == 0 )
+            return -1;
+    }
+    pool = malloc(sizeof(*pool));
+    VERIFY(pool);
+    strcpy(pool->name,pool_name);
+    pool->queue = mrpc_queue_create();
+    pool->thread_sz = thread_sz;
+    pool->th_data = NULL;
+    pool->th_pool.handles = NULL;
+    pool->th_pool.th_sz = 0;
+    pool->th_queues = NULL;
+    pool->th_queue_sz = 0;
+    pool->next = service->pools;
+    service->pools = pool;
+    return 0;
+}
+
+int mrpc_service_bind_pool( struct mrpc_service* service , const char* method_name , const char* pool_name ) {
+    const struct mrpc_service_entry* old;
+    struct mrpc_service_entry* ent;
+    struct mrpc_service_pool* pool;
+    for( pool = service->pools ; pool != NULL ; pool = pool->next ) {
+        if( strcmp(pool->name,pool_name) == 0 )
+            break;
+    }
+    if( pool == NULL )
+        return -1;
+    ent = _mrpc_service_edit(service,method_name,&old);
+    if( ent == NULL )
+        return -1;
+    ent->pool = pool;
+    _mrpc_service_commit(service,ent,old);
+    mrpc_set_router(_mrpc_service_route,service);
+    return 0;
+}
+
+int mrpc_service_set_limiter( struct mrpc_service* service , const char* method_name , int min_limit , int max_limit ) {
+    const struct mrpc_service_entry* old;
+    struct mrpc_service_entry* ent;
+    struct mrpc_limiter* lm;
+    if( min_limit <= 0 || max_limit < min_limit )
+        return -1;
+    ent = _mrpc_service_edit(service,method_name,&old);
+    if( ent == NULL )
+        return -1;
+    /* a new one , the requests holding the old limiter release it */
+    lm = malloc(sizeof(*lm));
+    VERIFY(lm);
+    lm->min_limit = min_limit;
+    lm->max_limit = max_limit;
+    lm->limit = MAX(min_limit,MIN(max_limit,MRPC_LIMITER_INITIAL));
+    lm->inflight = 0;
+    lm->noload = -1;
+    lm->samples = 0;
+    lm->next = service->limiters;
+    service->limiters = lm;
+    ent->limiter = lm;
+    _mrpc_service_commit(service,ent,old);
+    return 0;
+}
+
+int mrpc_service_get_limit( struct mrpc_service* service , const char* method_name ) {
+    const struct mrpc_service_entry* ent;
+    int ret = -1;
+    th_mutex_lock(&(service->lock));
+    ent = mrpc_stbl_query(service->stable,method_name);
+    if( ent != NULL && ent->limiter != NULL )
+        ret = ent->limiter->limit;
+    th_mutex_unlock(&(service->lock));
+    return ret;
+}
+
+int mrpc_service_set_key_affinity( struct mrpc_service* service , const char* method_name , int par_index ) {
+    const struct mrpc_service_entry* old;
+    struct mrpc_service_entry* ent;
+    if( par_index < 0 || par_index >= MRPC_MAX_PARAMETER_SIZE )
+        return -1;
+    ent = _mrpc_service_edit(service,method_name,&old);
+    if( ent == NULL )
+        return -1;
+    ent->key_par = par_index;
+    _mrpc_service_commit(service,ent,old);
+    mrpc_set_router(_mrpc_service_route,service);
+    return 0;
+}
+
+int mrpc_service_set_view( struct mrpc_service* service , const char* method_name ) {
+    const struct mrpc_service_entry* old;
+    struct mrpc_service_entry* ent = _mrpc_service_edit(service,method_name,&old);
+    if( ent == NULL )
+        return -1;
+    ent->view = 1;
+    _mrpc_service_commit(service,ent,old);
+    mrpc_set_router(_mrpc_service_route,service);
+    return 0;
+}
+
+int mrpc_service_set_lazy( struct mrpc_service* service , const char* method_name ) {
+    const struct mrpc_service_entry* old;
+    struct mrpc_service_entry* ent = _mrpc_service_edit(service,method_name,&old);
+    if( ent == NULL )
+        return -1;
+    ent->lazy = 1;
+    _mrpc_service_commit(service,ent,old);
+    mrpc_set_router(_mrpc_service_route,service);
+    return 0;
+}
+
+int mrpc_service_set_affinity( struct mrpc_service* service , const int* cpus , size_t n ) {
+    size_t i;
+    if( cpus == NULL ) {
+        service->follow_io = 1;
+        return 0;
+    }
+    if( n == 0 || n > MRPC_MAX_AFFINITY_CPU )
+        return -1;
+    for( i = 0 ; i < n ; ++i ) {
+        if( cpus[i] < 0 )
+            return -1;
+    }
+    memcpy(service->cpus,cpus,sizeof(int)*n);
+    service->cpu_sz = n;
+    service->follow_io = 0;
+    return 0;
+}
+
+int mrpc_service_set_inline( struct mrpc_service* service , const char* method_name ) {
+    const struct mrpc_service_entry* old;
+    struct mrpc_service_entry* ent = _mrpc_service_edit(service,method_name,&old);
+    if( ent == NULL )
+        return -1;
+    if( ent->async_func != NULL || ent->fiber ) {
+        free(ent);
+        th_mutex_unlock(&(service->lock));
+        return -1;
+    }
+    ent->inline_exec = 1;
+    _mrpc_service_commit(service,ent,old);
+    mrpc_set_router(_mrpc_service_route,service);
+    return 0;
+}
+
+void mrpc_service_run_once( struct mrpc_service* service ) {
+    void* key;
+    struct mrpc_request req;
+    struct mrpc_service_th th;
+    int ret = mrpc_request_try_recv(&req,&key);
+    th.service = service;
+    th.queue = NULL;
+    th.exit = 0;
+    th.elastic = 0;
+    th.once = 1;
+    th.local = NULL;
+    if( ret == 0 ) {
+        mrpc_service_dispatch(service,_mrpc_service_enter(service,NULL),&req,key,&th);
+        _mrpc_service_leave(service,NULL);
+    } else if( ret == 3 )
+        _mrpc_fiber_resume(&th,CAST(struct mrpc_fiber*,key));
+}
+
+void mrpc_service_run( struct mrpc_service* service ) {
+    struct mrpc_service_th th;
+    th.service = service;
+    th.queue = NULL;
+    th.exit = 0;
+    th.elastic = 0;
+    th.once = 0;
+    th.local = NULL;
+    th_mutex_init(&(th.state_lock));
+    _mrpc_service_register(service,&(th.reader));
+    _mrpc_service_state_enter(&th);
+    _mrpc_service_th_cb(&th);
+    _mrpc_service_unregister(service,&(th.reader));
+    /* the caller keeps its thread , the state goes away with it */
+    if( th.local != NULL && service->state_destroy != NULL )
+        service->state_destroy(service,th.local,service->state_data);
+    th_key_set(service->state_key,NULL);
+    th_mutex_delete(&(th.state_lock));
+}
+
+/* A pool having a key affine method gets a queue per thread , NULL otherwise.
+ * The first thread keeps the queue of the pool ( NULL is the default one ) ,
+ * it is where the frames bypassing the router , like a broken one , and the
+ * other users of that queue end up , so it never goes without a consumer */
+static
+struct mrpc_queue**
+_mrpc_service_key_queues( struct mrpc_service* service , const struct mrpc_service_pool* pool ,
+                          int thread_sz ) {
+    const struct mrpc_service_table* tbl;
+    struct mrpc_queue** queues;
+    size_t i;
+    int j;
+    th_mutex_lock(&(service->lock));
+    tbl = service->stable;
+    for( i = 0 ; i < tbl->cap ; ++i ) {
+        const struct mrpc_service_entry* ent = tbl->slots[i];
+        if( ent != NULL && ent->key_par >= 0 && ent->pool == pool )
+            break;
+    }
+    th_mutex_unlock(&(service->lock));
+    if( i == tbl->cap )
+        return NULL;
+    queues = malloc(sizeof(struct mrpc_queue*)*thread_sz);
+    VERIFY(queues);
+    queues[0] = pool != NULL ? pool->queue : NULL;
+    for( j = 1 ; j < thread_sz ; ++j )
+        queues[j] = mrpc_queue_create();
+    return queues;
+}
+
+static
+int
+_mrpc_service_spawn( struct mrpc_service* service , struct th_pool* th_pool ,
+                     struct th_data** th_data , int thread_sz , struct mrpc_queue* queue ,
+                     struct mrpc_queue** th_queues ) {
+    int i;
+    int created_sz;
+    int ret;
+
+    *th_data = malloc(sizeof(**th_data)*thread_sz);
+    VERIFY(*th_data);
+    for( i = 0 ; i < thread_sz ; ++i ) {
+        (*th_data)[i].p.service = service;
+        (*th_data)[i].p.queue = th_queues != NULL ? th_queues[i] : queue;
+        (*th_data)[i].p.elastic = 0;
+        (*th_data)[i].p.once = 0;
+        (*th_data)[i].p.local = NULL;
+        th_mutex_init(&((*th_data)[i].p.state_lock));
+        _mrpc_service_register(service,&((*th_data)[i].p.reader));
+        (*th_data)[i].cb = _mrpc_service_worker_cb;
+        (*th_data)[i].p.exit = 0;
+    }
+
+    ret=th_pool_create(th_pool,thread_sz,
+                   _mrpc_service_worker_cb,
+                   *th_data,
+                   &created_sz);
+
+    if( ret != 0 ) {
+        /* rollback to no thread creation status */
+        for( i = 0 ; i < created_sz ; ++i ) {
+            (*th_data)[i].p.exit = 1;
+        }
+        th_pool_join(th_pool,created_sz);
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int
+_mrpc_service_spawn_pools( struct mrpc_service* service ) {
+    struct mrpc_service_pool* pool;
+    for( pool = service->pools ; pool != NULL ; pool = pool->next ) {
+        pool->th_queues = _mrpc_service_key_queues(service,pool,pool->thread_sz);
+        if( pool->th_queues != NULL )
+            pool->th_queue_sz = pool->thread_sz;
+        if( _mrpc_service_spawn(service,&(pool->th_pool),&(pool->th_data),
+                                pool->thread_sz,pool->queue,pool->th_queues) != 0 )
+            return -1;
+    }
+    return 0;
+}
+
+int mrpc_service_run_remote( struct mrpc_service* service, int thread_sz ) {
+    service->th_queues = _mrpc_service_key_queues(service,NULL,thread_sz);
+    if( service->th_queues != NULL )
+        service->th_queue_sz = thread_sz;
+    if( _mrpc_service_spawn(service,&(service->th_pool),&(service->th_data),
+                            thread_sz,NULL,service->th_queues) != 0 )
+        return -1;
+    return _mrpc_service_spawn_pools(service);
+}
+
+int mrpc_service_run_cores( struct mrpc_service* service , const char* addr , int core_sz ) {
+    int i;
+    int created_sz;
+
+    if( core_sz <= 0 )
+        return -1;
+    service->cores = malloc(sizeof(*service->cores)*core_sz);
+    VERIFY(service->cores);
+    service->core_th_data = malloc(sizeof(*service->core_th_data)*core_sz);
+    VERIFY(service->core_th_data);
+    service->core_sz = core_sz;
+    for( i = 0 ; i < core_sz ; ++i ) {
+        struct mrpc_service_core* core = service->cores + i;
+        core->service = service;
+        core->stable = NULL;
+        core->index = i;
+        core->core = mrpc_core_create(addr,_mrpc_service_core_exec,core);
+        if( core->core == NULL ) {
+            service->core_sz = i;
+            return -1;
+        }
+        service->core_th_data[i].p.service = service;
+        service->core_th_data[i].p.queue = NULL;
+        service->core_th_data[i].p.elastic = 0;
+        service->core_th_data[i].p.once = 0;
+        service->core_th_data[i].p.exit = 0;
+        service->core_th_data[i].p.core = core;
+        service->core_th_data[i].p.local = NULL;
+        th_mutex_init(&(service->core_th_data[i].p.state_lock));
+        service->core_th_data[i].cb = _mrpc_service_core_cb;
+    }
+    if( th_pool_create(&(service->core_th_pool),core_sz,
+                       _mrpc_service_core_cb,service->core_th_data,&created_sz) != 0 ) {
+        /* the cores that are running stop at the interruption */
+        service->core_th_pool.th_sz = created_sz;
+        return -1;
+    }
+    return 0;
+}
+
+int mrpc_service_run_elastic( struct mrpc_service* service , int min_thread , int max_thread ) {
+    int i;
+
+    if( min_thread <= 0 || max_thread < min_thread )
+        return -1;
+    service->th_data = malloc(sizeof(*service->th_data)*max_thread);
+    VERIFY(service->th_data);
+    th_pool_init(&(service->th_pool),max_thread);
+    service->th_min = min_thread;
+    for( i = 0 ; i < max_thread ; ++i ) {
+        service->th_data[i].p.service = service;
+        service->th_data[i].p.queue = NULL;
+        service->th_data[i].p.elastic = 1;
+        service->th_data[i].p.once = 0;
+        service->th_data[i].p.state = TH_SLOT_EMPTY;
+        service->th_data[i].p.local = NULL;
+        th_mutex_init(&(service->th_data[i].p.state_lock));
+        _mrpc_service_register(service,&(service->th_data[i].p.reader));
+        service->th_data[i].p.exit = 0;
+        service->th_data[i].cb = _mrpc_service_worker_cb;
+    }
+    for( i = 0 ; i < min_thread ; ++i ) {
+        _mrpc_service_grow(service);
+        if( service->th_live != i+1 )
+            return -1;
+    }
+    return _mrpc_service_spawn_pools(service);
+}
+
+/* Join the elastic pool , the slots are taken out one by one since the
+ * workers may still be spawning and retiring */
+static
+int
+_mrpc_service_join_elastic( struct mrpc_service* service ) {
+    size_t i;
+    int ret = 0;
+    th_mutex_lock(&(service->lock));
+    service->quit = 1;
+    for( i = 0 ; i < service->th_pool.th_sz ; ++i ) {
+        if( service->th_data[i].p.state != TH_SLOT_EMPTY ) {
+            service->th_data[i].p.state = TH_SLOT_EMPTY;
+            th_mutex_unlock(&(service->lock));
+            if( th_pool_join_one(&(service->th_pool),i) != 0 )
+                ret = -1;
+            th_mutex_lock(&(service->lock));
+        }
+    }
+    th_mutex_unlock(&(service->lock));
+    return ret;
+}
+
+int mrpc_service_quit( struct mrpc_service* service ) {
+    struct mrpc_service_pool* pool;
+    int ret;
+    if( service->th_min != 0 )
+        ret = _mrpc_service_join_elastic(service);
+    else
+        ret = th_pool_join(&(service->th_pool),service->th_pool.th_sz);
+    for( pool = service->pools ; pool != NULL ; pool = pool->next ) {
+        if( th_pool_join(&(pool->th_pool),pool->th_pool.th_sz) != 0 )
+            ret = -1;
+    }
+    if( th_pool_join(&(service->core_th_pool),service->core_th_pool.th_sz) != 0 )
+        ret = -1;
+    return ret;
 }
 
 void* mrpc_service_get_udata( struct mrpc_service* service ) {
     return service->udata;
 }
+
+int mrpc_service_set_state( struct mrpc_service* service , mrpc_service_state_init_cb init ,
+                            mrpc_service_state_cb destroy , void* udata ) {
+    if( init == NULL )
+        return -1;
+    service->state_init = init;
+    service->state_destroy = destroy;
+    service->state_data = udata;
+    return 0;
+}
+
+void* mrpc_service_get_state( struct mrpc_service* service ) {
+    return th_key_get(service->state_key);
+}
+
+static
+void
+_mrpc_service_foreach_th( struct mrpc_service* service , struct th_data* th_data , size_t th_sz ,
+                          mrpc_service_state_cb cb , void* data ) {
+    size_t i;
+    for( i = 0 ; i < th_sz ; ++i ) {
+        th_mutex_lock(&(th_data[i].p.state_lock));
+        if( th_data[i].p.local != NULL )
+            cb(service,th_data[i].p.local,data);
+        th_mutex_unlock(&(th_data[i].p.state_lock));
+    }
+}
+
+void mrpc_service_foreach_state( struct mrpc_service* service , mrpc_service_state_cb cb , void* data ) {
+    struct mrpc_service_pool* pool;
+    if( service->th_data != NULL )
+        _mrpc_service_foreach_th(service,service->th_data,service->th_pool.th_sz,cb,data);
+    for( pool = service->pools ; pool != NULL ; pool = pool->next ) {
+        if( pool->th_data != NULL )
+            _mrpc_service_foreach_th(service,pool->th_data,pool->th_pool.th_sz,cb,data);
+    }
+    if( service->core_th_data != NULL )
+        _mrpc_service_foreach_th(service,service->core_th_data,service->core_sz,cb,data);
+}
@@ -14,23 +14,179 @@
 struct mrpc_val;
 struct mrpc_service;
 struct mrpc_request;
+struct mrpc_response;
 
+/* The min_slp_time and max_slp_time are in milliseconds and they only matter
+ * to the elastic pool , see mrpc_service_run_elastic */
 struct mrpc_service* mrpc_service_create( size_t sz ,
     size_t min_slp_time , size_t max_slp_time , void* opaque );
 
 /* Typically you don't have to call this function */
 void mrpc_service_destroy( struct mrpc_service* );
 
+/* The callback fills the error code and the result. The result is encoded once
+ * the callback returns and it stays owned by the caller as with
+ * mrpc_response_send , the service never releases it. So a string result must
+ * outlive the callback , like a short string held in its local buffer , a
+ * parameter of the request or memory kept by the handler */
 typedef void (*mrpc_service_cb)( struct mrpc_service* ,
                                  const struct mrpc_request* ,
                                  void*,
                                  int* ,
                                  struct mrpc_val* );
 
-/* This function is _NOT_ thread safe, call it before you call mrpc_service_run_remote
- * and after you call mrpc_service_create in the same thread */
+/* Methods can be added and removed at any time , the requests being served go
+ * on with the table they started with. The lookup is lock free , an update
+ * publishes a new table and the old one is freed once every worker is done
+ * with the requests it took before , the sz of mrpc_service_create is the
+ * initial capacity of the table. The options of a method ( mrpc_service_set_XXX
+ * and mrpc_service_bind_pool ) can be changed at any time as well , they are
+ * published the same way on a copy of the method and the requests being served
+ * keep the ones they started with. */
 
 int mrpc_service_add( struct mrpc_service*, mrpc_service_cb cb , const char* method_name , void* udata );
+int mrpc_service_remove( struct mrpc_service* , const char* method_name );
+
+/* Async methods. The callback doesn't answer the request before it returns ,
+ * it keeps the token and calls mrpc_service_complete later from any thread ,
+ * e.g. inside of an mrpc_request_async callback. The worker is free as soon as
+ * the callback returns , the token must be completed exactly once and it is
+ * released by mrpc_service_complete. The request stays valid until then. The
+ * result stays owned by the caller as with mrpc_response_send. Async methods
+ * can't be inline and are answered with MRPC_EC_FUNCTION_NOT_SUPPORTED in the
+ * thread per core mode. It has the same thread safety requirement as
+ * mrpc_service_add. */
+struct mrpc_service_token;
+
+typedef void (*mrpc_service_async_cb)( struct mrpc_service* ,
+                                       const struct mrpc_request* ,
+                                       void* ,
+                                       struct mrpc_service_token* );
+
+int mrpc_service_add_async( struct mrpc_service* , mrpc_service_async_cb cb , const char* method_name , void* udata );
+void mrpc_service_complete( struct mrpc_service_token* , const struct mrpc_val* result , int error_code );
+
+/* Fiber methods. The callback is written in the blocking style , but it runs
+ * on a fiber ( a small stack of MRPC_FIBER_STACK_SIZE taken from a pool ) and
+ * the downstream calls made by mrpc_service_fiber_request park the fiber
+ * instead of the thread , so a worker keeps serving other requests while the
+ * call is in flight. A parked fiber is resumed by whichever worker of the same
+ * queue is free , don't keep thread local state across a call. A fiber must not
+ * block the thread in any other way , to wait for a lock try it and call
+ * mrpc_service_fiber_yield between the tries. Fiber methods can't be inline and
+ * are answered with MRPC_EC_FUNCTION_NOT_SUPPORTED in the thread per core mode.
+ * It has the same thread safety requirement as mrpc_service_add. */
+#define MRPC_FIBER_STACK_SIZE (64*1024)
+
+int mrpc_service_add_fiber( struct mrpc_service* , mrpc_service_cb cb , const char* method_name , void* udata );
+
+/* Same as mrpc_request_async , but the calling fiber waits for the response.
+ * The req is the request handed to the fiber method. Return -1 when the call
+ * fails or it is not called from a fiber method */
+int mrpc_service_fiber_request( const struct mrpc_request* req , struct mrpc_response* res ,
+                                int timeout , const char* addr , int method_type ,
+                                const char* method_name , const char* par_fmt , ... );
+
+/* Let the worker run the other requests before the fiber goes on */
+void mrpc_service_fiber_yield( const struct mrpc_request* req );
+
+/* Batch methods. The requests of the method are collected and handed to the
+ * callback together , so a backend that is cheaper queried in bulk is hit once
+ * for many requests. A batch is executed once it holds max_batch requests or
+ * its oldest request has arrived window milliseconds ago. The worker that
+ * opens a batch keeps executing the other requests of its queue while the
+ * batch fills up. The callback fills the error code and the result of every
+ * request , and each response goes back to its own connection. An inline or
+ * thread per core execution has nothing to wait for , so it hands each request
+ * to the callback alone , and mrpc_service_run_once doesn't wait for the window ,
+ * it runs the batch with the requests already queued. It has the same thread
+ * safety requirement as mrpc_service_add. */
+typedef void (*mrpc_service_batch_cb)( struct mrpc_service* ,
+                                       const struct mrpc_request* reqs ,
+                                       size_t n ,
+                                       void* ,
+                                       int* ecs ,
+                                       struct mrpc_val* results );
+
+int mrpc_service_add_batch( struct mrpc_service* , mrpc_service_batch_cb cb , const char* method_name ,
+                            size_t max_batch , int window , void* udata );
+
+/* Put a registered method into a priority lane ( MRPC_PRIORITY_XXX ). Requests
+ * of a higher lane are dequeued by the workers ahead of the lower lanes , see
+ * mrpc_set_starvation_limit for how the lower lanes are kept from starving and
+ * mrpc_queue_depth for the depth of each lane. */
+int mrpc_service_set_priority( struct mrpc_service* , const char* method_name , int priority );
+
+/* Bulkhead pools. A pool owns a request queue and thread_sz worker threads ,
+ * a method bound to a pool is only executed by the threads of that pool , so a
+ * slow or stalled method can't take the workers of the other methods. Methods
+ * not bound to any pool share the threads of mrpc_service_run_remote. The pool
+ * threads are started by mrpc_service_run_remote and joined by mrpc_service_quit.
+ * mrpc_service_run(_once) only serves the shared queue. Pools must be added
+ * after mrpc_init and before the workers start , a method can be bound to one
+ * of them at any time. */
+int mrpc_service_add_pool( struct mrpc_service* , const char* pool_name , int thread_sz );
+int mrpc_service_bind_pool( struct mrpc_service* , const char* method_name , const char* pool_name );
+
+/* Key affinity. The parameter at par_index of the method is hashed to pick the
+ * worker thread , so the requests carrying the same key always run on the same
+ * thread and a per key cache of the handler stays warm without locking. The
+ * threads of the pool the method belongs to get a queue each , the first one
+ * keeps the queue of the pool , and the other methods of that pool go to the
+ * shortest queue. The elastic threads and
+ * mrpc_service_run(_once) don't take part , the shared methods are served from
+ * the shared queue there. The threads get their queues when they start , only
+ * if one method of their pool is key affine by then. */
+int mrpc_service_set_key_affinity( struct mrpc_service* , const char* method_name , int par_index );
+
+/* The requests of the method are parsed as views. The handler gets the string
+ * parameters in place in the received frame , without a copy or an allocation ,
+ * but they are not null terminated , use their len. The request and its strings
+ * are valid until the response is sent. */
+int mrpc_service_set_view( struct mrpc_service* , const char* method_name );
+
+/* The parameters of the method are not decoded up front , par_size is 0 and
+ * the handler reads the ones it needs with mrpc_req_param_at or
+ * mrpc_req_next_param , a routing or proxy handler looking at one parameter
+ * skips decoding the rest. */
+int mrpc_service_set_lazy( struct mrpc_service* , const char* method_name );
+
+/* Adaptive concurrency limiter. Once set , the number of concurrently executed
+ * requests of the method is bounded by a limit moving between min_limit and
+ * max_limit. The limit grows while the latency ( queueing delay included ) stays
+ * close to the lowest latency observed , and shrinks once the latency shows
+ * requests are piling up. A request over the limit is answered right away with
+ * MRPC_EC_OVERLOADED. An inline or thread per core execution runs one request
+ * at a time , so the limiter isn't applied there. Setting it again starts a
+ * new limiter. */
+int mrpc_service_set_limiter( struct mrpc_service* , const char* method_name , int min_limit , int max_limit );
+
+/* Current limit of the method , -1 if it has no limiter. It is thread safe */
+int mrpc_service_get_limit( struct mrpc_service* , const char* method_name );
+
+/* Thread per core mode , it sits alongside mrpc_service_run_remote. core_sz
+ * threads are started , each one owns a reactor listening on addr ( see
+ * mrpc_core_create ) , a replica of the service table that is rebuilt once the
+ * table is updated and its own connection allocator , and runs the methods to
+ * completion. No queue is crossed , so the priorities and pools don't apply.
+ * A core takes no lock shared with the other threads : the limiters are
+ * skipped , a batch method runs each request alone and async or fiber methods
+ * are answered with MRPC_EC_FUNCTION_NOT_SUPPORTED. It suits short , CPU bound
+ * methods. With an affinity set , the core i is pinned to the i-th CPU of the
+ * set. The threads are joined by mrpc_service_quit. */
+int mrpc_service_run_cores( struct mrpc_service* , const char* addr , int core_sz );
+
+/* Pin every worker thread started by mrpc_service_run_remote/elastic , pools
+ * included , to the given CPUs. A NULL cpus places the workers on the CPUs of
+ * the IO thread ( mrpc_set_io_affinity ) , so a request is executed on the same
+ * NUMA node that read it. Call it before starting the workers. */
+int mrpc_service_set_affinity( struct mrpc_service* , const int* cpus , size_t n );
+
+/* Execute the method on the IO thread as soon as its request is read , the
+ * queues and the worker threads are skipped and the response is written into
+ * the connection right away. It suits trivial methods whose execution costs
+ * less than the thread hand off , a method that blocks stalls all the IO. */
+int mrpc_service_set_inline( struct mrpc_service* , const char* method_name );
 
 /* Running the service in the caller thread  */
 void mrpc_service_run_once( struct mrpc_service* );
@@ -44,6 +200,13 @@ void mrpc_service_run( struct mrpc_service* );
  
 int mrpc_service_run_remote( struct mrpc_service* , int thread_sz );
 
+/* Same as mrpc_service_run_remote , but the number of threads follows the load.
+ * It starts with min_thread threads. Once a worker picks up a request that has
+ * been queued longer than min_slp_time , it spawns one more thread up to
+ * max_thread. A worker that stays idle for max_slp_time exits unless there are
+ * only min_thread threads left. */
+int mrpc_service_run_elastic( struct mrpc_service* , int min_thread , int max_thread );
+
 /* Call this function inside of the thread that call mrpc_service_run_remote
  * This function will block until all the thread join in the calling thread.
  * This function may deadlock if the user doesn't call mrpc_interrupt, the
@@ -62,4 +225,27 @@ int mrpc_service_quit( struct mrpc_service* );
 /* Get opaque user data */
 void* mrpc_service_get_udata( struct mrpc_service* );
 
+/* Per worker state. Every worker thread , pools and cores included , calls
+ * init once on its own thread and the handlers running on that thread get
+ * the returned state from mrpc_service_get_state , so counters , scratch
+ * buffers and caches need no lock. A fiber method may be resumed on another
+ * worker , it gets the state again after each call. The states live until
+ * mrpc_service_destroy calls destroy on each of them , the one of a thread
+ * running mrpc_service_run is destroyed when it returns. Call it before
+ * starting the workers. */
+typedef void* (*mrpc_service_state_init_cb)( struct mrpc_service* , void* udata );
+typedef void (*mrpc_service_state_cb)( struct mrpc_service* , void* state , void* udata );
+
+int mrpc_service_set_state( struct mrpc_service* , mrpc_service_state_init_cb init ,
+                            mrpc_service_state_cb destroy , void* udata );
+
+/* State of the calling worker , NULL outside of the workers */
+void* mrpc_service_get_state( struct mrpc_service* );
+
+/* Call cb on the state of every worker , e.g to sum up the counters. The
+ * workers keep running , cb is called with the lock of the worker held , which
+ * the worker holds while it runs a request , so cb sees a consistent state.
+ * Don't call it from a handler */
+void mrpc_service_foreach_state( struct mrpc_service* , mrpc_service_state_cb cb , void* data );
+
 #endif /* MINIRPC_SERVICE_H_ */
@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* sched_setaffinity */
+#endif /* __linux__ */
+
 #include "minirpc.h"
 #include "private/coder.h"
 #include "private/mq.h"
@@ -11,18 +15,21 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
+#ifdef __linux__
+#include <sched.h>
+#endif /* __linux__ */
 
 /* Wire protocol */
 
+/* A view references the string in the buffer , it is not null terminated */
 static
-int decode_varchar( void* buffer , size_t length , struct mrpc_val* val ) {
+int decode_varchar( void* buffer , size_t length , struct mrpc_val* val , int view ) {
     unsigned int str_len;
     int ret;
-    if( length < 4 )
-        return -1;
     /* Variant byte length : Variant string goes here */
     ret = decode_uint(&str_len,CAST(char*,buffer),length);
     if( ret < 0 )
@@ -32,14 +39,16 @@ int decode_varchar( void* buffer , size_t length , struct mrpc_val* val ) {
     /* Checking package completion */
     if( str_len > length - ret )
         return -1;
-    if( str_len < MRPC_MAX_LOCAL_VAR_CHAR_LEN ) {
+    if( view ) {
+        val->value.varchar.val = CAST(const char*,buffer);
+    } else if( str_len < MRPC_MAX_LOCAL_VAR_CHAR_LEN ) {
         memcpy(val->value.varchar.buf,buffer,str_len);
         val->value.varchar.buf[str_len] = 0;
         val->value.varchar.val=val->value.varchar.buf;
     } else {
         /* malloc new buffer since we cannot hold it in local buffer */
         val->value.varchar.val = malloc(str_len+1);
-        VERIFY(val->value.varchar.val == NULL);
+        VERIFY(val->value.varchar.val != NULL);
         memcpy(CAST(void*,val->value.varchar.val),buffer,str_len);
         CAST(char*,val->value.varchar.val)[str_len]=0;
     }
@@ -87,7 +96,7 @@ int mrpc_encode_val( const struct mrpc_val* val , char* buffer ) {
 }
 
 static
-int mrpc_decode_val( struct mrpc_val* val , const char* buffer , size_t length ) {
+int mrpc_decode_val( struct mrpc_val* val , const char* buffer , size_t length , int view ) {
     int type;
     int ret;
     if( length < 1 )
@@ -108,7 +117,7 @@ int mrpc_decode_val( struct mrpc_val* val , const char* buffer , size_t length )
             return ret;
         return ret + 1;
     case MRPC_VARCHAR:
-        ret = decode_varchar( CAST(char*,buffer)+1 , length-1, val );
+        ret = decode_varchar( CAST(char*,buffer)+1 , length-1, val , view );
         if( ret < 0 )
             return ret;
         return ret+1;
@@ -127,68 +136,346 @@ int mrpc_decode_val( struct mrpc_val* val , const char* buffer , size_t length )
  * and 9 bytes which means it contains really large
  */
 
+/* Flag bits carried in the high bits of the method type byte */
+#define MRPC_FLAG_DEADLINE 0x80 /* a varint time budget follows the transaction id */
+#define MRPC_FLAG_METHOD_ID 0x40 /* a varint method id replaces the method name */
+#define MRPC_FLAG_MASK 0xC0
+
+/* Frame version 2. The first byte has a magic in the high nibble and the
+ * version in the low one , it never collides with a version 1 method type.
+ * The varint length of the rest of the frame , the varint flags and the
+ * varint stream id follow , then the optional fields in the order of their
+ * flag bits , then the method and the parameter list , or the result */
+#define MRPC_V2_MAGIC 0xA0
+#define MRPC_V2_BYTE (MRPC_V2_MAGIC|2)
+
+#define MRPC_V2_NOTIFICATION 0x01 /* no response is expected */
+#define MRPC_V2_METHOD_ID 0x02 /* a varint method id replaces the method name */
+#define MRPC_V2_DEADLINE 0x04 /* a varint time budget */
+#define MRPC_V2_TRACE 0x08 /* a trace id of MRPC_V2_TRACE_LEN bytes , it is skipped */
+#define MRPC_V2_COMPRESSED 0x10 /* compressed parameters , not supported yet */
+#define MRPC_V2_ERROR 0x20 /* response , a varint error code replaces the result */
+
+#define MRPC_V2_TRACE_LEN 16
+
+/* The version a client writes its requests in , version 1 is read by every
+ * server and there is no negotiation yet , so version 2 is opt in */
+static int MRPC_WIRE_VERSION = 1;
+
+/* The stream id of version 2 is the transaction id taken as a number */
+static
+unsigned int mrpc_stream_id( const char transaction_id[4] ) {
+    const unsigned char* t = CAST(const unsigned char*,transaction_id);
+    return CAST(unsigned int,t[0]) | (CAST(unsigned int,t[1])<<8) |
+        (CAST(unsigned int,t[2])<<16) | (CAST(unsigned int,t[3])<<24);
+}
+
+static
+void mrpc_stream_id_set( char transaction_id[4] , unsigned int id ) {
+    transaction_id[0] = CAST(char,id & 0xff);
+    transaction_id[1] = CAST(char,(id>>8) & 0xff);
+    transaction_id[2] = CAST(char,(id>>16) & 0xff);
+    transaction_id[3] = CAST(char,(id>>24) & 0xff);
+}
+
+#ifdef _WIN32
+#define mrpc_barrier() MemoryBarrier()
+#define mrpc_atomic_inc(v) CAST(unsigned int,InterlockedIncrement(CAST(volatile LONG*,(v))))
+#else
+#define mrpc_barrier() __sync_synchronize()
+#define mrpc_atomic_inc(v) __sync_add_and_fetch((v),1)
+#endif /* _WIN32 */
+
+/* Method ids. A method registered by the server keeps its id for the life of
+ * the process , a slot is filled before the count publishes it , so the
+ * readers don't lock */
+struct mrpc_method {
+    char name[MRPC_MAX_METHOD_NAME_LEN];
+    size_t len;
+    unsigned int hash;
+};
+
+static struct mrpc_method MRPC_METHODS[MRPC_MAX_METHOD_ID];
+static volatile size_t MRPC_METHOD_SZ = 0;
+
+static
+int mrpc_method_lookup( const char* method_name , size_t len ) {
+    size_t sz = MRPC_METHOD_SZ;
+    size_t i;
+    for( i = 0 ; i < sz ; ++i ) {
+        if( MRPC_METHODS[i].len == len && memcmp(MRPC_METHODS[i].name,method_name,len) == 0 )
+            return CAST(int,i);
+    }
+    return -1;
+}
+
+int mrpc_method_id( const char* method_name ) {
+    size_t len = strlen(method_name);
+    int id = mrpc_method_lookup(method_name,len);
+    struct mrpc_method* m;
+    if( id >= 0 )
+        return id;
+    if( len >= MRPC_MAX_METHOD_NAME_LEN || MRPC_METHOD_SZ == MRPC_MAX_METHOD_ID )
+        return -1;
+    m = MRPC_METHODS + MRPC_METHOD_SZ;
+    memcpy(m->name,method_name,len+1);
+    m->len = len;
+    m->hash = mrpc_hash(method_name,len);
+    mrpc_barrier();
+    return CAST(int,MRPC_METHOD_SZ++);
+}
+
+/* The fixed part of a request frame , everything before the parameter list */
+struct mrpc_req_hdr {
+    int version;
+    int method_type;
+    int flags;
+    size_t length;
+    char transaction_id[4];
+    unsigned int timeout;
+    const char* method_name;
+    size_t method_name_len;
+    int method_id; /* -1 when the frame carries the name */
+    size_t par_offset; /* where the parameter list starts */
+};
+
+/* The method part of a request header , the name or the id */
 static
-int mrpc_request_parse( void* buffer , size_t length , struct mrpc_request* req ) {
+int mrpc_request_peek_method( const void* buffer , size_t length , size_t cur_pos ,
+                              int by_id , struct mrpc_req_hdr* hdr ) {
     size_t len;
+    int ret;
+
+    buffer=CAST(const char*,buffer)+cur_pos;
+
+    /* method id , an unknown one has an empty name and is not found */
+    if( by_id ) {
+        unsigned int id;
+        ret = decode_uint(&id,CAST(const char*,buffer),length-cur_pos);
+        if( ret < 0 || id >= CAST(unsigned int,MRPC_MAX_METHOD_ID) )
+            return -1;
+        hdr->method_id = CAST(int,id);
+        if( id < MRPC_METHOD_SZ ) {
+            hdr->method_name = MRPC_METHODS[id].name;
+            hdr->method_name_len = MRPC_METHODS[id].len;
+        } else {
+            hdr->method_name = "";
+            hdr->method_name_len = 0;
+        }
+        hdr->par_offset = cur_pos + ret;
+        return 0;
+    }
+    hdr->method_id = -1;
+
+    /* method name, only the prefix is safe to get */
+    ENSURE(1,length-cur_pos);
+    decode_byte(&len,CAST(const char*,buffer));
+    if( len >= MRPC_MAX_METHOD_NAME_LEN || len == 0 ) {
+        return -1;
+    }
+    buffer=CAST(const char*,buffer)+1;
+    cur_pos += 1;
+
+    /* check validation from the current position */
+    ENSURE(len,length-cur_pos);
+    hdr->method_name = CAST(const char*,buffer);
+    hdr->method_name_len = len;
+    hdr->par_offset = cur_pos + len;
+    return 0;
+}
+
+static
+int mrpc_request_peek_v2( const void* buffer , size_t length , struct mrpc_req_hdr* hdr ) {
+    const char* p = CAST(const char*,buffer);
+    size_t cur_pos = 1;
+    size_t body;
+    unsigned int flags;
+    unsigned int stream_id;
+    int ret;
+
+    hdr->version = 2;
+
+    /* length of the rest */
+    ret = decode_varsize(&body,p+cur_pos,length-cur_pos);
+    if( ret < 0 )
+        return -1;
+    cur_pos += ret;
+    hdr->length = cur_pos + body;
+    if( hdr->length != length )
+        return -1;
+
+    /* flags */
+    ret = decode_uint(&flags,p+cur_pos,length-cur_pos);
+    if( ret < 0 || (flags & MRPC_V2_COMPRESSED) || (flags & MRPC_V2_ERROR) )
+        return -1;
+    cur_pos += ret;
+    hdr->flags = CAST(int,flags);
+    hdr->method_type = (flags & MRPC_V2_NOTIFICATION) ? MRPC_NOTIFICATION : MRPC_FUNCTION;
+
+    /* stream id */
+    ret = decode_uint(&stream_id,p+cur_pos,length-cur_pos);
+    if( ret < 0 )
+        return -1;
+    cur_pos += ret;
+    mrpc_stream_id_set(hdr->transaction_id,stream_id);
+
+    /* optional deadline */
+    hdr->timeout = 0;
+    if( flags & MRPC_V2_DEADLINE ) {
+        ret = decode_uint(&(hdr->timeout),p+cur_pos,length-cur_pos);
+        if( ret < 0 )
+            return -1;
+        cur_pos += ret;
+    }
+
+    /* optional trace id */
+    if( flags & MRPC_V2_TRACE ) {
+        ENSURE(MRPC_V2_TRACE_LEN,length-cur_pos);
+        cur_pos += MRPC_V2_TRACE_LEN;
+    }
+
+    return mrpc_request_peek_method(buffer,length,cur_pos,(flags & MRPC_V2_METHOD_ID) != 0,hdr);
+}
+
+/* Decode the request header without touching the parameter list. It is cheap
+ * enough to be used by the IO thread on a received frame */
+static
+int mrpc_request_peek( const void* buffer , size_t length , struct mrpc_req_hdr* hdr ) {
+    const void* frame = buffer;
     size_t cur_pos = 0;
     int ret;
 
-    /* method type */
     ENSURE(1,length-cur_pos);
-    req->method_type = *CAST(char*,buffer);
-    if( req->method_type != MRPC_NOTIFICATION && req->method_type != MRPC_FUNCTION )
+    if( *CAST(const unsigned char*,buffer) == MRPC_V2_BYTE )
+        return mrpc_request_peek_v2(buffer,length,hdr);
+    hdr->version = 1;
+
+    /* method type */
+    hdr->flags = *CAST(const unsigned char*,buffer) & MRPC_FLAG_MASK;
+    hdr->method_type = *CAST(const unsigned char*,buffer) & ~MRPC_FLAG_MASK;
+    if( hdr->method_type != MRPC_NOTIFICATION && hdr->method_type != MRPC_FUNCTION )
         return -1;
-    buffer=CAST(char*,buffer)+1;
+    buffer=CAST(const char*,buffer)+1;
     ++cur_pos;
 
     /* method length */
-    ret=decode_size(&(req->length),CAST(char*,buffer),CAST(size_t,length)-cur_pos);
-    if( ret < 0 || req->length == 0 )
+    ENSURE(1,length-cur_pos);
+    ret=decode_size(&(hdr->length),CAST(const char*,buffer),CAST(size_t,length)-cur_pos);
+    if( ret < 0 || hdr->length == 0 )
         return -1;
-    assert( length = req->length );
+    assert( length == hdr->length );
 
-    buffer=CAST(char*,buffer)+ret;
+    buffer=CAST(const char*,buffer)+ret;
     cur_pos += ret;
 
     /* transaction id */
     ENSURE(4,length-cur_pos);
-    req->transaction_id[0] = *CAST(char*,buffer);
-    req->transaction_id[1] = *(CAST(char*,buffer)+1);
-    req->transaction_id[2] = *(CAST(char*,buffer)+2);
-    req->transaction_id[3] = *(CAST(char*,buffer)+3);
-    buffer=CAST(char*,buffer)+4;
+    hdr->transaction_id[0] = *CAST(const char*,buffer);
+    hdr->transaction_id[1] = *(CAST(const char*,buffer)+1);
+    hdr->transaction_id[2] = *(CAST(const char*,buffer)+2);
+    hdr->transaction_id[3] = *(CAST(const char*,buffer)+3);
+    buffer=CAST(const char*,buffer)+4;
     cur_pos += 4;
 
-    /* method name, only the prefix is safe to get */
-    ENSURE(1,length-cur_pos);
-    decode_byte(&len,CAST(char*,buffer));
-    if( len >= MRPC_MAX_METHOD_NAME_LEN || len == 0 ) {
-        return -1;
+    /* optional deadline */
+    hdr->timeout = 0;
+    if( hdr->flags & MRPC_FLAG_DEADLINE ) {
+        ret = decode_uint(&(hdr->timeout),CAST(const char*,buffer),length-cur_pos);
+        if( ret < 0 )
+            return -1;
+        buffer=CAST(const char*,buffer)+ret;
+        cur_pos += ret;
     }
-    buffer=CAST(char*,buffer)+1;
-    cur_pos += 1;
 
-    /* check validation from the current position */
-    if( length-cur_pos < len ) {
+    return mrpc_request_peek_method(frame,length,cur_pos,(hdr->flags & MRPC_FLAG_METHOD_ID) != 0,hdr);
+}
+
+unsigned int mrpc_hash( const void* data , size_t len ) {
+    const unsigned char* p = CAST(const unsigned char*,data);
+    unsigned int h = 2166136261U;
+    size_t i;
+    for( i = 0 ; i < len ; ++i )
+        h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+/* Hash of the encoded parameter at index par , which is the same for the
+ * same value. Return 0 when the request has no such parameter */
+static
+unsigned int mrpc_request_key_hash( const void* buffer , size_t length , size_t cur_pos , int par ) {
+    struct mrpc_val val;
+    int ret;
+    int i;
+
+    for( i = 0 ; ; ++i ) {
+        if( cur_pos >= length )
+            return 0;
+        ret = mrpc_decode_val(&val,CAST(const char*,buffer)+cur_pos,length-cur_pos,1);
+        if( ret < 0 )
+            return 0;
+        if( i == par )
+            break;
+        cur_pos += ret;
+    }
+
+    return mrpc_hash(CAST(const char*,buffer)+cur_pos,ret);
+}
+
+/* Hash of the method of a frame , a known method id has it already */
+static
+unsigned int mrpc_req_hdr_hash( const struct mrpc_req_hdr* hdr ) {
+    return hdr->method_name_len != 0 && hdr->method_id >= 0 ?
+        MRPC_METHODS[hdr->method_id].hash : mrpc_hash(hdr->method_name,hdr->method_name_len);
+}
+
+/* In a view the method name and the strings reference the frame , which stays
+ * in the input buffer of the connection until the response is sent. A lazy
+ * request only records where its parameters start. The method_hash is the one
+ * computed when the frame was routed , NULL to compute it here */
+static
+int mrpc_request_parse( void* buffer , size_t length , struct mrpc_request* req ,
+                        const struct mrpc_route* route , const unsigned int* method_hash ) {
+    struct mrpc_req_hdr hdr;
+    size_t cur_pos;
+    int view = route->view;
+
+    if( mrpc_request_peek(buffer,length,&hdr) != 0 )
         return -1;
+
+    req->version = hdr.version;
+    req->method_type = hdr.method_type;
+    req->length = hdr.length;
+    memcpy(req->transaction_id,hdr.transaction_id,4);
+    req->timeout = CAST(int,hdr.timeout);
+    if( view ) {
+        req->method_name[0] = 0;
+        req->method = hdr.method_name;
     } else {
-        if( len >= MRPC_MAX_METHOD_NAME_LEN ) {
-            return -1;
-        }
-        ENSURE(len,length-cur_pos);
-        memcpy(req->method_name,buffer,len);
-        (req->method_name)[len] = 0;
-        req->method_name_len = CAST(size_t,len);
+        memcpy(req->method_name,hdr.method_name,hdr.method_name_len);
+        (req->method_name)[hdr.method_name_len] = 0;
+        req->method = req->method_name;
     }
-    buffer=CAST(char*,buffer)+len;
-    cur_pos += len;
+    req->method_name_len = hdr.method_name_len;
+    req->view = view;
+    req->method_id = hdr.method_id;
+    req->method_hash = method_hash != NULL ? *method_hash : mrpc_req_hdr_hash(&hdr);
+
+    cur_pos = hdr.par_offset;
+    buffer=CAST(char*,buffer)+cur_pos;
+    req->par_data = CAST(const char*,buffer);
+    req->par_data_len = length - cur_pos;
 
     /* parameter list Type(1byte):Value */
     req->par_size = 0;
+    if( route->lazy )
+        return 0;
     while( cur_pos < length ) {
         int ret;
+        /* more parameters than par holds */
+        if( req->par_size == MRPC_MAX_PARAMETER_SIZE )
+            return -1;
         ret = mrpc_decode_val( &(req->par[req->par_size]) ,
-            CAST(char*,buffer) , CAST(size_t,length) - cur_pos );
+            CAST(char*,buffer) , CAST(size_t,length) - cur_pos , view );
 
         if( ret < 0 )
             return -1;
@@ -197,20 +484,103 @@ int mrpc_request_parse( void* buffer , size_t length , struct mrpc_request* req
         cur_pos += ret;
         buffer=CAST(char*,buffer)+ret;
         ++(req->par_size);
+    }
 
-        if( req->par_size == MRPC_MAX_PARAMETER_SIZE )
+    return 0;
+}
+
+void mrpc_req_param_iter( const struct mrpc_request* req , struct mrpc_param_iter* iter ) {
+    iter->req = req;
+    iter->pos = 0;
+    iter->index[0] = 0;
+    iter->index_sz = 0;
+}
+
+int mrpc_req_next_param( struct mrpc_param_iter* iter , struct mrpc_val* val ) {
+    const struct mrpc_request* req = iter->req;
+    int ret;
+    if( iter->pos >= req->par_data_len )
+        return 0;
+    ret = mrpc_decode_val(val,req->par_data+iter->pos,req->par_data_len-iter->pos,1);
+    if( ret < 0 )
+        return -1;
+    iter->pos += ret;
+    return 1;
+}
+
+int mrpc_req_param_at( struct mrpc_param_iter* iter , size_t index , struct mrpc_val* val ) {
+    const struct mrpc_request* req = iter->req;
+    size_t pos;
+    int ret;
+
+    /* the same bound as the parse , par can't hold more */
+    if( index >= MRPC_MAX_PARAMETER_SIZE )
+        return -1;
+    /* scan from the last indexed parameter up to the wanted one */
+    while( iter->index_sz < index ) {
+        pos = iter->index[iter->index_sz];
+        if( pos >= req->par_data_len )
+            return -1;
+        ret = mrpc_decode_val(val,req->par_data+pos,req->par_data_len-pos,1);
+        if( ret < 0 )
             return -1;
+        iter->index[++iter->index_sz] = pos + ret;
     }
-
+    pos = iter->index[index];
+    if( pos >= req->par_data_len )
+        return -1;
+    ret = mrpc_decode_val(val,req->par_data+pos,req->par_data_len-pos,1);
+    if( ret < 0 )
+        return -1;
+    if( iter->index_sz == index )
+        iter->index[++iter->index_sz] = pos + ret;
     return 0;
 }
 
+/* Version 2 frames know the size of the body before the length is written ,
+ * the length doesn't cover itself so it is never computed twice */
+static
+size_t mrpc_response_body_size_v2( const struct mrpc_response* response ) {
+    size_t sz = 1 + encode_size_uint(mrpc_stream_id(response->transaction_id));
+    if( response->error_code == MRPC_EC_OK )
+        sz += mrpc_cal_val_size( &(response->result) );
+    else
+        sz += encode_size_int(response->error_code);
+    return sz;
+}
+
+static
+void mrpc_response_serialize_v2( const struct mrpc_response* response , void* data , size_t sz ) {
+    char* p = CAST(char*,data);
+    *p++ = CAST(char,MRPC_V2_BYTE);
+    p += encode_varsize(mrpc_response_body_size_v2(response),p);
+    if( response->error_code == MRPC_EC_OK ) {
+        *p++ = 0;
+        p += encode_uint(mrpc_stream_id(response->transaction_id),p);
+        p += mrpc_encode_val( &(response->result), p );
+    } else {
+        *p++ = MRPC_V2_ERROR;
+        p += encode_uint(mrpc_stream_id(response->transaction_id),p);
+        p += encode_int(response->error_code,p);
+    }
+    assert( CAST(size_t,p-CAST(char*,data)) == sz );
+}
+
 static
 size_t mrpc_cal_response_size( const struct mrpc_response* response ) {
     /* Method has 1 bytes , since message header length is variable, just leave it here
      * Transaction code has 4 bytes . Method name length has 1 byte and followed by the
      * var length string */
-    uint64_t sz = 1+4+(1+response->method_name_len);
+    uint64_t sz = 1+4;
+    if( response->version == 2 ) {
+        size_t body = mrpc_response_body_size_v2(response);
+        return 1 + encode_size_varsize(body) + body;
+    }
+    /* An id replaces the name when the request carries one */
+    if( response->method_id >= 0 )
+        sz += encode_size_uint(CAST(unsigned int,response->method_id));
+    else
+        sz += 1+response->method_name_len;
     /* Error code is variable length */
     sz += encode_size_int(response->error_code);
     /* Result code buffer length */
@@ -232,23 +602,19 @@ size_t mrpc_cal_response_size( const struct mrpc_response* response ) {
         return CAST(size_t,sz);
 }
 
+/* Serialize into data which has sz bytes , sz comes from mrpc_cal_response_size */
 static
-void* mrpc_response_serialize( const struct mrpc_response* response , size_t* len ) {
-    /* Calculate the response buffer length */
-    size_t sz = mrpc_cal_response_size(response);
-    void* data;
-    void* h;
+void mrpc_response_serialize_to( const struct mrpc_response* response , void* data , size_t sz ) {
     int ret;
 
-    /* Too large package */
-    if( sz == 0 )
-        return NULL;
+    if( response->version == 2 ) {
+        mrpc_response_serialize_v2(response,data,sz);
+        return;
+    }
 
-    data = malloc(CAST(size_t,sz));
-    h = data;
-    VERIFY(data);
     /* Do the serialization one by one now */
-    *CAST(char*,data) = CAST(char,response->method_type);
+    *CAST(char*,data) = CAST(char,response->method_type |
+        (response->method_id >= 0 ? MRPC_FLAG_METHOD_ID : 0));
     data=CAST(char*,data)+1;
     /* Length */
     ret = encode_size(sz,CAST(char*,data),sz-1);
@@ -265,24 +631,85 @@ void* mrpc_response_serialize( const struct mrpc_response* response , size_t* le
     assert( ret > 0 );
     data=CAST(char*,data)+ret;
     /* Method Name */
-    encode_byte(CAST(char,response->method_name_len),CAST(char*,data));
-    data=CAST(char*,data)+1;
-    memcpy(data,response->method_name,response->method_name_len);
-    data=CAST(char*,data)+response->method_name_len;
+    if( response->method_id >= 0 ) {
+        ret = encode_uint(CAST(unsigned int,response->method_id),CAST(char*,data));
+        data=CAST(char*,data)+ret;
+    } else {
+        encode_byte(CAST(char,response->method_name_len),CAST(char*,data));
+        data=CAST(char*,data)+1;
+        memcpy(data,response->method_name,response->method_name_len);
+        data=CAST(char*,data)+response->method_name_len;
+    }
     /* Result */
     if( response->error_code == MRPC_EC_OK ) {
         ret = mrpc_encode_val( &(response->result), CAST(char*,data) );
         assert(ret >0);
     }
-    /* Done */
-    *len = sz;
-    return h;
+}
+
+static
+size_t mrpc_request_body_size_v2( const struct mrpc_request* req ) {
+    size_t sz = 1 + encode_size_uint(mrpc_stream_id(req->transaction_id));
+    size_t i;
+    if( req->timeout > 0 )
+        sz += encode_size_uint(CAST(unsigned int,req->timeout));
+    if( req->method_id >= 0 )
+        sz += encode_size_uint(CAST(unsigned int,req->method_id));
+    else
+        sz += 1+req->method_name_len;
+    for( i = 0 ; i < req->par_size ; ++i ) {
+        sz += mrpc_cal_val_size(req->par+i);
+    }
+    return sz;
+}
+
+static
+void mrpc_request_serialize_v2( const struct mrpc_request* req , void* data , size_t sz ) {
+    char* p = CAST(char*,data);
+    int flags = 0;
+    size_t i;
+
+    if( req->method_type == MRPC_NOTIFICATION )
+        flags |= MRPC_V2_NOTIFICATION;
+    if( req->method_id >= 0 )
+        flags |= MRPC_V2_METHOD_ID;
+    if( req->timeout > 0 )
+        flags |= MRPC_V2_DEADLINE;
+
+    *p++ = CAST(char,MRPC_V2_BYTE);
+    p += encode_varsize(mrpc_request_body_size_v2(req),p);
+    *p++ = CAST(char,flags);
+    p += encode_uint(mrpc_stream_id(req->transaction_id),p);
+    if( req->timeout > 0 )
+        p += encode_uint(CAST(unsigned int,req->timeout),p);
+    if( req->method_id >= 0 ) {
+        p += encode_uint(CAST(unsigned int,req->method_id),p);
+    } else {
+        encode_byte(CAST(char,req->method_name_len),p);
+        ++p;
+        memcpy(p,req->method_name,req->method_name_len);
+        p += req->method_name_len;
+    }
+    for( i = 0 ; i < req->par_size ; ++i ) {
+        p += mrpc_encode_val(req->par+i,p);
+    }
+    assert( CAST(size_t,p-CAST(char*,data)) == sz );
 }
 
 static
 size_t mrpc_cal_request_size( const struct mrpc_request* req ) {
-    uint64_t sz = 1 + 4 + (1+req->method_name_len);
+    uint64_t sz = 1 + 4;
     size_t i ;
+    if( req->version == 2 ) {
+        size_t body = mrpc_request_body_size_v2(req);
+        return 1 + encode_size_varsize(body) + body;
+    }
+    if( req->method_id >= 0 )
+        sz += encode_size_uint(CAST(unsigned int,req->method_id));
+    else
+        sz += 1+req->method_name_len;
+    if( req->timeout > 0 )
+        sz += encode_size_uint(CAST(unsigned int,req->timeout));
     for( i = 0 ; i < req->par_size ; ++i ) {
         sz += mrpc_cal_val_size(req->par+i);
     }
@@ -314,8 +741,14 @@ void* mrpc_request_msg_serialize( const struct mrpc_request* req , size_t* len )
     VERIFY(data);
     *len = sz;
 
+    if( req->version == 2 ) {
+        mrpc_request_serialize_v2(req,data,sz);
+        return h;
+    }
+
     /* Method type */
-    *CAST(char*,data) = req->method_type;
+    *CAST(char*,data) = req->method_type | (req->timeout > 0 ? MRPC_FLAG_DEADLINE : 0) |
+        (req->method_id >= 0 ? MRPC_FLAG_METHOD_ID : 0);
     data=CAST(char*,data)+1;
     --sz;
     /* Length */
@@ -330,12 +763,24 @@ void* mrpc_request_msg_serialize( const struct mrpc_request* req , size_t* len )
     CAST(char*,data)[3]=req->transaction_id[3];
     sz-=4;
     data=CAST(char*,data)+4;
+    /* Deadline */
+    if( req->timeout > 0 ) {
+        ret = encode_uint(CAST(unsigned int,req->timeout),data);
+        data=CAST(char*,data)+ret;
+        sz-=ret;
+    }
     /* Method name */
-    encode_byte(CAST(char,req->method_name_len),CAST(char*,data));
-    data=CAST(char*,data)+1;
-    memcpy(data,req->method_name,req->method_name_len);
-    data=CAST(char*,data)+req->method_name_len;
-    sz-=1+req->method_name_len;
+    if( req->method_id >= 0 ) {
+        ret = encode_uint(CAST(unsigned int,req->method_id),data);
+        data=CAST(char*,data)+ret;
+        sz-=ret;
+    } else {
+        encode_byte(CAST(char,req->method_name_len),CAST(char*,data));
+        data=CAST(char*,data)+1;
+        memcpy(data,req->method_name,req->method_name_len);
+        data=CAST(char*,data)+req->method_name_len;
+        sz-=1+req->method_name_len;
+    }
     /* Parameters */
     for( i = 0 ; i < req->par_size ; ++i ) {
         ret = mrpc_encode_val(req->par+i,data);
@@ -347,12 +792,77 @@ void* mrpc_request_msg_serialize( const struct mrpc_request* req , size_t* len )
     return h;
 }
 
+static
+int mrpc_response_parse_v2( void* data , size_t length , struct mrpc_response* response ) {
+    const char* p = CAST(const char*,data);
+    size_t cur_pos = 1;
+    size_t body;
+    unsigned int flags;
+    unsigned int stream_id;
+    int ret;
+
+    response->version = 2;
+    response->method_type = MRPC_FUNCTION;
+    response->method_name[0] = 0;
+    response->method_name_len = 0;
+    response->method_id = -1;
+
+    /* length of the rest */
+    ret = decode_varsize(&body,p+cur_pos,length-cur_pos);
+    if( ret < 0 )
+        return -1;
+    cur_pos += ret;
+    response->length = cur_pos + body;
+    if( response->length != length )
+        return -1;
+
+    /* flags */
+    ret = decode_uint(&flags,p+cur_pos,length-cur_pos);
+    if( ret < 0 || (flags & MRPC_V2_COMPRESSED) )
+        return -1;
+    cur_pos += ret;
+
+    /* stream id */
+    ret = decode_uint(&stream_id,p+cur_pos,length-cur_pos);
+    if( ret < 0 )
+        return -1;
+    cur_pos += ret;
+    mrpc_stream_id_set(response->transaction_id,stream_id);
+
+    if( flags & MRPC_V2_TRACE ) {
+        ENSURE(MRPC_V2_TRACE_LEN,length-cur_pos);
+        cur_pos += MRPC_V2_TRACE_LEN;
+    }
+
+    /* error code or result */
+    if( flags & MRPC_V2_ERROR ) {
+        ret = decode_int(&response->error_code,p+cur_pos,length-cur_pos);
+        if( ret < 0 || response->error_code == MRPC_EC_OK )
+            return -1;
+    } else {
+        response->error_code = MRPC_EC_OK;
+        ret = mrpc_decode_val(&response->result,p+cur_pos,length-cur_pos,0);
+        if( ret < 0 )
+            return -1;
+    }
+    cur_pos += ret;
+
+    return cur_pos == length ? 0 : -1;
+}
+
 int
 mrpc_response_parse( void* data , size_t length , struct mrpc_response* response ) {
     int ret;
+    int flags;
+
+    ENSURE(1,length);
+    if( *CAST(unsigned char*,data) == MRPC_V2_BYTE )
+        return mrpc_response_parse_v2(data,length,response);
+    response->version = 1;
 
     /* method type */
-    response->method_type=*CAST(char*,data);
+    flags = *CAST(unsigned char*,data) & MRPC_FLAG_MASK;
+    response->method_type = *CAST(unsigned char*,data) & ~MRPC_FLAG_MASK;
     data=CAST(char*,data)+1;
     --length;
     if( response->method_type != MRPC_FUNCTION )
@@ -369,8 +879,8 @@ mrpc_response_parse( void* data , size_t length , struct mrpc_response* response
     ENSURE(4,length);
     response->transaction_id[0]=CAST(char*,data)[0];
     response->transaction_id[1]=CAST(char*,data)[1];
-    response->transaction_id[0]=CAST(char*,data)[2];
-    response->transaction_id[1]=CAST(char*,data)[3];
+    response->transaction_id[2]=CAST(char*,data)[2];
+    response->transaction_id[3]=CAST(char*,data)[3];
     data=CAST(char*,data)+4;
     length-=4;
 
@@ -379,7 +889,22 @@ mrpc_response_parse( void* data , size_t length , struct mrpc_response* response
     if( ret < 0 )
         return -1;
     data=CAST(char*,data)+ret;
-    --length;
+    length-=ret;
+
+    /* method id */
+    if( flags & MRPC_FLAG_METHOD_ID ) {
+        unsigned int id;
+        ret = decode_uint(&id,data,length);
+        if( ret < 0 )
+            return -1;
+        response->method_id = CAST(int,id);
+        response->method_name[0] = 0;
+        response->method_name_len = 0;
+        data=CAST(char*,data)+ret;
+        length-=ret;
+        goto result;
+    }
+    response->method_id = -1;
 
     /* method */
     ENSURE(1,length);
@@ -395,9 +920,10 @@ mrpc_response_parse( void* data , size_t length , struct mrpc_response* response
     data=CAST(char*,data)+response->method_name_len;
     length-=response->method_name_len+1;
 
+result:
     /* result */
     if( response->error_code == MRPC_EC_OK ) {
-        ret = mrpc_decode_val(&response->result,data,length);
+        ret = mrpc_decode_val(&response->result,data,length,0);
         if( ret<0 )
             return -1;
         length -= ret;
@@ -408,13 +934,39 @@ mrpc_response_parse( void* data , size_t length , struct mrpc_response* response
 
 /* MRPC */
 
+/* priority lanes are the lanes of the request queue */
+typedef char mrpc_lane_size_check[ MQ_LANE_SIZE == MRPC_PRIORITY_SIZE ? 1 : -1 ];
+
+/* An extra request queue , it is served by its own workers */
+struct mrpc_queue {
+    struct mq* q;
+    struct mrpc_queue* next;
+};
+
 struct minirpc {
     struct mq* req_q; /* request queue */
+    struct mrpc_queue* queues; /* extra request queues */
+    struct mrpc_core* cores; /* reactors of the thread per core mode */
     struct mq* poll_q; /* response queue */
     struct net_server server; /* server for network */
     FILE* logf;
     struct slab conn_slab; /* slab for connection */
     int poll_tm; /* polling time */
+    size_t inflight; /* requests not replied yet, only touched by IO thread */
+    size_t max_inflight;
+    struct mrpc_conn* parked_head; /* requests waiting for in-flight budget */
+    struct mrpc_conn* parked_tail;
+    size_t max_queue_depth; /* admission control */
+    int target_delay;
+    int delay_interval;
+    int above_target_since; /* when the queueing delay goes above the target */
+    int above_target;
+    size_t fair_quantum; /* queue requests per client , 0 means disabled */
+    mrpc_router_cb router;
+    void* router_data;
+    size_t starvation_limit;
+    int io_cpus[MRPC_MAX_AFFINITY_CPU]; /* affinity of the IO thread */
+    size_t io_cpu_sz;
 };
 
 enum {
@@ -439,6 +991,7 @@ struct mrpc_client_req {
     size_t sz;
     char addr[22]; /* MAX IP:PORT 255.255.255.255:65535 (21 digits)*/
     int timeout;
+    int loopback; /* the timeout bounds the whole exchange , see mrpc_client_events */
 }; 
 
 enum {
@@ -458,6 +1011,10 @@ struct mrpc_req_data {
     void* raw_data;
     size_t raw_data_len;
     struct mrpc_conn* rconn;
+    int arrival; /* millisecond clock when the frame is completed */
+    unsigned int timeout; /* time budget carried by the frame */
+    unsigned int method_hash; /* computed once on the IO thread when hashed is set */
+    int hashed;
 };
 
 struct mrpc_conn {
@@ -467,25 +1024,60 @@ struct mrpc_conn {
     /* This 2 areas are embedded here in which it makes our code faster */
     struct mrpc_poll_data poll_data;
     struct mrpc_req_data request;
+    struct mrpc_conn* next_parked;
+    unsigned int client_tag; /* fair queuing flow of this connection */
+    struct mrpc_route route; /* where the request is queued */
+    int inline_exec; /* the request is being executed on the IO thread */
+    struct mrpc_core* core; /* owner reactor , NULL means the main one */
 };
 
+/* Reactor of the thread per core mode. It serves its own listener and runs
+ * every request to completion , nothing is shared with the main reactor */
+struct mrpc_core {
+    struct net_server server;
+    struct slab conn_slab;
+    mrpc_inline_cb exec;
+    void* exec_data;
+    struct mrpc_core* next;
+};
+
+#define mrpc_conn_free(rconn) \
+    slab_free((rconn)->core == NULL ? &(RPC.conn_slab) : &((rconn)->core->conn_slab),(rconn))
+
 
 enum {
     RESPONSE_TAG_RSP,
     RESPONSE_TAG_LOG,
     RESPONSE_TAG_ERR,
     RESPONSE_TAG_DONE,
+    RESPONSE_TAG_SENT, /* the worker has written the response already */
     REQUEST_TAG_SEND /* for client async sending */
 };
 
 int mrpc_get_package_size( void* buf , size_t sz , size_t* len )  {
-    if( sz < 2 )
-        return -1;
+    const unsigned char* ubuf = CAST(const unsigned char*,buf);
+    size_t body;
+    int ret;
 
-    if( decode_size(len,CAST(char*,buf)+1,sz-2) <0 )
+    if( sz < 1 )
         return -1;
 
-    return 0;
+    if( ubuf[0] == MRPC_V2_BYTE ) {
+        ret = decode_varsize(&body,CAST(const char*,buf)+1,sz-1);
+        if( ret < 0 )
+            return ret;
+        *len = 1 + ret + body;
+        return *len < body ? -2 : 0;
+    }
+
+    /* version 1 , the method type comes first */
+    if( (ubuf[0] & ~MRPC_FLAG_MASK) != MRPC_FUNCTION &&
+        (ubuf[0] & ~MRPC_FLAG_MASK) != MRPC_NOTIFICATION )
+        return -2;
+    if( sz < 2 || (ubuf[1] == 255 && sz < 2 + sizeof(size_t)) )
+        return -1;
+    decode_size(len,CAST(const char*,buf)+1,sz-1);
+    return *len < 2 ? -2 : 0;
 }
 
 static
@@ -503,23 +1095,36 @@ void mrpc_request_parse_fail( struct mrpc_conn* conn ) {
     mq_enqueue(RPC.poll_q,&(conn->poll_data));
 }
 
-int mrpc_request_try_recv( struct mrpc_request* req , void** conn ) {
+/* A posted task is queued as a request data without any connection */
+static
+int mrpc_task_take( struct mrpc_req_data* data , void** task ) {
+    *task = data->raw_data;
+    free(data);
+    return 3;
+}
+
+static
+int mrpc_request_try_dequeue( struct mq* q , struct mrpc_request* req , void** conn ) {
     struct mrpc_req_data* data;
     int ec;
     int ret;
 
     do {
-        ret = mq_try_dequeue(RPC.req_q,CAST(void*,&data));
+        ret = mq_try_dequeue(q,CAST(void*,&data));
         if( ret != 0 ) {
             return -1;
         }
         if( data == NULL )
             return 1;
+        if( data->rconn == NULL )
+            return mrpc_task_take(data,conn);
         *conn = data->rconn;
-        ec = mrpc_request_parse(data->raw_data,data->raw_data_len,req);
+        ec = mrpc_request_parse(data->raw_data,data->raw_data_len,req,&data->rconn->route,
+                                 data->hashed ? &(data->method_hash) : NULL);
         if( ec != 0 ) {
             mrpc_request_parse_fail( CAST(struct mrpc_conn*,*conn));
         } else {
+            req->arrival_time = data->arrival;
             break;
         }
     } while(1);
@@ -527,47 +1132,160 @@ int mrpc_request_try_recv( struct mrpc_request* req , void** conn ) {
     return 0;
 }
 
-int mrpc_request_recv( struct mrpc_request* req , void** conn ) {
+static
+int mrpc_request_dequeue( struct mq* q , struct mrpc_request* req , void** conn , int msec ) {
     struct mrpc_req_data* data;
     int ec;
-    mq_dequeue(RPC.req_q,CAST(void*,&data));
+    if( msec < 0 )
+        mq_dequeue(q,CAST(void*,&data));
+    else if( mq_timed_dequeue(q,CAST(void*,&data),msec) != 0 )
+        return 2;
     if( data == NULL )
         return 1;
+    if( data->rconn == NULL )
+        return mrpc_task_take(data,conn);
     *conn = data->rconn;
-    ec = mrpc_request_parse(data->raw_data,data->raw_data_len,req);
+    ec = mrpc_request_parse(data->raw_data,data->raw_data_len,req,&data->rconn->route,
+                                 data->hashed ? &(data->method_hash) : NULL);
     if( ec != 0 ) {
         mrpc_request_parse_fail( CAST(struct mrpc_conn*,*conn));
         return -1;
     }
+    req->arrival_time = data->arrival;
     return 0;
 }
 
+int mrpc_request_try_recv( struct mrpc_request* req , void** conn ) {
+    return mrpc_request_try_dequeue(RPC.req_q,req,conn);
+}
+
+int mrpc_request_recv( struct mrpc_request* req , void** conn ) {
+    return mrpc_request_dequeue(RPC.req_q,req,conn,-1);
+}
+
+int mrpc_request_timed_recv( struct mrpc_request* req , void** conn , int msec ) {
+    return mrpc_request_dequeue(RPC.req_q,req,conn,msec);
+}
+
+int mrpc_queue_try_recv( struct mrpc_queue* queue , struct mrpc_request* req , void** conn ) {
+    return mrpc_request_try_dequeue(queue->q,req,conn);
+}
+
+int mrpc_queue_recv( struct mrpc_queue* queue , struct mrpc_request* req , void** conn ) {
+    return mrpc_request_dequeue(queue->q,req,conn,-1);
+}
+
+int mrpc_queue_timed_recv( struct mrpc_queue* queue , struct mrpc_request* req , void** conn , int msec ) {
+    return mrpc_request_dequeue(queue->q,req,conn,msec);
+}
+
+struct mrpc_queue* mrpc_queue_create() {
+    struct mrpc_queue* ret = malloc(sizeof(*ret));
+    VERIFY(ret);
+    ret->q = mq_create();
+    if( RPC.fair_quantum != 0 )
+        mq_set_quantum(ret->q,RPC.fair_quantum);
+    mq_set_starvation_limit(ret->q,RPC.starvation_limit);
+    ret->next = RPC.queues;
+    RPC.queues = ret;
+    return ret;
+}
+
+void mrpc_queue_destroy( struct mrpc_queue* queue ) {
+    struct mrpc_queue** p = &(RPC.queues);
+    while( *p != queue )
+        p = &((*p)->next);
+    *p = queue->next;
+    mq_destroy(queue->q);
+    free(queue);
+}
+
+void mrpc_queue_post( struct mrpc_queue* queue , void* task ) {
+    struct mrpc_req_data* data = malloc(sizeof(*data));
+    VERIFY(data);
+    data->raw_data = task;
+    data->raw_data_len = 0;
+    data->rconn = NULL;
+    data->arrival = CAST(int,net_time_millisec());
+    data->timeout = 0;
+    data->hashed = 0;
+    /* a task is the rest of a request already admitted , don't delay it */
+    mq_enqueue_flow(queue == NULL ? RPC.req_q : queue->q,data,MRPC_PRIORITY_HIGH,0,0);
+}
+
+size_t mrpc_queue_size( struct mrpc_queue* queue ) {
+    return mq_size(queue == NULL ? RPC.req_q : queue->q);
+}
+
+int mrpc_request_elapsed( const struct mrpc_request* req ) {
+    return CAST(int,CAST(unsigned int,net_time_millisec()) - CAST(unsigned int,req->arrival_time));
+}
+
+int mrpc_request_expired( const struct mrpc_request* req ) {
+    if( req->timeout <= 0 )
+        return 0;
+    return mrpc_request_elapsed(req) >= req->timeout;
+}
+
 void mrpc_response_send( const struct mrpc_request* req ,
                          void* opaque , const struct mrpc_val* result , int ec ) {
     struct mrpc_response response;
     struct mrpc_conn* conn = CAST(struct mrpc_conn*,opaque);
+    struct mrpc_res_data* res = &(conn->poll_data.value.resp);
+    size_t sz;
+    int left;
 
     assert(req->method_type != MRPC_NOTIFICATION);
 
     response.error_code = ec;
-    strcpy(response.method_name,req->method_name);
-    response.method_name_len = req->method_name_len;
+    response.method_id = req->method_id;
     response.method_type = req->method_type;
+    response.version = req->version;
+    /* only version 1 echoes the method name */
+    if( req->version == 1 && req->method_id < 0 ) {
+        memcpy(response.method_name,req->method,req->method_name_len);
+        response.method_name[req->method_name_len] = 0;
+        response.method_name_len = req->method_name_len;
+    }
 
     response.transaction_id[0] = req->transaction_id[0];
     response.transaction_id[1] = req->transaction_id[1];
     response.transaction_id[2] = req->transaction_id[2];
     response.transaction_id[3] = req->transaction_id[3];
 
-    /* this copy is fine here since we don't really use this pointer */
+    /* this copy is fine here since the result is encoded before we return */
     if( ec == MRPC_EC_OK )
         response.result = *result;
 
-    /* serialization of the response objects */
+    /* The reactor doesn't touch the connection while the request executes , so
+     * the response is encoded straight into its output buffer , from the worker
+     * as well as from the IO thread */
+    sz = mrpc_cal_response_size(&response);
+    if( sz != 0 )
+        mrpc_response_serialize_to(&response,net_buffer_reserve(&(conn->conn->out),sz),sz);
+
+    /* on the IO thread , the reactor writes it out */
+    if( conn->inline_exec ) {
+        if( sz != 0 )
+            conn->stage = PENDING_REPLY;
+        return;
+    }
+
+    /* The worker tries to send the response by itself. The IO thread is only
+     * told to release the connection , or to send what is left */
     conn->poll_data.type = MRPC_RESPONSE_DATA;
-    conn->poll_data.value.resp.buf = mrpc_response_serialize(&response,&conn->poll_data.value.resp.len);
-    conn->poll_data.value.resp.rconn = conn;
-    conn->poll_data.value.resp.tag = RESPONSE_TAG_RSP;
+    res->buf = NULL;
+    res->len = 0;
+    res->rconn = conn;
+    if( sz == 0 ) {
+        res->tag = RESPONSE_TAG_ERR;
+    } else {
+        /* Only a socket is written from here. A memory pipe writes into the
+         * buffer of its peer , which the IO thread reads without a lock , so
+         * net_try_flush refuses it ( -1 ) and the IO thread sends it */
+        left = net_try_flush(conn->conn);
+        res->tag = left == 0 ? RESPONSE_TAG_SENT : RESPONSE_TAG_RSP;
+    }
 
     /* send back the processor queue */
     mq_enqueue(RPC.poll_q,&(conn->poll_data));
@@ -575,6 +1293,9 @@ void mrpc_response_send( const struct mrpc_request* req ,
 
 void mrpc_response_done( void* conn ) {
     struct mrpc_conn* rconn=CAST(struct mrpc_conn*,conn);
+    /* the IO thread closes it once the inline execution returns */
+    if( rconn->inline_exec )
+        return;
     rconn->poll_data.type = MRPC_RESPONSE_DATA;
     rconn->poll_data.value.resp.tag = RESPONSE_TAG_DONE;
     rconn->poll_data.value.resp.rconn = rconn;
@@ -582,37 +1303,250 @@ void mrpc_response_done( void* conn ) {
 }
 
 static
-void do_log( const char* fmt , ... ) {
-    va_list vlist;
-    int ret;
-    char buf[1024];
-    va_start(vlist,fmt);
-    ret=vsprintf(buf,fmt,vlist);
-    assert( ret < 1024 );
-    fwrite(buf,1,ret,RPC.logf);
+void do_log( const char* fmt , ... ) {
+    va_list vlist;
+    int ret;
+    char buf[1024];
+    va_start(vlist,fmt);
+    ret=vsprintf(buf,fmt,vlist);
+    assert( ret < 1024 );
+    fwrite(buf,1,ret,RPC.logf);
+}
+
+void mrpc_write_log( const char* fmt , ... ) {
+    int ret;
+    char buf[1024];
+    va_list vlist;
+    struct mrpc_poll_data* res;
+
+    va_start(vlist,fmt);
+    ret = vsprintf(buf,fmt,vlist);
+    if( ret <=0 )
+        return;
+
+    res = malloc(sizeof(*res) +ret+1);
+    VERIFY(res);
+    res->type = MRPC_RESPONSE_DATA;
+    res->value.resp.buf = CAST(char*,res)+sizeof(*res);
+    res->value.resp.len = CAST(size_t,res+1);
+    memcpy(res->value.resp.buf,buf,ret+1);
+    res->value.resp.rconn = NULL;
+    res->value.resp.tag = RESPONSE_TAG_LOG;
+
+    mq_enqueue(RPC.poll_q,res);
+}
+
+/* Called by mq_peek with the queue locked. A posted task is released by the
+ * worker taking it , so the arrival is only read while it is still queued */
+static
+void mrpc_peek_arrival( void* data , void* udata ) {
+    *CAST(int*,udata) = CAST(struct mrpc_req_data*,data)->arrival;
+}
+
+/* Admission control, return 0 if the request can be queued. It is evaluated
+ * on the IO thread only , so no locking is needed for the state */
+static
+int mrpc_admit( struct mq* q ) {
+    int arrival;
+
+    if( RPC.max_queue_depth != 0 && mq_size(q) >= RPC.max_queue_depth )
+        return -1;
+
+    if( RPC.target_delay == 0 )
+        return 0;
+
+    /* Queueing delay is the time the oldest request has waited */
+    if( mq_peek(q,mrpc_peek_arrival,&arrival) == 0 ) {
+        int now = net_time_millisec();
+        int delay = now - arrival;
+        if( delay >= RPC.target_delay ) {
+            if( !RPC.above_target ) {
+                RPC.above_target = 1;
+                RPC.above_target_since = now;
+            }
+            return now - RPC.above_target_since >= RPC.delay_interval ? -1 : 0;
+        }
+    }
+    RPC.above_target = 0;
+    return 0;
+}
+
+/* Reply an error on the IO thread directly, the frame is composed straight
+ * into the output buffer of the connection */
+static
+int mrpc_reply_error( struct mrpc_conn* rconn , const struct mrpc_req_hdr* hdr , int ec ) {
+    struct mrpc_response response;
+    size_t sz;
+
+    response.version = hdr->version;
+    response.method_type = hdr->method_type;
+    memcpy(response.method_name,hdr->method_name,hdr->method_name_len);
+    response.method_name[hdr->method_name_len] = 0;
+    response.method_name_len = hdr->method_name_len;
+    response.method_id = hdr->method_id;
+    memcpy(response.transaction_id,hdr->transaction_id,4);
+    response.error_code = ec;
+
+    sz = mrpc_cal_response_size(&response);
+    mrpc_response_serialize_to(&response,net_buffer_reserve(&(rconn->conn->out),sz),sz);
+    rconn->stage = PENDING_REPLY;
+    return NET_EV_WRITE;
+}
+
+/* Queue a fully received request to the backend, or park it on the IO thread
+ * when the in-flight budget is used up */
+#define mrpc_route_queue(rconn) \
+    ((rconn)->route.queue == NULL ? RPC.req_q : (rconn)->route.queue->q)
+
+static
+void mrpc_queue_request( struct mrpc_conn* rconn ) {
+    struct mq* q = mrpc_route_queue(rconn);
+    if( RPC.max_inflight != 0 && RPC.inflight >= RPC.max_inflight ) {
+        rconn->next_parked = NULL;
+        if( RPC.parked_tail == NULL )
+            RPC.parked_head = rconn;
+        else
+            RPC.parked_tail->next_parked = rconn;
+        RPC.parked_tail = rconn;
+        return;
+    }
+    ++RPC.inflight;
+    /* Order by deadline only when the queue is deep, a shallow queue is
+     * drained soon enough and doesn't need to pay the sorted insertion */
+    if( rconn->request.timeout != 0 && mq_size(q) >= MRPC_EDF_QUEUE_DEPTH ) {
+        mq_enqueue_deadline(q,&(rconn->request),rconn->route.lane,
+            rconn->client_tag,rconn->request.raw_data_len,
+            rconn->request.arrival+CAST(int,rconn->request.timeout));
+    } else {
+        mq_enqueue_flow(q,&(rconn->request),rconn->route.lane,
+            rconn->client_tag,rconn->request.raw_data_len);
+    }
 }
 
-void mrpc_write_log( const char* fmt , ... ) {
-    int ret;
-    char buf[1024];
-    va_list vlist;
-    struct mrpc_poll_data* res;
+#define mrpc_is_method_id_query(name,len) \
+    ((len) == sizeof(MRPC_METHOD_ID_QUERY)-1 && \
+     memcmp((name),MRPC_METHOD_ID_QUERY,sizeof(MRPC_METHOD_ID_QUERY)-1) == 0)
 
-    va_start(vlist,fmt);
-    ret = vsprintf(buf,fmt,vlist);
-    if( ret <=0 )
+/* The built-in discovery method , it answers the id of a registered method */
+static
+void mrpc_serve_method_id( const struct mrpc_request* req , void* key ) {
+    struct mrpc_val result;
+    int id = -1;
+    if( req->method_type == MRPC_NOTIFICATION )
         return;
+    if( req->par_size != 1 ) {
+        mrpc_response_send(req,key,NULL,MRPC_EC_FUNCTION_INVALID_PARAMETER_SIZE);
+        return;
+    }
+    if( req->par[0].type != MRPC_VARCHAR ) {
+        mrpc_response_send(req,key,NULL,MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE);
+        return;
+    }
+    id = mrpc_method_lookup(req->par[0].value.varchar.val,req->par[0].value.varchar.len);
+    if( id < 0 ) {
+        mrpc_response_send(req,key,NULL,MRPC_EC_FUNCTION_NOT_FOUND);
+        return;
+    }
+    mrpc_val_uint(&result,CAST(unsigned int,id));
+    mrpc_response_send(req,key,&result,MRPC_EC_OK);
+}
 
-    res = malloc(sizeof(*res) +ret+1);
-    VERIFY(res);
-    res->type = MRPC_RESPONSE_DATA;
-    res->value.resp.buf = CAST(char*,res)+sizeof(*res);
-    res->value.resp.len = CAST(size_t,res+1);
-    memcpy(res->value.resp.buf,buf,ret+1);
-    res->value.resp.rconn = NULL;
-    res->value.resp.tag = RESPONSE_TAG_LOG;
+/* Execute the request on the IO thread , the response is serialized into the
+ * output buffer by mrpc_response_send without going through any queue */
+static
+int mrpc_execute_inline( struct net_connection* conn , struct mrpc_conn* rconn ) {
+    struct mrpc_request req;
 
-    mq_enqueue(RPC.poll_q,res);
+    if( mrpc_request_parse(rconn->request.raw_data,rconn->request.raw_data_len,&req,&rconn->route,
+                           rconn->request.hashed ? &(rconn->request.method_hash) : NULL) == 0 ) {
+        req.arrival_time = rconn->request.arrival;
+        rconn->inline_exec = 1;
+        if( req.method_id < 0 && mrpc_is_method_id_query(req.method,req.method_name_len) )
+            mrpc_serve_method_id(&req,rconn);
+        else
+            rconn->route.exec(&req,rconn,rconn->route.exec_data);
+        rconn->inline_exec = 0;
+        if( rconn->stage == PENDING_REPLY )
+            return NET_EV_WRITE;
+    }
+    /* notification , or nothing to reply */
+    mrpc_conn_free(rconn);
+    conn->user_data = NULL;
+    return NET_EV_CLOSE;
+}
+
+/* A request frame is fully received , route it and queue it unless the
+ * admission control rejects it */
+static
+int mrpc_accept_request( struct net_connection* conn , struct mrpc_conn* rconn ) {
+    struct mrpc_req_hdr hdr;
+    mrpc_router_cb router;
+
+    rconn->route.lane = MRPC_PRIORITY_NORMAL;
+    rconn->route.queue = NULL;
+    rconn->route.exec = NULL;
+    rconn->route.key_par = -1;
+    rconn->route.view = 0;
+    rconn->route.lazy = 0;
+    rconn->request.timeout = 0;
+    rconn->request.hashed = 0;
+
+    if( rconn->core != NULL ) {
+        rconn->route.exec = rconn->core->exec;
+        rconn->route.exec_data = rconn->core->exec_data;
+        return mrpc_execute_inline(conn,rconn);
+    }
+
+    /* A broken frame is left to the worker to report */
+    if( mrpc_request_peek(rconn->request.raw_data,rconn->request.raw_data_len,&hdr) == 0 ) {
+        rconn->request.timeout = hdr.timeout;
+        /* the worker reuses the hash instead of hashing the name again */
+        rconn->request.method_hash = mrpc_req_hdr_hash(&hdr);
+        rconn->request.hashed = 1;
+        if( hdr.method_id < 0 && mrpc_is_method_id_query(hdr.method_name,hdr.method_name_len) )
+            return mrpc_execute_inline(conn,rconn);
+        router = *CAST(mrpc_router_cb volatile*,&(RPC.router));
+        if( router != NULL ) {
+            /* the udata is set ahead of the router , see mrpc_set_router */
+            mrpc_barrier();
+            rconn->route.method_hash = rconn->request.method_hash;
+            rconn->route.method_id = hdr.method_id;
+            router(hdr.method_name,hdr.method_name_len,&(rconn->route),RPC.router_data);
+            assert( rconn->route.lane >= 0 && rconn->route.lane < MRPC_PRIORITY_SIZE );
+            if( rconn->route.exec != NULL )
+                return mrpc_execute_inline(conn,rconn);
+            if( rconn->route.key_par >= 0 && rconn->route.key_queue_sz != 0 ) {
+                unsigned int h = mrpc_request_key_hash(rconn->request.raw_data,
+                    rconn->request.raw_data_len,hdr.par_offset,rconn->route.key_par);
+                rconn->route.queue = rconn->route.key_queues[h % rconn->route.key_queue_sz];
+            }
+        }
+        if( mrpc_admit(mrpc_route_queue(rconn)) != 0 ) {
+            if( hdr.method_type == MRPC_NOTIFICATION ) {
+                mrpc_conn_free(rconn);
+                conn->user_data = NULL;
+                return NET_EV_CLOSE;
+            }
+            return mrpc_reply_error(rconn,&hdr,MRPC_EC_OVERLOADED);
+        }
+    }
+    rconn->stage = EXECUTE_RPC;
+    mrpc_queue_request(rconn);
+    return NET_EV_IDLE;
+}
+
+static
+void mrpc_request_finish() {
+    struct mrpc_conn* rconn;
+    assert( RPC.inflight > 0 );
+    --RPC.inflight;
+    if( RPC.parked_head != NULL ) {
+        rconn = RPC.parked_head;
+        RPC.parked_head = rconn->next_parked;
+        if( RPC.parked_head == NULL )
+            RPC.parked_tail = NULL;
+        mrpc_queue_request(rconn);
+    }
 }
 
 /* This callback function will be used for each connection */
@@ -626,7 +1560,15 @@ int mrpc_do_read( struct net_connection* conn , struct mrpc_conn* rconn ) {
         if( rconn->length == 0 ) {
             size_t sz = net_buffer_readable_size(&(conn->in));
             void* data = net_buffer_peek(&(conn->in),&sz);
-            if( mrpc_get_package_size(data,sz,&(rconn->length)) != 0 ) {
+            int ret = mrpc_get_package_size(data,sz,&(rconn->length));
+            if( ret == -2 ) {
+                /* not a frame of any version */
+                mrpc_conn_free(rconn);
+                conn->user_data = NULL;
+                return NET_EV_CLOSE;
+            }
+            if( ret != 0 ) {
+                rconn->length = 0;
                 return NET_EV_READ;
             }
         }
@@ -637,11 +1579,12 @@ int mrpc_do_read( struct net_connection* conn , struct mrpc_conn* rconn ) {
             rconn->request.raw_data = data;
             rconn->request.raw_data_len = sz;
             rconn->request.rconn = rconn;
-            rconn->stage = EXECUTE_RPC;
-            mq_enqueue(RPC.req_q,&(rconn->request));
-            return NET_EV_IDLE;
+            rconn->request.arrival = net_time_millisec();
+            return mrpc_accept_request(conn,rconn);
         } else {
             if( rconn->length < net_buffer_readable_size(&(conn->in)) ) {
+                mrpc_conn_free(rconn);
+                conn->user_data = NULL;
                 return NET_EV_CLOSE;
             } else {
                 return NET_EV_READ;
@@ -654,7 +1597,9 @@ static
 int mrpc_on_conn( int ev , int ec , struct net_connection* conn ) {
     struct mrpc_conn* rconn = CAST(struct mrpc_conn*,conn->user_data);
     if( ec != 0 ) {
-        do_log("[MRPC]:network error:%d",ec);
+        /* a core shares nothing with the main reactor , the log included */
+        if( rconn->core == NULL )
+            do_log("[MRPC]:network error:%d",ec);
         return NET_EV_CLOSE;
     } else {
         if( ev & NET_EV_EOF ) {
@@ -662,7 +1607,7 @@ int mrpc_on_conn( int ev , int ec , struct net_connection* conn ) {
                 rconn->stage = CONNECTION_FAILED;
                 return NET_EV_IDLE;
             } else {
-                slab_free(&(RPC.conn_slab),rconn);
+                mrpc_conn_free(rconn);
                 return NET_EV_CLOSE;
             }
         } else if( ev & NET_EV_READ ) {
@@ -670,7 +1615,7 @@ int mrpc_on_conn( int ev , int ec , struct net_connection* conn ) {
         } else if( ev & NET_EV_WRITE ) {
             assert( rconn->stage == PENDING_REPLY );
             conn->timeout = MRPC_DEFAULT_TIMEOUT_CLOSE;
-            slab_free(&(RPC.conn_slab),rconn);
+            mrpc_conn_free(rconn);
             conn->user_data = NULL;
             return NET_EV_CLOSE | NET_EV_TIMEOUT;
         } else {
@@ -680,36 +1625,107 @@ int mrpc_on_conn( int ev , int ec , struct net_connection* conn ) {
     }
 }
 
+static
+void mrpc_conn_init( struct net_connection* conn , struct mrpc_conn* rconn , struct mrpc_core* core ) {
+    conn->user_data = rconn;
+    rconn->conn = conn;
+    rconn->length = 0;
+    rconn->stage = PENDING_REQUEST_OR_INDICATION;
+    rconn->poll_data.type = MRPC_RESPONSE_DATA;
+    rconn->poll_data.value.resp.rconn = rconn;
+    rconn->request.rconn = rconn;
+    rconn->client_tag = RPC.fair_quantum != 0 ? net_peer_addr(conn) : 0;
+    rconn->inline_exec = 0;
+    rconn->core = core;
+
+    /* hook the callback function here */
+    conn->cb = mrpc_on_conn;
+}
+
 /* This is the main function for doing the accept operations */
 static
 int mrpc_on_accept( int ec , struct net_server* ser , struct net_connection* conn ) {
     if( ec == 0 ) {
-        struct mrpc_conn* rconn = CAST(struct mrpc_conn*,slab_malloc(&(RPC.conn_slab)));
-
-        conn->user_data = rconn;
-        rconn->conn = conn;
-        rconn->length = 0;
-        rconn->stage = PENDING_REQUEST_OR_INDICATION;
-        rconn->poll_data.type = MRPC_RESPONSE_DATA;
-        rconn->poll_data.value.resp.rconn = rconn;
-        rconn->request.rconn = rconn;
-
-        /* hook the callback function here */
-        conn->cb = mrpc_on_conn;
+        mrpc_conn_init(conn,CAST(struct mrpc_conn*,slab_malloc(&(RPC.conn_slab))),NULL);
+        return NET_EV_READ;
+    }
+    return NET_EV_CLOSE;
+}
+
+/* A socket timeout only bounds the connect. A pipe connects at once , so its
+ * timeout is kept armed until the response is read */
+#define mrpc_client_events(req,ev) \
+    ((req)->loopback && (req)->timeout > 0 ? ((ev) | NET_EV_TIMEOUT) : (ev))
+
+static
+int mrpc_core_on_accept( int ec , struct net_server* ser , struct net_connection* conn ) {
+    if( ec == 0 ) {
+        struct mrpc_core* core = CAST(struct mrpc_core*,ser->user_data);
+        mrpc_conn_init(conn,CAST(struct mrpc_conn*,slab_malloc(&(core->conn_slab))),core);
         return NET_EV_READ;
     }
     return NET_EV_CLOSE;
 }
 
+struct mrpc_core* mrpc_core_create( const char* addr , mrpc_inline_cb exec , void* udata ) {
+    struct mrpc_core* core = malloc(sizeof(*core));
+    VERIFY(core);
+    if( net_server_create_shared(&(core->server),addr,mrpc_core_on_accept) != 0 ) {
+        do_log("[MRPC]:cannot create core server with address:%s",addr);
+        free(core);
+        return NULL;
+    }
+    core->server.user_data = core;
+    /* the slab is created by mrpc_core_run , on the memory of the core thread */
+    core->conn_slab.obj_sz = 0;
+    core->exec = exec;
+    core->exec_data = udata;
+    core->next = RPC.cores;
+    RPC.cores = core;
+    return core;
+}
+
+void mrpc_core_destroy( struct mrpc_core* core ) {
+    struct mrpc_core** p = &(RPC.cores);
+    while( *p != core )
+        p = &((*p)->next);
+    *p = core->next;
+    net_server_destroy(&(core->server));
+    if( core->conn_slab.obj_sz != 0 )
+        slab_destroy(&(core->conn_slab));
+    free(core);
+}
+
+int mrpc_core_run( struct mrpc_core* core ) {
+    int inter;
+    if( core->conn_slab.obj_sz == 0 )
+        slab_create(&(core->conn_slab),sizeof(struct mrpc_conn),MRPC_DEFAULT_RESERVE_MEMPOOL);
+    for( ;; ) {
+        if( net_server_poll(&(core->server),-1,&inter) < 0 ) {
+            /* errno is kept for the caller , the log queue isn't touched */
+            return -1;
+        } else if( inter ) {
+            return 1;
+        }
+    }
+}
+
 static
 int mrpc_on_client_do_read( struct net_connection* conn , struct mrpc_client_req* req  , void* poll ) {
     if( req->sz == 0 ) {
         /* peek the buffer size here */
         size_t sz = net_buffer_readable_size(&(conn->in));
         void* data = net_buffer_peek(&(conn->in),&sz);
-        if( mrpc_get_package_size(data,sz,&req->sz) != 0 ) {
+        int ret = mrpc_get_package_size(data,sz,&req->sz);
+        if( ret == -2 ) {
+            req->cb(NULL,req->udata);
+            free(poll);
+            conn->user_data = NULL;
+            return NET_EV_CLOSE;
+        }
+        if( ret != 0 ) {
             req->sz = 0;
-            return NET_EV_READ; /* read again */
+            return mrpc_client_events(req,NET_EV_READ); /* read again */
         }
     }
     /* When we reach here it means that we have already know how large
@@ -737,7 +1753,7 @@ int mrpc_on_client_do_read( struct net_connection* conn , struct mrpc_client_req
             conn->user_data = NULL;
             return NET_EV_CLOSE;
         } else {
-            return NET_EV_READ; /* read again */
+            return mrpc_client_events(req,NET_EV_READ); /* read again */
         }
     }
 }
@@ -762,10 +1778,10 @@ int mrpc_on_client( int ev , int ec , struct net_connection* conn ) {
             free(req->req_data);
             req->req_data = NULL;
             req->sz = 0;
-            return NET_EV_WRITE;
+            return mrpc_client_events(req,NET_EV_WRITE);
         } else if ( ev & NET_EV_WRITE ) {
             assert( req->req_data == NULL && req->sz == 0 );
-            return NET_EV_READ;
+            return mrpc_client_events(req,NET_EV_READ);
         } else if( ev & NET_EV_READ ) {
             return mrpc_on_client_do_read(conn,req,poll);
         } else {
@@ -796,30 +1812,31 @@ static
 void mrpc_poll_handle_response( struct mrpc_res_data* res ) {
     switch(res->tag) {
     case RESPONSE_TAG_RSP:
+        mrpc_request_finish();
+        /* the response is in the output buffer already */
         if( res->rconn->stage == CONNECTION_FAILED ) {
-            free(res->buf);
             net_stop(res->rconn->conn);
             slab_free(&(RPC.conn_slab),res->rconn);
             break;
         } else {
             res->rconn->stage = PENDING_REPLY;
-            net_buffer_produce( &(res->rconn->conn->out), res->buf,  res->len);
             net_post( res->rconn->conn, NET_EV_WRITE);
-            free(res->buf);
-            res->buf = NULL;
-            res->len = 0;
             break;
         }
     case RESPONSE_TAG_LOG:
         do_log( "%s" , CAST(const char*,res->buf) );
         free(res);
         break;
+    case RESPONSE_TAG_SENT:
     case RESPONSE_TAG_ERR:
+        mrpc_request_finish();
         res->rconn->conn->timeout = MRPC_DEFAULT_TIMEOUT_CLOSE;
+        res->rconn->conn->user_data = NULL;
         net_post(res->rconn->conn,NET_EV_CLOSE|NET_EV_TIMEOUT);
         slab_free(&(RPC.conn_slab),res->rconn);
         break;
     case RESPONSE_TAG_DONE:
+        mrpc_request_finish();
         net_stop(res->rconn->conn);
         slab_free(&(RPC.conn_slab),res->rconn);
         break;
@@ -843,8 +1860,14 @@ int mrpc_on_poll( int ev , int ec , struct net_connection* conn ) {
             mrpc_poll_handle_response(&(poll_data->value.resp));
             break;
         case MRPC_CLIENT_REQUEST: {
-                struct net_connection* conn =
-                    net_make_connection(&(RPC.server),mrpc_on_client,
+                struct net_connection* conn;
+                if( strcmp(poll_data->value.cli_req.addr,MRPC_LOOPBACK_ADDR) == 0 ) {
+                    poll_data->value.cli_req.loopback = 1;
+                    net_make_pipe(&(RPC.server),mrpc_on_client,poll_data,
+                        poll_data->value.cli_req.timeout);
+                    break;
+                }
+                conn = net_make_connection(&(RPC.server),mrpc_on_client,
                     poll_data->value.cli_req.addr,
                     poll_data->value.cli_req.timeout);
 
@@ -896,6 +1919,8 @@ int mrpc_init( const char* logf_name , const char* addr , int polling_time ) {
     slab_create(&(RPC.conn_slab),sizeof(struct mrpc_conn),MRPC_DEFAULT_RESERVE_MEMPOOL);
     RPC.req_q = mq_create();
     RPC.poll_q = mq_create();
+    RPC.queues = NULL;
+    RPC.cores = NULL;
     RPC.logf = fopen(logf_name,"a+");
     if( RPC.logf == NULL ) {
         slab_destroy(&(RPC.conn_slab));
@@ -917,6 +1942,29 @@ int mrpc_init( const char* logf_name , const char* addr , int polling_time ) {
 
     }
 
+    /* flow control */
+    RPC.inflight = 0;
+    RPC.max_inflight = MRPC_DEFAULT_MAX_INFLIGHT;
+    RPC.parked_head = RPC.parked_tail = NULL;
+
+    /* admission control */
+    RPC.max_queue_depth = MRPC_DEFAULT_MAX_QUEUE_DEPTH;
+    RPC.target_delay = MRPC_DEFAULT_TARGET_DELAY;
+    RPC.delay_interval = MRPC_DEFAULT_DELAY_INTERVAL;
+    RPC.above_target = 0;
+    RPC.above_target_since = 0;
+
+    /* fair queuing */
+    mrpc_set_fair_queue(MRPC_DEFAULT_FAIR_QUANTUM);
+
+    /* routing */
+    RPC.router = NULL;
+    RPC.router_data = NULL;
+    mrpc_set_starvation_limit(MRPC_DEFAULT_STARVATION_LIMIT);
+
+    /* affinity */
+    RPC.io_cpu_sz = 0;
+
     /* initialize poller callback */
     RPC.poll_tm = polling_time;
     conn = net_timer(&(RPC.server),mrpc_on_poll,NULL,polling_time);
@@ -938,6 +1986,10 @@ void
 mrpc_clean() {
     assert(MRPC_INSTANCE_NUM == 1);
     do_log("%s","[MRPC]:MRPC exit successfully!");
+    while( RPC.queues != NULL )
+        mrpc_queue_destroy(RPC.queues);
+    while( RPC.cores != NULL )
+        mrpc_core_destroy(RPC.cores);
     mq_destroy(RPC.req_q);
     mq_destroy(RPC.poll_q);
     slab_destroy(&(RPC.conn_slab));
@@ -946,8 +1998,115 @@ mrpc_clean() {
 	--MRPC_INSTANCE_NUM;
 }
 
+void mrpc_set_flow_control( size_t max_inflight ) {
+    assert(MRPC_INSTANCE_NUM == 1);
+    RPC.max_inflight = max_inflight;
+}
+
+void mrpc_set_admission( size_t max_queue_depth , int target_delay , int interval ) {
+    assert(MRPC_INSTANCE_NUM == 1);
+    RPC.max_queue_depth = max_queue_depth;
+    RPC.target_delay = target_delay;
+    RPC.delay_interval = interval;
+    RPC.above_target = 0;
+}
+
+void mrpc_set_fair_queue( size_t quantum ) {
+    struct mrpc_queue* queue;
+    RPC.fair_quantum = quantum;
+    if( quantum == 0 )
+        return;
+    mq_set_quantum(RPC.req_q,quantum);
+    for( queue = RPC.queues ; queue != NULL ; queue = queue->next )
+        mq_set_quantum(queue->q,quantum);
+}
+
+int mrpc_set_client_weight( const char* addr , unsigned int weight ) {
+    struct mrpc_queue* queue;
+    unsigned int c1,c2,c3,c4;
+    if( weight == 0 || sscanf(addr,"%u.%u.%u.%u",&c1,&c2,&c3,&c4) != 4 )
+        return -1;
+    if( c1 > 255 || c2 > 255 || c3 > 255 || c4 > 255 )
+        return -1;
+    mq_set_weight(RPC.req_q,(c1<<24)|(c2<<16)|(c3<<8)|c4,weight);
+    for( queue = RPC.queues ; queue != NULL ; queue = queue->next )
+        mq_set_weight(queue->q,(c1<<24)|(c2<<16)|(c3<<8)|c4,weight);
+    return 0;
+}
+
+void mrpc_set_router( mrpc_router_cb router , void* udata ) {
+    RPC.router_data = udata;
+    mrpc_barrier();
+    *CAST(mrpc_router_cb volatile*,&(RPC.router)) = router;
+}
+
+void mrpc_set_starvation_limit( size_t limit ) {
+    struct mrpc_queue* queue;
+    RPC.starvation_limit = limit;
+    mq_set_starvation_limit(RPC.req_q,limit);
+    for( queue = RPC.queues ; queue != NULL ; queue = queue->next )
+        mq_set_starvation_limit(queue->q,limit);
+}
+
+int mrpc_set_thread_affinity( const int* cpus , size_t n ) {
+    size_t i;
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+    for( i = 0 ; i < n ; ++i ) {
+        if( cpus[i] < 0 || cpus[i] >= CAST(int,sizeof(mask)*8) )
+            return -1;
+        mask |= CAST(DWORD_PTR,1) << cpus[i];
+    }
+    if( mask == 0 )
+        return -1;
+    return SetThreadAffinityMask(GetCurrentThread(),mask) == 0 ? -1 : 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for( i = 0 ; i < n ; ++i ) {
+        if( cpus[i] < 0 || cpus[i] >= CPU_SETSIZE )
+            return -1;
+        CPU_SET(cpus[i],&set);
+    }
+    if( n == 0 )
+        return -1;
+    /* pid 0 is the calling thread */
+    return sched_setaffinity(0,sizeof(set),&set);
+#else
+    i = n;
+    cpus = cpus;
+    return -1;
+#endif /* _WIN32 */
+}
+
+int mrpc_set_io_affinity( const int* cpus , size_t n ) {
+    size_t i;
+    if( n == 0 || n > MRPC_MAX_AFFINITY_CPU )
+        return -1;
+    for( i = 0 ; i < n ; ++i ) {
+        if( cpus[i] < 0 )
+            return -1;
+    }
+    memcpy(RPC.io_cpus,cpus,sizeof(int)*n);
+    RPC.io_cpu_sz = n;
+    return 0;
+}
+
+size_t mrpc_get_io_affinity( int* cpus , size_t cap ) {
+    size_t n = MIN(cap,RPC.io_cpu_sz);
+    memcpy(cpus,RPC.io_cpus,sizeof(int)*n);
+    return n;
+}
+
+size_t mrpc_queue_depth( int lane ) {
+    assert( lane >= 0 && lane < MRPC_PRIORITY_SIZE );
+    return mq_lane_size(RPC.req_q,lane);
+}
+
 int mrpc_run() {
     int inter;
+    if( RPC.io_cpu_sz != 0 && mrpc_set_thread_affinity(RPC.io_cpus,RPC.io_cpu_sz) != 0 )
+        do_log("[MRPC]:Cannot set the affinity of the IO thread");
     for( ;; ) {
         if( net_server_poll(&(RPC.server),-1,&inter) < 0 ) {
             do_log("[MRPC]:Network error:%s",strerror(errno));
@@ -964,8 +2123,14 @@ int mrpc_run() {
 
 void mrpc_interrupt() {
     if( MRPC_INSTANCE_NUM == 1 ) {
+        struct mrpc_queue* queue;
+        struct mrpc_core* core;
         net_server_wakeup(&(RPC.server));
+        for( core = RPC.cores ; core != NULL ; core = core->next )
+            net_server_wakeup(&(core->server));
         mq_wakeup(RPC.req_q);
+        for( queue = RPC.queues ; queue != NULL ; queue = queue->next )
+            mq_wakeup(queue->q);
     }
 }
 
@@ -1010,14 +2175,10 @@ void mrpc_varchar_destroy( struct mrpc_varchar* varchar ) {
 /* client function */
 static
 void gen_transaction_id( char transaction_id[4] ) {
-    srand(CAST(unsigned int,time(NULL)));
-    transaction_id[0] = rand() % 255;
-    srand(transaction_id[1]);
-    transaction_id[1] = rand() % 255;
-    srand(transaction_id[2]);
-    transaction_id[2] = rand() % 255;
-    srand(transaction_id[3]);
-    transaction_id[3] = rand() % 255;
+    static volatile unsigned int STREAM_ID = 0;
+    /* small ids keep the varint stream id of version 2 short. The client
+     * threads draw from it concurrently , an id must never repeat */
+    mrpc_stream_id_set(transaction_id,mrpc_atomic_inc(&STREAM_ID));
 }
 
 static
@@ -1032,21 +2193,33 @@ void mrpc_request_clean( struct mrpc_request* req ) {
 }
 
 static
-void* mrpc_request_vserialize( size_t* len , int method_type ,const char* method_name , const char* par_fmt , va_list vl ) {
+void* mrpc_request_vserialize( size_t* len , int timeout , int method_type , int method_id ,
+                               const char* method_name , const char* par_fmt , va_list vl ) {
     struct mrpc_request req;
     void* seria_data = NULL;
     int i ;
 
     /* set request method type */
+    req.version = MRPC_WIRE_VERSION;
     req.method_type = method_type;
 
+    /* the time budget travels with the request , so the server can drop it
+     * once the caller has given up */
+    req.timeout = timeout > 0 ? timeout : 0;
+
     /* generate transaction id here */
     gen_transaction_id(req.transaction_id);
 
-    /* method name */
-    assert( strlen(method_name) < MRPC_MAX_METHOD_NAME_LEN );
-    req.method_name_len = strlen(method_name);
-    strcpy(req.method_name,method_name);
+    /* method name , or the id when the caller knows it */
+    req.method_id = method_id;
+    if( method_id >= 0 ) {
+        req.method_name[0] = 0;
+        req.method_name_len = 0;
+    } else {
+        assert( strlen(method_name) < MRPC_MAX_METHOD_NAME_LEN );
+        req.method_name_len = strlen(method_name);
+        strcpy(req.method_name,method_name);
+    }
 
     /* parameter list */
     req.par_size = 0;
@@ -1080,24 +2253,12 @@ fail:
     return NULL;
 }
 
-/* async send */
-int mrpc_request_async( mrpc_request_async_cb cb , void* udata , int timeout, 
-                        const char* addr, int method_type , const char* method_name ,
-                        const char* par_fmt , ... ) {
-
-    void* req_data;
-    size_t data_len;
-    va_list vlist;
+/* Hand a serialized request to the IO thread */
+static
+void mrpc_request_post( mrpc_request_async_cb cb , void* udata , int timeout ,
+                        const char* addr , void* req_data , size_t data_len ) {
     struct mrpc_poll_data* req;
 
-
-    va_start(vlist,par_fmt);
-
-    req_data = mrpc_request_vserialize(&data_len,method_type,method_name,par_fmt,vlist);
-    if( req_data == NULL ) {
-        return -1;
-    } 
-
     req = malloc(sizeof(*req));
     VERIFY(req);
 
@@ -1108,10 +2269,52 @@ int mrpc_request_async( mrpc_request_async_cb cb , void* udata , int timeout,
     req->value.cli_req.cb = cb;
     strcpy(req->value.cli_req.addr,addr);
     req->value.cli_req.timeout = timeout;
+    req->value.cli_req.loopback = 0;
 
     /* sending into the internal queue */
     mq_enqueue( RPC.poll_q , req );
+}
+
+/* async send */
+int mrpc_request_async( mrpc_request_async_cb cb , void* udata , int timeout, 
+                        const char* addr, int method_type , const char* method_name ,
+                        const char* par_fmt , ... ) {
+    va_list vlist;
+    int ret;
+    va_start(vlist,par_fmt);
+    ret = mrpc_request_vasync(cb,udata,timeout,addr,method_type,method_name,par_fmt,vlist);
+    va_end(vlist);
+    return ret;
+}
+
+int mrpc_request_async_id( mrpc_request_async_cb cb , void* udata , int timeout,
+                           const char* addr, int method_type , int method_id ,
+                           const char* par_fmt , ... ) {
+    va_list vlist;
+    void* req_data;
+    size_t data_len;
+    assert( method_id >= 0 );
+    va_start(vlist,par_fmt);
+    req_data = mrpc_request_vserialize(&data_len,timeout,method_type,method_id,NULL,par_fmt,vlist);
+    va_end(vlist);
+    if( req_data == NULL )
+        return -1;
+    mrpc_request_post(cb,udata,timeout,addr,req_data,data_len);
+    return 0;
+}
+
+int mrpc_request_vasync( mrpc_request_async_cb cb , void* udata , int timeout, 
+                         const char* addr, int method_type , const char* method_name ,
+                         const char* par_fmt , va_list vlist ) {
+
+    void* req_data;
+    size_t data_len;
 
+    req_data = mrpc_request_vserialize(&data_len,timeout,method_type,-1,method_name,par_fmt,vlist);
+    if( req_data == NULL ) {
+        return -1;
+    } 
+    mrpc_request_post(cb,udata,timeout,addr,req_data,data_len);
     return 0;
 }
 
@@ -1149,6 +2352,7 @@ int mrpc_request_do_recv( socket_t fd , struct mrpc_response* resp ) {
     size_t buf_cap = STACK_BUFF_SIZE;
     size_t buf_sz = 0;
     size_t pkg_sz = 0;
+    int pkg_ret;
 
     while(1) {
         ret = recv(fd,buf+buf_sz,buf_cap-buf_sz,0);
@@ -1161,7 +2365,12 @@ int mrpc_request_do_recv( socket_t fd , struct mrpc_response* resp ) {
             }
         }
 
-        if( mrpc_get_package_size(buf,ret+buf_sz,&pkg_sz) == 0 ) {
+        pkg_ret = mrpc_get_package_size(buf,ret+buf_sz,&pkg_sz);
+        if( pkg_ret == -2 ) {
+            ret = -1;
+            break;
+        }
+        if( pkg_ret == 0 ) {
             if( pkg_sz > STACK_BUFF_SIZE ) {
                 hbuf = malloc(pkg_sz);
                 VERIFY(hbuf);
@@ -1207,7 +2416,8 @@ int mrpc_request( const char* addr , int method_type , const char* method_name ,
     assert( method_type == MRPC_FUNCTION || method_type == MRPC_NOTIFICATION );
 
     va_start(vl,par_fmt);
-    seria_data = mrpc_request_vserialize(&seria_sz,method_type,method_name,par_fmt,vl);
+    seria_data = mrpc_request_vserialize(&seria_sz,0,method_type,-1,method_name,par_fmt,vl);
+    va_end(vl);
     if( seria_data == NULL )
         return -1;
 
@@ -1241,5 +2451,212 @@ done:
 void* mrpc_request_serialize( size_t* len , int method_type , const char* method_name , const char* par_fmt, ... ) {
     va_list vl;
     va_start(vl,par_fmt);
-    return mrpc_request_vserialize(len,method_type,method_name,par_fmt,vl);
+    return mrpc_request_vserialize(len,0,method_type,-1,method_name,par_fmt,vl);
+}
+
+void mrpc_set_wire_version( int version ) {
+    assert( version == 1 || version == 2 );
+    MRPC_WIRE_VERSION = version;
+}
+
+int mrpc_request_method_id( const char* addr , const char* method_name ) {
+    struct mrpc_response res;
+    if( mrpc_request(addr,MRPC_FUNCTION,MRPC_METHOD_ID_QUERY,&res,"%s",method_name) != 0 )
+        return -1;
+    if( res.error_code != MRPC_EC_OK || res.result.type != MRPC_UINT )
+        return -1;
+    return CAST(int,res.result.value.uinteger);
+}
+
+/* Prepared calls , the method part of the frame is encoded and the parameter
+ * format is parsed once */
+struct mrpc_prepared {
+    int version;
+    int method_type;
+    int method_id;
+    char method[1+MRPC_MAX_METHOD_NAME_LEN]; /* encoded method name or id */
+    size_t method_sz;
+    int par_type[MRPC_MAX_PARAMETER_SIZE];
+    size_t par_size;
+};
+
+static
+struct mrpc_prepared* mrpc_prepare_method( int method_type , const char* method_name ,
+                                           int method_id , const char* par_fmt ) {
+    struct mrpc_prepared* p;
+    size_t len = method_name != NULL ? strlen(method_name) : 0;
+    int i;
+
+    assert( method_type == MRPC_FUNCTION || method_type == MRPC_NOTIFICATION );
+    if( method_id < 0 && (len == 0 || len >= MRPC_MAX_METHOD_NAME_LEN) )
+        return NULL;
+
+    p = malloc(sizeof(*p));
+    VERIFY(p);
+    p->version = MRPC_WIRE_VERSION;
+    p->method_type = method_type;
+    p->method_id = method_id;
+    if( method_id >= 0 ) {
+        p->method_sz = encode_uint(CAST(unsigned int,method_id),p->method);
+    } else {
+        encode_byte(CAST(char,len),p->method);
+        memcpy(p->method+1,method_name,len);
+        p->method_sz = 1+len;
+    }
+
+    p->par_size = 0;
+    for( i = 0 ; par_fmt[i] ; ++i ) {
+        if( par_fmt[i] != '%' )
+            continue;
+        if( p->par_size == MRPC_MAX_PARAMETER_SIZE )
+            goto fail;
+        switch(par_fmt[i+1]) {
+        case 'd': p->par_type[p->par_size] = MRPC_INT; break;
+        case 'u': p->par_type[p->par_size] = MRPC_UINT; break;
+        case 's': p->par_type[p->par_size] = MRPC_VARCHAR; break;
+        default: goto fail;
+        }
+        ++i;
+        ++p->par_size;
+    }
+    return p;
+fail:
+    free(p);
+    return NULL;
+}
+
+struct mrpc_prepared* mrpc_prepare( int method_type , const char* method_name , const char* par_fmt ) {
+    return mrpc_prepare_method(method_type,method_name,-1,par_fmt);
+}
+
+struct mrpc_prepared* mrpc_prepare_id( int method_type , int method_id , const char* par_fmt ) {
+    assert( method_id >= 0 );
+    return mrpc_prepare_method(method_type,NULL,method_id,par_fmt);
+}
+
+void mrpc_prepared_destroy( struct mrpc_prepared* p ) {
+    free(p);
+}
+
+/* The strings are referenced , not copied , the frame is written before the
+ * call returns */
+static
+size_t mrpc_prepared_args( const struct mrpc_prepared* p , struct mrpc_val* par , va_list vl ) {
+    size_t sz = 0;
+    size_t i;
+    for( i = 0 ; i < p->par_size ; ++i ) {
+        par[i].type = p->par_type[i];
+        switch(p->par_type[i]) {
+        case MRPC_INT:
+            par[i].value.integer = va_arg(vl,int);
+            break;
+        case MRPC_UINT:
+            par[i].value.uinteger = va_arg(vl,unsigned int);
+            break;
+        default:
+            mrpc_varchar_create(&(par[i].value.varchar),va_arg(vl,const char*),1);
+            break;
+        }
+        sz += mrpc_cal_val_size(par+i);
+    }
+    return sz;
+}
+
+/* Frame size of a prepared call , body is the size after the length field */
+static
+size_t mrpc_prepared_size( const struct mrpc_prepared* p , int timeout ,
+                           unsigned int stream_id , size_t par_sz , size_t* body ) {
+    size_t sz = p->method_sz + par_sz;
+    if( timeout > 0 )
+        sz += encode_size_uint(CAST(unsigned int,timeout));
+    if( p->version == 2 ) {
+        sz += 1 + encode_size_uint(stream_id);
+        *body = sz;
+        return 1 + encode_size_varsize(sz) + sz;
+    }
+    sz += 1 + 4;
+    *body = 0;
+    return sz + (encode_size_size(sz+1) == 1 ? 1 : 1 + sizeof(size_t));
+}
+
+static
+void mrpc_prepared_write( const struct mrpc_prepared* p , int timeout , unsigned int stream_id ,
+                          const struct mrpc_val* par , size_t body , void* buf , size_t sz ) {
+    char* data = CAST(char*,buf);
+    size_t i;
+
+    if( p->version == 2 ) {
+        int flags = 0;
+        if( p->method_type == MRPC_NOTIFICATION )
+            flags |= MRPC_V2_NOTIFICATION;
+        if( p->method_id >= 0 )
+            flags |= MRPC_V2_METHOD_ID;
+        if( timeout > 0 )
+            flags |= MRPC_V2_DEADLINE;
+        *data++ = CAST(char,MRPC_V2_BYTE);
+        data += encode_varsize(body,data);
+        *data++ = CAST(char,flags);
+        data += encode_uint(stream_id,data);
+    } else {
+        *data++ = CAST(char,p->method_type | (timeout > 0 ? MRPC_FLAG_DEADLINE : 0) |
+            (p->method_id >= 0 ? MRPC_FLAG_METHOD_ID : 0));
+        data += encode_size(sz,data,sz-1);
+        mrpc_stream_id_set(data,stream_id);
+        data += 4;
+    }
+    if( timeout > 0 )
+        data += encode_uint(CAST(unsigned int,timeout),data);
+    memcpy(data,p->method,p->method_sz);
+    data += p->method_sz;
+    for( i = 0 ; i < p->par_size ; ++i )
+        data += mrpc_encode_val(par+i,data);
+    assert( CAST(size_t,data-CAST(char*,buf)) == sz );
+}
+
+size_t mrpc_call_prepared( const struct mrpc_prepared* p , void* buf , size_t buf_sz ,
+                           int timeout , ... ) {
+    struct mrpc_val par[MRPC_MAX_PARAMETER_SIZE];
+    char transaction_id[4];
+    unsigned int stream_id;
+    size_t body;
+    size_t sz;
+    size_t max_sz;
+    va_list vl;
+
+    va_start(vl,timeout);
+    sz = mrpc_prepared_args(p,par,vl);
+    va_end(vl);
+    /* a probe gets the size of the longest stream id , so the retry fits
+     * whatever id it is given , the id is only taken once the frame fits */
+    max_sz = mrpc_prepared_size(p,timeout,UINT_MAX,sz,&body);
+    if( max_sz > buf_sz )
+        return max_sz;
+    gen_transaction_id(transaction_id);
+    stream_id = mrpc_stream_id(transaction_id);
+    sz = mrpc_prepared_size(p,timeout,stream_id,sz,&body);
+    mrpc_prepared_write(p,timeout,stream_id,par,body,buf,sz);
+    return sz;
+}
+
+int mrpc_request_async_prepared( mrpc_request_async_cb cb , void* udata , int timeout ,
+                                 const char* addr , const struct mrpc_prepared* p , ... ) {
+    struct mrpc_val par[MRPC_MAX_PARAMETER_SIZE];
+    char transaction_id[4];
+    unsigned int stream_id;
+    size_t body;
+    size_t sz;
+    void* data;
+    va_list vl;
+
+    va_start(vl,p);
+    sz = mrpc_prepared_args(p,par,vl);
+    va_end(vl);
+    gen_transaction_id(transaction_id);
+    stream_id = mrpc_stream_id(transaction_id);
+    sz = mrpc_prepared_size(p,timeout,stream_id,sz,&body);
+    data = malloc(sz);
+    VERIFY(data);
+    mrpc_prepared_write(p,timeout,stream_id,par,body,data,sz);
+    mrpc_request_post(cb,udata,timeout,addr,data,sz);
+    return 0;
 }
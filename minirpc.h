@@ -2,6 +2,7 @@
 #define MINIRPC_H_
 #include <stddef.h>
 #include <stdint.h>
+#include <stdarg.h>
 
 /* The following macro is used to define rpc specific configuration.
  * The user could change it to adapt its requirement */
@@ -9,10 +10,26 @@
 #define MRPC_MAX_LOCAL_VAR_CHAR_LEN 16 /* Small string optimization length */
 #define MRPC_MAX_METHOD_NAME_LEN 128   /* The max method name supported */
 #define MRPC_MAX_PARAMETER_SIZE 16     /* The max parameter size for a function  call */
+#define MRPC_MAX_METHOD_ID 1024        /* The max number of methods having a numeric id */
 
 #define MRPC_DEFAULT_TIMEOUT_CLOSE 15000 /* The default time out close for server */
 #define MRPC_DEFAULT_OUTBAND_SIZE 100    /* The default number of how many data is allowed to send out outstanding */
 #define MRPC_DEFAULT_RESERVE_MEMPOOL 50  /* The default memory pool initial size */
+#define MRPC_DEFAULT_MAX_INFLIGHT 0      /* The default max requests being served at once, 0 means no limit */
+#define MRPC_EDF_QUEUE_DEPTH 32          /* Queue depth from which requests are ordered by their deadline */
+#define MRPC_DEFAULT_MAX_QUEUE_DEPTH 0   /* Queued requests that trigger overload rejection, 0 means no limit */
+#define MRPC_DEFAULT_TARGET_DELAY 0      /* Acceptable queueing delay in milliseconds, 0 disables the delay check */
+#define MRPC_DEFAULT_DELAY_INTERVAL 100  /* How long the delay must stay above the target before rejecting */
+#define MRPC_DEFAULT_FAIR_QUANTUM 1024   /* Request bytes a client may have dequeued per round robin turn */
+#define MRPC_DEFAULT_STARVATION_LIMIT 16 /* Times a priority lane can be passed over before it is served */
+
+/* The address of the in-process loopback transport. A request issued by
+ * mrpc_request_async to this address is served by the local MRPC server
+ * through a memory pipe, so the full request path runs without any kernel
+ * socket involved. There is no connect to bound , so the timeout of the call
+ * bounds the wait for the response , the callback gets a NULL response once
+ * it is over. The blocking mrpc_request cannot use it. */
+#define MRPC_LOOPBACK_ADDR "loopback"
 
 /* Method type */
 enum {
@@ -20,6 +37,14 @@ enum {
     MRPC_NOTIFICATION = 2 /* Notification represent a one way message send */
 };
 
+/* Priority lane of a request, a lower value is dequeued first */
+enum {
+    MRPC_PRIORITY_HIGH = 0,  /* latency critical calls , health check , lookup */
+    MRPC_PRIORITY_NORMAL,    /* the default */
+    MRPC_PRIORITY_LOW,       /* bulk or batch calls */
+    MRPC_PRIORITY_SIZE
+};
+
 /* Supported type comes here */
 enum {
     MRPC_UINT = 1,
@@ -95,19 +120,78 @@ struct mrpc_request {
     int method_type;
     char transaction_id[4];
     size_t length;
+    int timeout;      /* time budget of the caller in milliseconds, 0 means none */
+    int arrival_time; /* local millisecond clock when the request is received */
     size_t par_size;
     struct mrpc_val par[MRPC_MAX_PARAMETER_SIZE];
+    unsigned int method_hash; /* mrpc_hash of the method name */
+    int method_id; /* the method id carried by the frame , -1 when it carries the name */
+    int version; /* frame version , the response is written in the same one */
+    /* The method name , method_name_len bytes. In a view it references the
+     * frame , method_name is left empty and the strings of par are not null
+     * terminated , their val references the frame as well. A view is valid
+     * until the response is sent. See mrpc_route.view */
+    const char* method;
+    int view;
+    /* The encoded parameter list in the frame , read by mrpc_req_next_param
+     * and mrpc_req_param_at */
+    const char* par_data;
+    size_t par_data_len;
+};
+
+/* Lazy parameter access. The parameters of a request are decoded on demand
+ * from the frame , a value is a view , its string is not null terminated and
+ * it is valid until the response is sent. They work whether or not par is
+ * filled , see mrpc_route.lazy */
+struct mrpc_param_iter {
+    const struct mrpc_request* req;
+    size_t pos;
+    /* index[i] is the offset of the ith parameter , the offsets of the first
+     * index_sz+1 parameters are known so far */
+    size_t index[MRPC_MAX_PARAMETER_SIZE+1];
+    size_t index_sz;
 };
 
+void mrpc_req_param_iter( const struct mrpc_request* req , struct mrpc_param_iter* iter );
+
+/* Decode the next parameter. Return 1 on success , 0 at the end of the list
+ * and -1 when the parameter is broken */
+int mrpc_req_next_param( struct mrpc_param_iter* iter , struct mrpc_val* val );
+
+/* Decode the parameter at index of the iterator's request , the offsets found
+ * on the way are cached in the iterator so a later call doesn't scan the list
+ * again , the request itself is left untouched. It doesn't move the iterator
+ * of mrpc_req_next_param. Return 0 on success and -1 when there is no such
+ * parameter , an index is valid below MRPC_MAX_PARAMETER_SIZE */
+int mrpc_req_param_at( struct mrpc_param_iter* iter , size_t index , struct mrpc_val* val );
+
+/* FNV-1a hash , the method name of a request is hashed once when it is parsed */
+unsigned int mrpc_hash( const void* data , size_t len );
+
+/* Method ids. A frame may carry a small integer instead of the method name ,
+ * the server looks the method up by indexing an array. The id of a method is
+ * assigned when it is first registered and never changes while the process
+ * runs. A client asks for it once with the built-in MRPC_METHOD_ID_QUERY call ,
+ * which takes the method name and replies its id , and caches the answer.
+ *
+ * mrpc_method_id registers the method name and returns its id , or -1 when
+ * MRPC_MAX_METHOD_ID ids are used up. It is not thread safe with itself , the
+ * service registers its methods under its own lock. */
+#define MRPC_METHOD_ID_QUERY "mrpc.method_id"
+
+int mrpc_method_id( const char* method_name );
+
 /* A response object, it represents a response object from the peer */
 struct mrpc_response {
     int method_type;
     char method_name[MRPC_MAX_METHOD_NAME_LEN];
-    size_t method_name_len;
+    size_t method_name_len; /* 0 when the request carries the method id */
     size_t length;
     char transaction_id[4];
     struct mrpc_val result;
     int error_code;
+    int method_id; /* -1 when the frame carries the method name */
+    int version; /* frame version */
 };
 
 /* error code
@@ -127,7 +211,10 @@ enum {
     MRPC_EC_OK = 0,
     MRPC_EC_FUNCTION_NOT_FOUND,
     MRPC_EC_FUNCTION_INVALID_PARAMETER_SIZE,
-    MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE
+    MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE,
+    MRPC_EC_DEADLINE_EXCEEDED, /* the caller gave up before the request gets executed */
+    MRPC_EC_OVERLOADED, /* the server rejects the request without queueing it, retry elsewhere */
+    MRPC_EC_FUNCTION_NOT_SUPPORTED /* the method can't run in the execution mode that read the request */
 };
 
 /* Initialize the mini-rpc */
@@ -136,9 +223,140 @@ int mrpc_init( const char* logf_name , const char* addr , int polling_time );
 /* Clean the MRPC, it could be optional if after stop MRPC, you will exit the process */
 void mrpc_clean();
 
+/* Flow control, call it after mrpc_init and before mrpc_run.
+ * max_inflight bounds the requests that are queued, executing or waiting for
+ * their reply to be written. The limit is global to the process, it is not
+ * per connection: a connection carries a single request and reads nothing
+ * else until its reply is written, so there is nothing to bound per
+ * connection and the count is taken over all of them. Requests received
+ * above it are parked on the IO thread and queued in the order they came in
+ * once the in-flight count drops, 0 means no limit. */
+void mrpc_set_flow_control( size_t max_inflight );
+
+/* Admission control, call it after mrpc_init and before mrpc_run.
+ * The IO thread answers a new request with MRPC_EC_OVERLOADED at once, without
+ * queueing it, when either check trips :
+ * (1) max_queue_depth requests are waiting in the request queue.
+ * (2) CoDel style : the oldest queued request has waited longer than target_delay
+ *     milliseconds for at least interval milliseconds. It stops rejecting as soon
+ *     as the queueing delay goes below target_delay again.
+ * A zero max_queue_depth or target_delay disables the corresponding check. */
+void mrpc_set_admission( size_t max_queue_depth , int target_delay , int interval );
+
+/* Fair queuing, call it after mrpc_init and before mrpc_run.
+ * Requests are queued per client , a client is tagged by its IPv4 address.
+ * Workers drain the clients by deficit round robin , each turn a client may
+ * have quantum*weight bytes of requests dequeued, so a bursting client only
+ * delays itself. A zero quantum makes the request queue a single FIFO.
+ * The weight of a client is 1 unless it is configured by mrpc_set_client_weight
+ * with its dotted address , e.g "10.0.0.1". */
+void mrpc_set_fair_queue( size_t quantum );
+int mrpc_set_client_weight( const char* addr , unsigned int weight );
+
+/* Extra request queue. Requests are put into the default request queue unless
+ * the router sends them into an extra queue , which is drained by its own
+ * workers through mrpc_queue_(try|timed)_recv. Those functions behave just like
+ * mrpc_request_(try|timed)_recv. Queues must be created after mrpc_init and before
+ * mrpc_run , the ones left are destroyed by mrpc_clean. */
+struct mrpc_queue;
+
+struct mrpc_queue* mrpc_queue_create();
+void mrpc_queue_destroy( struct mrpc_queue* );
+int mrpc_queue_try_recv( struct mrpc_queue* , struct mrpc_request* req , void** );
+int mrpc_queue_recv( struct mrpc_queue* , struct mrpc_request* req , void** );
+int mrpc_queue_timed_recv( struct mrpc_queue* , struct mrpc_request* req , void** , int msec );
+
+/* Post a task to the workers of a queue , NULL means the default queue. The
+ * worker receiving it gets 3 from the recv function with the task in the
+ * second argument , the request object is left untouched. Tasks go ahead of
+ * the normal requests , they are used to resume the work of a request. */
+void mrpc_queue_post( struct mrpc_queue* , void* task );
+
+/* Number of requests waiting in a queue , NULL means the default queue */
+size_t mrpc_queue_size( struct mrpc_queue* );
+
+/* Request routing. The router is called on the IO thread once a request is
+ * received and before it is queued. The method name is _NOT_ null terminated.
+ * The route is preset to the defaults , the router only changes what it needs.
+ * The router must be fast and must not block , since it stalls the IO thread. */
+typedef void (*mrpc_inline_cb)( const struct mrpc_request* req , void* key , void* udata );
+
+struct mrpc_route {
+    unsigned int method_hash; /* input , mrpc_hash of the method name */
+    int method_id; /* input , the method id of the frame or -1 */
+    int lane; /* MRPC_PRIORITY_XXX , defaults to MRPC_PRIORITY_NORMAL */
+    struct mrpc_queue* queue; /* target queue , defaults to NULL , the default queue */
+    /* When exec is set , the request bypasses the queues and exec is called on
+     * the IO thread right away. It answers through mrpc_response_send as usual
+     * and the response is written into the connection without another hop.
+     * Only cheap , non blocking work belongs there. Defaults to NULL */
+    mrpc_inline_cb exec;
+    void* exec_data;
+    /* Key affinity. When key_par is set , the parameter at that index is hashed
+     * and the request goes to key_queues[ hash % key_queue_sz ] instead of queue ,
+     * so the requests carrying the same key meet the same queue. A request
+     * without such a parameter goes to the first one. Defaults to -1 */
+    int key_par;
+    struct mrpc_queue* const* key_queues;
+    size_t key_queue_sz;
+    /* When view is set , the request is parsed as a view , the method name and
+     * the string parameters are not copied out of the frame. Defaults to 0 */
+    int view;
+    /* When lazy is set , par is left empty and par_size is 0 , the handler
+     * reads the parameters it needs with mrpc_req_param_at or
+     * mrpc_req_next_param. Defaults to 0 */
+    int lazy;
+};
+
+typedef void (*mrpc_router_cb)( const char* method_name , size_t method_name_len ,
+                                struct mrpc_route* route , void* udata );
+
+/* The router can be set from any thread while mrpc_run is running */
+void mrpc_set_router( mrpc_router_cb router , void* udata );
+
+/* A lower priority lane that has been passed over limit times in a row gets one
+ * request dequeued ahead of the higher lanes , 0 means strict priority */
+void mrpc_set_starvation_limit( size_t limit );
+
+/* Number of requests waiting in a priority lane of the default queue , it is
+ * a snapshot */
+size_t mrpc_queue_depth( int lane );
+
+/* CPU affinity. The IO thread , the one calling mrpc_run , is pinned to the
+ * given CPUs once mrpc_run starts. Memory is placed on the NUMA node of the
+ * thread that first touches it , so a pinned thread keeps its own buffers on
+ * its local node. The IO set is kept so the workers can be placed next to the
+ * IO thread , see mrpc_service_set_affinity. Those functions return -1 when the
+ * platform doesn't support affinity or a CPU is out of range. */
+#define MRPC_MAX_AFFINITY_CPU 64
+int mrpc_set_io_affinity( const int* cpus , size_t n );
+
+/* Copy the IO set into cpus , return the number of CPUs , 0 means not pinned */
+size_t mrpc_get_io_affinity( int* cpus , size_t cap );
+
+/* Pin the calling thread */
+int mrpc_set_thread_affinity( const int* cpus , size_t n );
+
 /* ----------------------------------------
  * Server side
  * --------------------------------------*/
+
+/* Thread per core mode. A core is a reactor with its own listener , it is run
+ * by mrpc_core_run in a dedicated thread until mrpc_interrupt is called. Every
+ * request it reads is executed right there by exec , like an inline route , and
+ * no queue is shared with the main reactor or the other cores. Several cores
+ * listen on the same address ( SO_REUSEPORT ) and the kernel balances the
+ * connections among them , so pass a NULL address to mrpc_init in this mode.
+ * Cores are created after mrpc_init and before the threads start , the ones
+ * left are destroyed by mrpc_clean. mrpc_core_create returns NULL when the
+ * address can't be shared on this platform. A core doesn't write the log , its
+ * connections are closed on error and mrpc_core_run returns -1 with errno set
+ * when the reactor fails. */
+struct mrpc_core;
+
+struct mrpc_core* mrpc_core_create( const char* addr , mrpc_inline_cb exec , void* udata );
+void mrpc_core_destroy( struct mrpc_core* );
+int mrpc_core_run( struct mrpc_core* );
  
  /* Run means run it until the interrupt called or error (cannot recover) happened */
 int mrpc_run();
@@ -167,16 +385,31 @@ void mrpc_interrupt();
  * will block until a data is there .
  * However, due to user calls mrpc_interrupt, this function may still return without
  * any data available.
- * Return 0 : success ; return 1 : interruption ; return -1: failed. 
+ * Return 0 : success ; return 1 : interruption ; return -1: failed ;
+ * return 3 : a task posted by mrpc_queue_post.
  */
 int mrpc_request_try_recv( struct mrpc_request* req , void** );
 int mrpc_request_recv( struct mrpc_request* req , void** );
 
+/* Same as mrpc_request_recv but gives up after roughly msec milliseconds ,
+ * return 2 : timeout */
+int mrpc_request_timed_recv( struct mrpc_request* req , void** , int msec );
+
+/* Answer a request. The result is encoded into the response before it returns ,
+ * it stays owned by the caller , which releases what it allocated for it */
 void mrpc_response_send( const struct mrpc_request* req , void* , const struct mrpc_val* result , int ec );
 
 /* This function is used to finish a indication request */
 void mrpc_response_done( void* );
 
+/* Return 1 if the caller of this request has already given up on it, a
+ * dispatcher should answer it with MRPC_EC_DEADLINE_EXCEEDED instead of
+ * executing it */
+int mrpc_request_expired( const struct mrpc_request* req );
+
+/* Milliseconds since the request is received , it covers the queueing delay */
+int mrpc_request_elapsed( const struct mrpc_request* req );
+
 /* Writing the log into the MRPC server log file */
 void mrpc_write_log( const char* fmt , ... );
 
@@ -199,10 +432,56 @@ int mrpc_request_async( mrpc_request_async_cb cb , void* data , int timeout ,
                         const char* addr, int method_type , const char* method_name ,
                         const char* par_fmt , ... );
 
+/* The va_list version of mrpc_request_async */
+int mrpc_request_vasync( mrpc_request_async_cb cb , void* data , int timeout , 
+                         const char* addr, int method_type , const char* method_name ,
+                         const char* par_fmt , va_list );
+
+/* mrpc_request_async , but the frame carries the method id instead of the name */
+int mrpc_request_async_id( mrpc_request_async_cb cb , void* data , int timeout ,
+                           const char* addr, int method_type , int method_id ,
+                           const char* par_fmt , ... );
+
+/* Frame version of the requests sent by this process , 1 by default. Version 2
+ * has a compact header : a version byte , varint length , flags and stream id ,
+ * and the response doesn't echo the method. A server reads both versions and
+ * answers a request in the version it comes in , but a server that predates
+ * version 2 can't read it and nothing negotiates the version , so set it to 2
+ * only when every server the process calls reads version 2 */
+void mrpc_set_wire_version( int version );
+
+/* Ask the server at addr for the id of a method , it blocks. Returns -1 when
+ * the method is not known */
+int mrpc_request_method_id( const char* addr , const char* method_name );
+
 /* This function is used to serialize the data into the buffer. the returned value is
  * malloced on heap, after sending it, the user needs to call free function to free it */
 void* mrpc_request_serialize( size_t* len , int method_type, const char* method_name , const char* par_fmt, ... );
 
+/* Prepared calls. A hot call site prepares its method once , the method name
+ * or id is encoded and the parameter format is parsed up front , so a call
+ * only encodes the header and the parameters.
+ *
+ * mrpc_call_prepared writes a request frame into buf and returns its size.
+ * When buf_sz may be too small nothing is written and the largest size the
+ * frame can take is returned , a buffer of that size always fits. The parameters follow the format given to mrpc_prepare ,
+ * a timeout larger than 0 travels with the request as its deadline.
+ *
+ * mrpc_request_async_prepared is mrpc_request_async on a prepared call.
+ * A prepared call is bound to the wire version when it is prepared , and it
+ * can be used by many threads at once */
+struct mrpc_prepared;
+
+struct mrpc_prepared* mrpc_prepare( int method_type , const char* method_name , const char* par_fmt );
+struct mrpc_prepared* mrpc_prepare_id( int method_type , int method_id , const char* par_fmt );
+void mrpc_prepared_destroy( struct mrpc_prepared* );
+
+size_t mrpc_call_prepared( const struct mrpc_prepared* p , void* buf , size_t buf_sz ,
+                           int timeout , ... );
+
+int mrpc_request_async_prepared( mrpc_request_async_cb cb , void* data , int timeout ,
+                                 const char* addr , const struct mrpc_prepared* p , ... );
+
 /* Deserialize the input data into a struct mrpc_response_t object */
 int mrpc_response_parse( void* buf , size_t sz , struct mrpc_response* r );
 
@@ -218,7 +497,8 @@ int mrpc_response_parse( void* buf , size_t sz , struct mrpc_response* r );
  * extract the size of package within the partial data. You could feed this function with
  * any length data , once this function figure out how large a package should be , it 
  * will return 0 , then you just need to loop your read until the full package is received
- * and then call with other parse routine. */
+ * and then call with other parse routine. It returns -1 when more data is needed to tell
+ * the size , and -2 when the data doesn't start with a valid frame header. */
 
 int mrpc_get_package_size( void* buf , size_t sz , size_t* len );
 
@@ -65,7 +65,7 @@ int decode_uint( unsigned int* val , const char* buf , size_t len ) {
 
 #define RET(X) \
     do { \
-        if( !(buf[0] & (1<<8)) ) \
+        if( !(buf[0] & (1<<7)) ) \
             return X; \
         ++buf; \
         --plen; \
@@ -140,6 +140,30 @@ int decode_size( size_t* val , const char* buf , size_t len ) {
     }
 }
 
+int encode_varsize( size_t val , char buf[VARSIZE_MAX_LEN] ) {
+    int i = 0;
+    while( val > 127 ) {
+        buf[i++] = CAST(char,(val & 127) | 128);
+        val >>= 7;
+    }
+    buf[i++] = CAST(char,val);
+    return i;
+}
+
+int decode_varsize( size_t* val , const char* buf , size_t len ) {
+    const unsigned char* ubuf = CAST(const unsigned char*,buf);
+    size_t i;
+    *val = 0;
+    for( i = 0 ; i < VARSIZE_MAX_LEN ; ++i ) {
+        if( i == len )
+            return -1;
+        *val |= CAST(size_t,ubuf[i] & 127) << (7*i);
+        if( !(ubuf[i] & 128) )
+            return CAST(int,i+1);
+    }
+    return -2;
+}
+
 int encode_size_int( int val ) {
     return encode_size_uint( (val<<1) ^ (val>>31) );
 }
@@ -171,6 +195,15 @@ int encode_size_size( size_t size ) {
         return 1 + sizeof(size_t);
 }
 
+int encode_size_varsize( size_t size ) {
+    int i = 1;
+    while( size > 127 ) {
+        size >>= 7;
+        ++i;
+    }
+    return i;
+}
+
 /* Fixed , just encode everything using big endian */
 void encode_fint( int val , char buf[4] ) {
     buf[0] = val & 0x000000ff;
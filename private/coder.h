@@ -10,12 +10,19 @@ int decode_uint( unsigned int* val , const char* buf , size_t len );
 int encode_size( size_t val , char* buf , size_t buf_length );
 int decode_size( size_t* val , const char* buf , size_t len );
 
+/* size_t using base 128 , at most 10 bytes. decode_varsize returns -1 when
+ * the buffer ends in the middle and -2 when the encoding is too long */
+#define VARSIZE_MAX_LEN 10
+int encode_varsize( size_t val , char buf[VARSIZE_MAX_LEN] );
+int decode_varsize( size_t* val , const char* buf , size_t len );
+
 /* this function helps to determine how much memory will be consumed for
  * encoding the variant type internally */
 
 int encode_size_int( int val );
 int encode_size_uint( unsigned int val );
 int encode_size_size( size_t size );
+int encode_size_varsize( size_t size );
 
 /* fixed */
 void encode_fushort( unsigned short val , char buf[2] );
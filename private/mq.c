@@ -121,6 +121,7 @@ void spinlock_delete( spinlock_t* lk ) {
 
 #else
 #include <pthread.h>
+#include <time.h>
 typedef pthread_mutex_t mutex_t;
 typedef pthread_cond_t cond_t;
 
@@ -168,11 +169,19 @@ static
 int cond_wait( cond_t* c , mutex_t* l , int msec ) {
     struct timespec tv;
     int ret;
-    if( msec != -1 ) {
-        tv.tv_sec = msec/1000;
-        tv.tv_nsec = (msec%1000)*1000;
+    if( msec < 0 ) {
+        ret = pthread_cond_wait(c,l);
+    } else {
+        /* the timeout of pthread_cond_timedwait is an absolute time */
+        clock_gettime(CLOCK_REALTIME,&tv);
+        tv.tv_sec += msec/1000;
+        tv.tv_nsec += (long)(msec%1000)*1000000;
+        if( tv.tv_nsec >= 1000000000 ) {
+            tv.tv_nsec -= 1000000000;
+            ++tv.tv_sec;
+        }
+        ret = pthread_cond_timedwait(c,l,&tv);
     }
-    ret = pthread_cond_timedwait(c,l,&tv);
     return ret == 0 ? 0 : -1;
 }
 
@@ -251,10 +260,15 @@ struct queue_node_t {
     void* data;
     struct queue_node_t* next;
     struct queue_node_t* prev;
+    int deadline;
+    int has_deadline;
+    size_t cost;
+    size_t seq;
 };
 
 struct queue_t {
     struct queue_node_t tail;
+    size_t size;
 };
 
 static
@@ -262,14 +276,33 @@ void initqueue ( struct queue_t* q ) {
     q->tail.next = &(q->tail);
     q->tail.prev = &(q->tail);
     q->tail.data = NULL;
+    q->tail.has_deadline = 0;
+    q->size = 0;
+}
+
+/* insert n right after the node pos */
+static
+void insert_after( struct queue_t* q , struct queue_node_t* pos , struct queue_node_t* n ) {
+    n->prev = pos;
+    n->next = pos->next;
+    pos->next->prev = n;
+    pos->next = n;
+    ++q->size;
 }
 
 static
 void enqueue( struct queue_t* q , struct queue_node_t* n ) {
-    q->tail.prev->next = n;
-    n->prev = q->tail.prev;
-    n->next = &(q->tail);
-    q->tail.prev = n;
+    insert_after(q,q->tail.prev,n);
+}
+
+static
+void enqueue_deadline( struct queue_t* q , struct queue_node_t* n ) {
+    struct queue_node_t* pos = q->tail.prev;
+    /* walk back over the deadline data expiring later than us */
+    while( pos != &(q->tail) && pos->has_deadline &&
+           CAST(int,CAST(unsigned int,pos->deadline)-CAST(unsigned int,n->deadline)) > 0 )
+        pos = pos->prev;
+    insert_after(q,pos,n);
 }
 
 static
@@ -279,6 +312,7 @@ int dequeue( struct queue_t* q , struct queue_node_t** n ) {
    *n = q->tail.next;
    q->tail.next = (*n)->next;
    (*n)->next->prev = &(q->tail);
+   --q->size;
    return 0;
 }
 
@@ -293,8 +327,46 @@ void clearqueue( struct queue_t* q ) {
     }
 }
 
+/* Flow of the queue. Data is kept in per flow FIFO sub queues which are drained
+ * by deficit round robin: a flow receives quantum*weight cost of credit once
+ * per round and is served while the cost of its head fits in the credit. A
+ * flow is only kept on the active list of its lane while it has data.
+ *
+ * Lanes are served by strict priority , lane 0 first. To avoid starvation a
+ * lane which has data but has been passed over starvation_limit times in a
+ * row is served once ahead of the higher lanes. */
+
+#define FLOW_BUCKET_SIZE 64
+#define DEFAULT_QUANTUM 1024
+#define DEFAULT_STARVATION_LIMIT 16
+
+struct flow_t {
+    unsigned int id;
+    int lane;
+    unsigned int weight;
+    int pinned;  /* weight is configured, keep the flow when it goes idle */
+    int active;
+    int fresh;   /* the credit of this round is not granted yet */
+    size_t deficit;
+    struct queue_t q;
+    struct flow_t* hash_next;
+    struct flow_t* active_next;
+};
+
+struct lane_t {
+    struct flow_t* active_head; /* round robin list of flows that have data */
+    struct flow_t* active_tail;
+    size_t size;
+    size_t skipped; /* dequeues served by other lanes while this one has data */
+};
+
 struct mq {
-    struct queue_t q; /* the real queue */
+    struct flow_t* flows[FLOW_BUCKET_SIZE]; /* all the known flows */
+    struct lane_t lanes[MQ_LANE_SIZE];
+    size_t size;
+    size_t quantum;
+    size_t starvation_limit;
+    size_t seq;       /* enqueue sequence , used to find the oldest data */
     spinlock_t sp_lk; /* spin lock to protect the queue itself */
     mutex_t lk;       /* this mutex and condition variable is used to protect sleeped thread */
     cond_t c;
@@ -302,10 +374,147 @@ struct mq {
     int exit; /* this flag is used to notify the blocked the dequeue function to exit */
 };
 
+#define flow_slot(mq,lane,id) ((mq)->flows + (((id) ^ CAST(unsigned int,lane)) % FLOW_BUCKET_SIZE))
+
+static
+struct flow_t* flow_get( struct mq* mq , int lane , unsigned int id ) {
+    struct flow_t** slot = flow_slot(mq,lane,id);
+    struct flow_t* f;
+    for( f = *slot ; f != NULL ; f = f->hash_next ) {
+        if( f->id == id && f->lane == lane )
+            return f;
+    }
+    f = malloc(sizeof(*f));
+    VERIFY(f);
+    f->id = id;
+    f->lane = lane;
+    f->weight = 1;
+    f->pinned = 0;
+    f->active = 0;
+    f->fresh = 0;
+    f->deficit = 0;
+    initqueue(&(f->q));
+    f->active_next = NULL;
+    f->hash_next = *slot;
+    *slot = f;
+    return f;
+}
+
+/* free a flow that is neither active nor configured */
+static
+void flow_release( struct mq* mq , struct flow_t* f ) {
+    struct flow_t** slot = flow_slot(mq,f->lane,f->id);
+    if( f->pinned || f->active )
+        return;
+    while( *slot != f )
+        slot = &((*slot)->hash_next);
+    *slot = f->hash_next;
+    free(f);
+}
+
+static
+void flow_push( struct mq* mq , struct flow_t* f , struct queue_node_t* n ) {
+    struct lane_t* l = mq->lanes + f->lane;
+    n->seq = mq->seq++;
+    if( n->has_deadline )
+        enqueue_deadline(&(f->q),n);
+    else
+        enqueue(&(f->q),n);
+    ++mq->size;
+    ++l->size;
+    if( !f->active ) {
+        f->active = 1;
+        f->fresh = 1;
+        f->deficit = 0;
+        f->active_next = NULL;
+        if( l->active_tail == NULL )
+            l->active_head = f;
+        else
+            l->active_tail->active_next = f;
+        l->active_tail = f;
+    }
+}
+
+static
+void lane_dequeue( struct mq* mq , struct lane_t* l , struct queue_node_t** n ) {
+    struct flow_t* f;
+    while( (f = l->active_head) != NULL ) {
+        size_t cost = f->q.tail.next->cost;
+        if( f->deficit < cost ) {
+            if( f->fresh ) {
+                f->deficit += mq->quantum * f->weight;
+                f->fresh = 0;
+            } else if( f->active_next != NULL ) {
+                /* out of credit , move to the end of this round */
+                l->active_head = f->active_next;
+                l->active_tail->active_next = f;
+                l->active_tail = f;
+                f->active_next = NULL;
+                f->fresh = 1;
+            } else {
+                f->fresh = 1;
+            }
+            continue;
+        }
+        dequeue(&(f->q),n);
+        f->deficit -= cost;
+        --mq->size;
+        --l->size;
+        if( f->q.size == 0 ) {
+            l->active_head = f->active_next;
+            if( l->active_head == NULL )
+                l->active_tail = NULL;
+            f->active = 0;
+            f->deficit = 0;
+            flow_release(mq,f);
+        }
+        return;
+    }
+    assert(0);
+}
+
+static
+int sched_dequeue( struct mq* mq , struct queue_node_t** n ) {
+    int i;
+    int pick = -1;
+
+    if( mq->size == 0 )
+        return -1;
+
+    /* the highest lane that has data , unless a lower one is starving */
+    for( i = 0 ; i < MQ_LANE_SIZE ; ++i ) {
+        if( mq->lanes[i].size == 0 )
+            continue;
+        if( pick < 0 ) {
+            pick = i;
+        } else if( mq->starvation_limit != 0 &&
+                   mq->lanes[i].skipped >= mq->starvation_limit ) {
+            pick = i;
+            break;
+        }
+    }
+    assert( pick >= 0 );
+
+    for( i = 0 ; i < MQ_LANE_SIZE ; ++i ) {
+        if( i == pick )
+            mq->lanes[i].skipped = 0;
+        else if( mq->lanes[i].size != 0 )
+            ++mq->lanes[i].skipped;
+    }
+
+    lane_dequeue(mq,mq->lanes+pick,n);
+    return 0;
+}
+
 struct mq* mq_create() {
     struct mq* ret = malloc( sizeof(*ret) );
     VERIFY(ret);
-    initqueue(&(ret->q));
+    memset(ret->flows,0,sizeof(ret->flows));
+    memset(ret->lanes,0,sizeof(ret->lanes));
+    ret->size = 0;
+    ret->seq = 0;
+    ret->quantum = DEFAULT_QUANTUM;
+    ret->starvation_limit = DEFAULT_STARVATION_LIMIT;
     cond_init(&(ret->c));
     mutex_init(&(ret->lk));
     spinlock_init(&(ret->sp_lk));
@@ -315,24 +524,24 @@ struct mq* mq_create() {
 }
 
 void mq_destroy( struct mq* mq ) {
-    clearqueue(&(mq->q));
+    size_t i;
+    for( i = 0 ; i < FLOW_BUCKET_SIZE ; ++i ) {
+        struct flow_t* f = mq->flows[i];
+        while( f != NULL ) {
+            struct flow_t* n = f->hash_next;
+            clearqueue(&(f->q));
+            free(f);
+            f = n;
+        }
+    }
     mutex_delete(&(mq->lk));
     cond_delete(&(mq->c));
     spinlock_delete(&(mq->sp_lk));
     free(mq);
 }
 
-void mq_enqueue( struct mq* mq , void* data ) {
-    /* do the allocation */
-    struct queue_node_t* n = malloc(sizeof(*n));
-    VERIFY(n);
-    assert( data );
-
-    n->data = data;
-    /* the queue itself is protected by the spinlock */
-    spinlock_lock(&(mq->sp_lk));
-    enqueue(&(mq->q),n);
-    spinlock_unlock(&(mq->sp_lk));
+static
+void mq_notify( struct mq* mq ) {
     /* check if there're sleeped thread then we need to wake them up */
     if( mq->sleep_thread != 0 ) {
         /* this may lead to the target thread lose the wake up
@@ -345,6 +554,98 @@ void mq_enqueue( struct mq* mq , void* data ) {
     }
 }
 
+static
+void mq_push( struct mq* mq , void* data , int lane , unsigned int flow , size_t cost ,
+              int has_deadline , int deadline ) {
+    /* do the allocation */
+    struct queue_node_t* n = malloc(sizeof(*n));
+    VERIFY(n);
+    assert( data );
+    assert( lane >= 0 && lane < MQ_LANE_SIZE );
+
+    n->data = data;
+    n->cost = cost;
+    n->has_deadline = has_deadline;
+    n->deadline = deadline;
+    /* the queue itself is protected by the spinlock */
+    spinlock_lock(&(mq->sp_lk));
+    flow_push(mq,flow_get(mq,lane,flow),n);
+    spinlock_unlock(&(mq->sp_lk));
+    mq_notify(mq);
+}
+
+void mq_enqueue( struct mq* mq , void* data ) {
+    mq_push(mq,data,0,0,0,0,0);
+}
+
+void mq_enqueue_flow( struct mq* mq , void* data , int lane , unsigned int flow , size_t cost ) {
+    mq_push(mq,data,lane,flow,cost,0,0);
+}
+
+void mq_enqueue_deadline( struct mq* mq , void* data , int lane , unsigned int flow , size_t cost , int deadline ) {
+    mq_push(mq,data,lane,flow,cost,1,deadline);
+}
+
+void mq_set_quantum( struct mq* mq , size_t quantum ) {
+    assert( quantum != 0 );
+    spinlock_lock(&(mq->sp_lk));
+    mq->quantum = quantum;
+    spinlock_unlock(&(mq->sp_lk));
+}
+
+void mq_set_weight( struct mq* mq , unsigned int flow , unsigned int weight ) {
+    struct flow_t* f;
+    int i;
+    assert( weight != 0 );
+    spinlock_lock(&(mq->sp_lk));
+    for( i = 0 ; i < MQ_LANE_SIZE ; ++i ) {
+        f = flow_get(mq,i,flow);
+        f->weight = weight;
+        f->pinned = 1;
+    }
+    spinlock_unlock(&(mq->sp_lk));
+}
+
+void mq_set_starvation_limit( struct mq* mq , size_t limit ) {
+    spinlock_lock(&(mq->sp_lk));
+    mq->starvation_limit = limit;
+    spinlock_unlock(&(mq->sp_lk));
+}
+
+size_t mq_lane_size( struct mq* mq , int lane ) {
+    size_t sz;
+    assert( lane >= 0 && lane < MQ_LANE_SIZE );
+    spinlock_lock(&(mq->sp_lk));
+    sz = mq->lanes[lane].size;
+    spinlock_unlock(&(mq->sp_lk));
+    return sz;
+}
+
+size_t mq_size( struct mq* mq ) {
+    size_t sz;
+    spinlock_lock(&(mq->sp_lk));
+    sz = mq->size;
+    spinlock_unlock(&(mq->sp_lk));
+    return sz;
+}
+
+int mq_peek( struct mq* mq , mq_peek_cb cb , void* udata ) {
+    struct flow_t* f;
+    struct queue_node_t* oldest = NULL;
+    int i;
+    spinlock_lock(&(mq->sp_lk));
+    for( i = 0 ; i < MQ_LANE_SIZE ; ++i ) {
+        for( f = mq->lanes[i].active_head ; f != NULL ; f = f->active_next ) {
+            struct queue_node_t* n = f->q.tail.next;
+            if( oldest == NULL || n->seq < oldest->seq )
+                oldest = n;
+        }
+    }
+    if( oldest != NULL )
+        cb(oldest->data,udata);
+    spinlock_unlock(&(mq->sp_lk));
+    return oldest == NULL ? -1 : 0;
+}
 
 #define MAX_SPIN 10
 
@@ -352,14 +653,18 @@ void mq_enqueue( struct mq* mq , void* data ) {
 #define MIN_SLEEP_TIME 2
 #define MAX_SLEEP_TIME 256
 
-void mq_dequeue( struct mq* mq, void** data ) {
+/* Wait for at most msec milliseconds, a negative value means forever.
+ * The waiting time is counted by the sleep slices, so it is a rough one */
+static
+int mq_wait_dequeue( struct mq* mq, void** data , int msec ) {
     /* get data from the back queue no lock now. */
     struct queue_node_t* n=NULL;
     int ret;
+    int waited = 0;
 
     /* try to dequeue the data from the queue */
     spinlock_lock(&(mq->sp_lk));
-    ret = dequeue(&(mq->q),&n);
+    ret = sched_dequeue(mq,&n);
     spinlock_unlock(&(mq->sp_lk));
 
     if( ret != 0 ) {
@@ -373,7 +678,7 @@ void mq_dequeue( struct mq* mq, void** data ) {
          * Is it useful ? */
         while( i-- && ret != 0 && !mq->exit ) {
             spinlock_lock(&(mq->sp_lk));
-            ret = dequeue(&(mq->q),&n);
+            ret = sched_dequeue(mq,&n);
             spinlock_unlock(&(mq->sp_lk));
         }
 
@@ -387,7 +692,10 @@ void mq_dequeue( struct mq* mq, void** data ) {
         mutex_lock(&(mq->lk));
         ++mq->sleep_thread;
         do {
+            if( msec >= 0 && waited >= msec )
+                break;
             cond_wait(&(mq->c),&(mq->lk),slp_time);
+            waited += slp_time;
             /* Exponential avoidance for busy polling */
             slp_time *= 2;
             if ( slp_time > MAX_SLEEP_TIME )
@@ -403,7 +711,7 @@ void mq_dequeue( struct mq* mq, void** data ) {
              * dequeue operation which is very simple  */
 
             spinlock_lock(&(mq->sp_lk));
-            ret = dequeue(&(mq->q),&n);
+            ret = sched_dequeue(mq,&n);
             spinlock_unlock(&(mq->sp_lk));
 
         } while( ret != 0 && !mq->exit );
@@ -418,10 +726,21 @@ done:
     /* We get what we want */
     if( mq->exit ) {
         *data = NULL;
+    } else if( ret != 0 ) {
+        return -1;
     } else {
         *data = n->data;
     }
     free(n);
+    return 0;
+}
+
+void mq_dequeue( struct mq* mq, void** data ) {
+    mq_wait_dequeue(mq,data,-1);
+}
+
+int mq_timed_dequeue( struct mq* mq , void** data , int msec ) {
+    return mq_wait_dequeue(mq,data,msec);
 }
 
 int mq_try_dequeue( struct mq* mq , void** data ) {
@@ -434,7 +753,7 @@ int mq_try_dequeue( struct mq* mq , void** data ) {
     }
 
     spinlock_lock(&(mq->sp_lk));
-    ret = dequeue(&(mq->q),&n);
+    ret = sched_dequeue(mq,&n);
     spinlock_unlock(&(mq->sp_lk));
 
     if( ret == 0 ) {
@@ -1,5 +1,6 @@
 #ifndef MQ_H_
 #define MQ_H_
+#include <stddef.h>
 
 /* A THREAD SAFE message queue implementation. This implementation is used to
  * decouple the mini-rpc core service from the external service provider here. */
@@ -9,6 +10,43 @@ struct mq* mq_create();
 void mq_destroy( struct mq* );
 void mq_enqueue( struct mq* , void* data );
 
+/* Data is queued on a lane and a flow inside of that lane. Lanes are served by
+ * strict priority , lane 0 first , with starvation protection. The flows of a
+ * lane are served by deficit round robin , a flow gets quantum*weight of cost
+ * per round. Data queued by mq_enqueue goes to flow 0 of lane 0 with no cost,
+ * so a queue fed only by it is a plain FIFO. */
+#define MQ_LANE_SIZE 3
+
+void mq_enqueue_flow( struct mq* , void* data , int lane , unsigned int flow , size_t cost );
+
+/* Earliest deadline first enqueue. The data is put ahead of the deadline data
+ * at the tail of its flow whose deadline is later, but never ahead of data
+ * without a deadline, so plain FIFO data cannot starve. Deadline values are
+ * compared as wrapping millisecond clocks. */
+void mq_enqueue_deadline( struct mq* , void* data , int lane , unsigned int flow , size_t cost , int deadline );
+
+/* Configure the round robin credit of the flows, the default weight is 1 and
+ * it applies to the flow in every lane */
+void mq_set_quantum( struct mq* , size_t quantum );
+void mq_set_weight( struct mq* , unsigned int flow , unsigned int weight );
+
+/* A lane that has been passed over limit times in a row is served once ahead
+ * of the higher lanes, 0 means strict priority */
+void mq_set_starvation_limit( struct mq* , size_t limit );
+
+/* Number of data in a lane , it is a snapshot only */
+size_t mq_lane_size( struct mq* , int lane );
+
+/* Number of data in the queue, it is a snapshot only */
+size_t mq_size( struct mq* );
+
+/* Look at the oldest head of the flows without removing it. The cb is called
+ * with the data while the queue is locked , so the data can't be dequeued and
+ * released meanwhile. It must copy out what it needs and not call into the
+ * queue. return 0 --> has one element ; return -1 --> empty queue */
+typedef void (*mq_peek_cb)( void* data , void* udata );
+int mq_peek( struct mq* , mq_peek_cb cb , void* udata );
+
 /* this function will wake up _all_ thread that is WAITING on the queue */
 void mq_wakeup( struct mq* );
 
@@ -17,4 +55,9 @@ void mq_wakeup( struct mq* );
 void mq_dequeue( struct mq* , void** data );
 int mq_try_dequeue( struct mq* , void** data );
 
+/* Same as mq_dequeue but gives up after roughly msec milliseconds.
+ * return 0 --> has one element returned ( NULL when woken up )
+ * return -1 --> timeout */
+int mq_timed_dequeue( struct mq* , void** data , int msec );
+
 #endif /* MQ_H_ */
@@ -31,10 +31,6 @@ extern "C" {
     fprintf(stderr,"die:" #cond); abort(); }} while(0)
 #endif // NDEBUG
 
-#ifndef MULTI_SERVER_ENABLE
-static char single_server_internal_buffer[MAXIMUM_IPV4_PACKET_SIZE];
-#endif
-
 #define cast(x,p) ((x)(p))
 
 #ifndef min
@@ -197,16 +193,22 @@ void* net_buffer_peek( struct net_buffer*  buf , size_t* size ) {
     }
 }
 
-void net_buffer_produce( struct net_buffer* buf , const void* data , size_t size ) {
+void* net_buffer_reserve( struct net_buffer* buf , size_t size ) {
+    void* ret;
     if( buf->capacity < size + buf->produce_pos ) {
         // We need to expand the memory
         size_t cap = size + buf->produce_pos;
         buf->mem = mem_realloc(buf->mem,cap);
         buf->capacity = cap;
     }
-    // Write the data to the buffer position
-    memcpy(cast(char*,buf->mem) + buf->produce_pos , data , size);
+    ret = cast(char*,buf->mem) + buf->produce_pos;
     buf->produce_pos += size;
+    return ret;
+}
+
+void net_buffer_produce( struct net_buffer* buf , const void* data , size_t size ) {
+    // Write the data to the buffer position
+    memcpy(net_buffer_reserve(buf,size) , data , size);
 }
 
 static void* net_buffer_consume_peek( struct net_buffer* buf ) {
@@ -235,6 +237,97 @@ static void net_buffer_consume_advance( struct net_buffer* buf , size_t size ) {
         (buf)->mem = NULL; \
     } while(0)
 
+// socket transport
+static int socket_read( struct net_connection* conn , void* buf , size_t sz , int* error_code ) {
+    int rd = recv( conn->socket_fd , buf , sz , 0 );
+    if( rd <= 0 )
+        *error_code = net_has_error();
+    return rd;
+}
+
+static int socket_write( struct net_connection* conn , const void* buf , size_t sz , int* error_code ) {
+    int snd = send( conn->socket_fd , buf , sz , 0 );
+    if( snd <= 0 )
+        *error_code = net_has_error();
+    return snd;
+}
+
+static void socket_close( struct net_connection* conn ) {
+    if( conn->socket_fd != invalid_socket_handler )
+        closesocket(conn->socket_fd);
+}
+
+static const struct net_transport socket_transport = {
+    socket_read,
+    socket_write,
+    socket_close,
+    NULL
+};
+
+// memory pipe transport
+// buf[i] holds the data that is readable by end[i]. Once an end is closed its
+// slot is set to NULL, the peer sees EOF after draining its buffer and the
+// last end closed frees the pipe.
+struct net_pipe {
+    struct net_buffer buf[2];
+    struct net_connection* end[2];
+};
+
+#define pipe_index(p,conn) ((p)->end[0] == (conn) ? 0 : 1)
+
+static int pipe_read( struct net_connection* conn , void* buf , size_t sz , int* error_code ) {
+    struct net_pipe* p = cast(struct net_pipe*,conn->transport_data);
+    int i = pipe_index(p,conn);
+    void* data;
+    data = net_buffer_consume(&(p->buf[i]),&sz);
+    if( data == NULL ) {
+        *error_code = 0;
+        return p->end[!i] == NULL ? 0 : -1;
+    }
+    memcpy(buf,data,sz);
+    return cast(int,sz);
+}
+
+static int pipe_write( struct net_connection* conn , const void* buf , size_t sz , int* error_code ) {
+    struct net_pipe* p = cast(struct net_pipe*,conn->transport_data);
+    int i = pipe_index(p,conn);
+    if( p->end[!i] == NULL ) {
+        *error_code = EPIPE;
+        return -1;
+    }
+    net_buffer_produce(&(p->buf[!i]),buf,sz);
+    return cast(int,sz);
+}
+
+static void pipe_close( struct net_connection* conn ) {
+    struct net_pipe* p = cast(struct net_pipe*,conn->transport_data);
+    p->end[pipe_index(p,conn)] = NULL;
+    if( p->end[0] == NULL && p->end[1] == NULL ) {
+        net_buffer_free(&(p->buf[0]));
+        net_buffer_free(&(p->buf[1]));
+        mem_free(p);
+    }
+}
+
+static int pipe_ready( struct net_connection* conn , int ev ) {
+    struct net_pipe* p = cast(struct net_pipe*,conn->transport_data);
+    int i = pipe_index(p,conn);
+    int ret = ev & NET_EV_WRITE;
+    if( (ev & NET_EV_READ) &&
+        (net_buffer_readable_size(&(p->buf[i])) != 0 || p->end[!i] == NULL) )
+        ret |= NET_EV_READ;
+    return ret;
+}
+
+#undef pipe_index
+
+static const struct net_transport pipe_transport = {
+    pipe_read,
+    pipe_write,
+    pipe_close,
+    pipe_ready
+};
+
 // connection
 static void connection_cb( int ev , int ec , struct net_connection* conn ) {
     if( conn->cb != NULL ) {
@@ -245,6 +338,8 @@ static void connection_cb( int ev , int ec , struct net_connection* conn ) {
 static struct net_connection* connection_create( socket_t fd ) {
     struct net_connection* conn = mem_alloc(sizeof(struct net_connection));
     conn->socket_fd = fd;
+    conn->transport = &socket_transport;
+    conn->transport_data = NULL;
     net_buffer_clear(&(conn->in));
     net_buffer_clear(&(conn->out));
     conn->cb = NULL;
@@ -276,20 +371,31 @@ static struct net_connection* connection_destroy( struct net_connection* conn )
 }
 
 static struct net_connection* connection_close( struct net_connection* conn ) {
-    socket_t fd = conn->socket_fd;
-    struct net_connection* ret = connection_destroy(conn);
-    if( fd != invalid_socket_handler )
-        closesocket(fd);
+    conn->transport->close(conn);
+    return connection_destroy(conn);
+}
+
+// readiness of a connection for the events in ev , the socket transport
+// is answered by the select result and the others by the transport itself
+static int connection_ready( struct net_connection* conn , int ev , fd_set* read_set , fd_set* write_set ) {
+    int ret = 0;
+    if( conn->transport->ready != NULL )
+        return conn->transport->ready(conn,ev);
+    if( (ev & NET_EV_READ) && FD_ISSET(conn->socket_fd,read_set) )
+        ret |= NET_EV_READ;
+    if( (ev & NET_EV_WRITE) && FD_ISSET(conn->socket_fd,write_set) )
+        ret |= NET_EV_WRITE;
     return ret;
 }
 
 // server
-int net_server_create( struct net_server* server, const char* addr , net_acb_func cb ) {
+static int server_create( struct net_server* server, const char* addr , net_acb_func cb , int shared ) {
     struct sockaddr_in ipv4;
     server->conns.next = &(server->conns);
     server->conns.prev = &(server->conns);
     server->cb = cb;
     server->user_data = NULL;
+    server->reserve_buffer = NULL;
     server->last_io_time = 0;
     if( addr != NULL ) {
         if( str_to_sockaddr(addr,&ipv4) != 0 )
@@ -302,6 +408,12 @@ int net_server_create( struct net_server* server, const char* addr , net_acb_fun
         exec_socket(server->listen_fd);
         // reuse the addr
         reuse_socket(server->listen_fd);
+#ifdef SO_REUSEPORT
+        if( shared ) {
+            int on = 1;
+            setsockopt(server->listen_fd,SOL_SOCKET,SO_REUSEPORT,cast(const char*,&on),sizeof(int));
+        }
+#endif // SO_REUSEPORT
         // bind
         if( bind(server->listen_fd,cast(struct sockaddr*,&ipv4),sizeof(ipv4)) != 0 ) {
             closesocket(server->listen_fd);
@@ -341,20 +453,29 @@ int net_server_create( struct net_server* server, const char* addr , net_acb_fun
         server->ctrl_fd = invalid_socket_handler;
         return -1;
     }
-#ifndef MULTI_SERVER_ENABLE
-    server->reserve_buffer = single_server_internal_buffer;
-#else
+    // each server has its own , servers may be polled by different threads
     server->reserve_buffer = mem_alloc(MAXIMUM_IPV4_PACKET_SIZE);
-#endif // MULTI_SERVER_ENABLE
     return 0;
 }
 
+int net_server_create( struct net_server* server, const char* addr , net_acb_func cb ) {
+    return server_create(server,addr,cb,0);
+}
+
+int net_server_create_shared( struct net_server* server, const char* addr , net_acb_func cb ) {
+#ifdef SO_REUSEPORT
+    return server_create(server,addr,cb,1);
+#else
+    return -1;
+#endif // SO_REUSEPORT
+}
+
 static void server_close_all_conns( struct net_server* server ) {
     struct net_connection* next = server->conns.next;
     struct net_connection* temp = NULL;
     while( next != &(server->conns) ) {
         temp = next->next;
-        connection_close(temp);
+        connection_close(next);
         next = temp;
     }
 }
@@ -368,10 +489,9 @@ void net_server_destroy( struct net_server* server ) {
     server->conns.next = &(server->conns);
     server->conns.prev = &(server->conns);
     server->ctrl_fd = server->listen_fd = invalid_socket_handler;
-#ifdef MULTI_SERVER_ENABLE
     if( server->reserve_buffer != NULL )
         mem_free(server->reserve_buffer);
-#endif // MULTI_SERVER_ENABLE
+    server->reserve_buffer = NULL;
 }
 
 int net_server_wakeup( struct net_server* server ) {
@@ -379,7 +499,8 @@ int net_server_wakeup( struct net_server* server ) {
     struct sockaddr_in addr;
     socklen_t len = sizeof(addr);
 
-    assert(server->ctrl_fd != invalid_socket_handler &&  server->listen_fd != invalid_socket_handler );
+    // a client only server has no listen_fd but it can still be woken up
+    assert(server->ctrl_fd != invalid_socket_handler);
     memset(&addr,0,sizeof(addr));
     if( getsockname(server->ctrl_fd,cast(struct sockaddr*,&addr),&len) !=0 )
         return -1;
@@ -399,11 +520,20 @@ static int do_connected( struct net_connection* conn , int* error_code );
         if( *(mfd) < fd ) { *(mfd) = fd; } \
     }while(0)
 
-static int prepare_linger( struct net_connection* conn , fd_set* write , socket_t* max_fd ) {
+// Transport without a socket cannot be put into the fd set, if it is ready
+// already we just make the select return at once
+#define ADD_CONN(fs,conn,ev,mfd,millis) \
+    do { \
+        if( (conn)->transport->ready == NULL ) { \
+            ADD_FSET(fs,(conn)->socket_fd,mfd); \
+        } else if( (conn)->transport->ready(conn,ev) ) { \
+            *(millis) = 0; \
+        } \
+    }while(0)
+
+static int prepare_linger( struct net_connection* conn , fd_set* write , socket_t* max_fd , int* millis ) {
     if( net_buffer_readable_size(&(conn->out)) ) {
-        FD_SET(conn->socket_fd,write);
-        if( *max_fd < conn->socket_fd )
-            *max_fd = conn->socket_fd;
+        ADD_CONN(write,conn,NET_EV_WRITE,max_fd,millis);
         return 0;
     }
     return -1;
@@ -431,16 +561,16 @@ static void prepare_fd( struct net_server* server , fd_set* read_set , fd_set* w
                 !(conn->pending_event & NET_EV_CONNECT) &&
                 !(conn->pending_event & NET_EV_CLOSE) );
             if( conn->pending_event & NET_EV_READ ) {
-                ADD_FSET(read_set,conn->socket_fd,max_fd);
+                ADD_CONN(read_set,conn,NET_EV_READ,max_fd,millis);
             }
             if( conn->pending_event & NET_EV_WRITE ) {
-                ADD_FSET(write_set,conn->socket_fd,max_fd);
+                ADD_CONN(write_set,conn,NET_EV_WRITE,max_fd,millis);
             }
         } else {
             if( (conn->pending_event & NET_EV_LINGER) || (conn->pending_event & NET_EV_LINGER_SILENT) ) {
                 assert( !(conn->pending_event & NET_EV_CONNECT) &&
                     !(conn->pending_event & NET_EV_CLOSE) );
-                if( prepare_linger(conn,write_set,max_fd) !=0 ) {
+                if( prepare_linger(conn,write_set,max_fd,millis) !=0 ) {
                     if( conn->pending_event & NET_EV_LINGER ) {
                         connection_cb(NET_EV_LINGER,0,conn);
                     }
@@ -451,7 +581,7 @@ static void prepare_fd( struct net_server* server , fd_set* read_set , fd_set* w
                 }
             } else if( conn->pending_event & NET_EV_CONNECT ) {
                 assert( !(conn->pending_event & NET_EV_CLOSE) );
-                ADD_FSET(write_set,conn->socket_fd,max_fd);
+                ADD_CONN(write_set,conn,NET_EV_WRITE,max_fd,millis);
             } else {
                 // We just need to convert a NET_EV_CLOSE|NET_EV_TIMEOUT to
                 // internal NET_EV_TIMEOUT_AND_CLOSE operations
@@ -492,7 +622,7 @@ static int dispatch( struct net_server* server , fd_set* read_set , fd_set* writ
             }
         }
         // connect
-        if( (conn->pending_event & NET_EV_CONNECT) && FD_ISSET(conn->socket_fd,write_set) ) {
+        if( (conn->pending_event & NET_EV_CONNECT) && connection_ready(conn,NET_EV_WRITE,read_set,write_set) ) {
             // connection operation done, notify our user
             if( do_connected(conn,&ec) == 0 ) {
                 ev |= NET_EV_CONNECT;
@@ -507,7 +637,8 @@ static int dispatch( struct net_server* server , fd_set* read_set , fd_set* writ
         if( (conn->pending_event & NET_EV_WRITE) || (conn->pending_event & NET_EV_READ) ) {
             rw = 0; ec = 0;
             // checking read
-            if( (conn->pending_event & NET_EV_READ) && FD_ISSET(conn->socket_fd,read_set) ) {
+            if( (conn->pending_event & NET_EV_READ) &&
+                connection_ready(conn,NET_EV_READ,read_set,write_set) ) {
                 ret = do_read(server,&ec,conn);
                 if( ret == 0 ) {
                     ev |= NET_EV_EOF;
@@ -519,7 +650,7 @@ static int dispatch( struct net_server* server , fd_set* read_set , fd_set* writ
                 ++rw;
             }
             // checking write
-            if( !(ev & NET_EV_ERR_READ) && (conn->pending_event & NET_EV_WRITE) && FD_ISSET(conn->socket_fd,write_set) ) {
+            if( !(ev & NET_EV_ERR_READ) && (conn->pending_event & NET_EV_WRITE) && connection_ready(conn,NET_EV_WRITE,read_set,write_set) ) {
                 ret = do_write(conn,&ec);
                 if( ret < 0 ) {
                     ev |= NET_EV_ERR_WRITE;
@@ -528,12 +659,14 @@ static int dispatch( struct net_server* server , fd_set* read_set , fd_set* writ
                 }
                 ++rw;
             }
-            // call the connection callback function here
+            // call the connection callback function here , a timeout armed
+            // along with read/write fires when nothing is ready
             if( rw != 0 ) connection_cb(ev,ec,conn);
+            else if( ev & NET_EV_TIMEOUT ) connection_cb(NET_EV_TIMEOUT,0,conn);
             continue;
         }
         // linger
-        if( ((conn->pending_event & NET_EV_LINGER) || (conn->pending_event & NET_EV_LINGER_SILENT)) && FD_ISSET(conn->socket_fd,write_set) ) {
+        if( ((conn->pending_event & NET_EV_LINGER) || (conn->pending_event & NET_EV_LINGER_SILENT)) && connection_ready(conn,NET_EV_WRITE,read_set,write_set) ) {
             ec = 0;
             ret = do_write(conn,&ec);
             if( ret <= 0 ) {
@@ -637,8 +770,21 @@ int net_server_poll( struct net_server* server , int millis , int* wakeup ) {
     return return_num;
 }
 
+#undef ADD_CONN
 #undef ADD_FSET
 
+static void accept_connection( struct net_server* server , struct net_connection* conn ) {
+    int pending_ev;
+    conn->pending_event = NET_EV_CLOSE;
+    if( server->cb == NULL )
+        return;
+    pending_ev = server->cb(0,server,conn);
+    if( conn->cb == NULL )
+        conn->pending_event = NET_EV_CLOSE;
+    else
+        conn->pending_event = pending_ev;
+}
+
 static void do_accept( struct net_server* server ) {
     struct net_connection* conn;
     int error_code;
@@ -651,24 +797,17 @@ static void do_accept( struct net_server* server ) {
             }
             return;
         } else {
-            int pending_ev;
             nb_socket(sock);
             conn = connection_create(sock);
             connection_add(server,conn);
-            conn->pending_event = NET_EV_CLOSE;
-            pending_ev = server->cb(0,server,conn);
-            if( conn->cb == NULL )
-                conn->pending_event = NET_EV_CLOSE;
-            else
-                conn->pending_event = pending_ev;
+            accept_connection(server,conn);
         }
     } while(1);
 }
 
 static int do_read( struct net_server* server , int* error_code , struct net_connection* conn ) {
-    int rd = recv( conn->socket_fd , server->reserve_buffer , MAXIMUM_IPV4_PACKET_SIZE , 0 );
+    int rd = conn->transport->read( conn , server->reserve_buffer , MAXIMUM_IPV4_PACKET_SIZE , error_code );
     if( rd <= 0 ) {
-        *error_code = net_has_error();
         return rd;
     } else {
         net_buffer_produce( &(conn->in) , server->reserve_buffer , rd );
@@ -680,9 +819,8 @@ static int do_write( struct net_connection* conn , int* error_code ) {
     void* out = net_buffer_consume_peek(&(conn->out));
     int snd;
     if( out == NULL ) return 0;
-    snd = send(conn->socket_fd,out,net_buffer_readable_size(&(conn->out)),0);
+    snd = conn->transport->write(conn,out,net_buffer_readable_size(&(conn->out)),error_code);
     if( snd <= 0 ) {
-        *error_code = net_has_error();
         return snd;
     } else {
         net_buffer_consume_advance(&(conn->out),snd);
@@ -698,6 +836,9 @@ static void do_control( struct net_server* server ) {
 static int do_connected( struct net_connection* conn , int* error_code ) {
     int val;
     socklen_t len = sizeof(int);
+    // only a socket can be in progress of connecting
+    if( conn->transport->ready != NULL )
+        return 0;
     // before we do anything we need to check whether we have connected to the socket or not
     getsockopt(conn->socket_fd,SOL_SOCKET,SO_ERROR,cast(char*,&val),&len);
     if( val != 0 ) {
@@ -787,6 +928,29 @@ struct net_connection* net_make_connection( struct net_server* server , net_ccb_
         return conn;
 }
 
+struct net_connection* net_make_pipe( struct net_server* server , net_ccb_func cb , void* udata ,
+    int timeout ) {
+    struct net_pipe* p = mem_alloc(sizeof(struct net_pipe));
+    struct net_connection* cli = connection_create(invalid_socket_handler);
+    struct net_connection* srv = connection_create(invalid_socket_handler);
+    net_buffer_clear(&(p->buf[0]));
+    net_buffer_clear(&(p->buf[1]));
+    p->end[0] = cli;
+    p->end[1] = srv;
+    cli->transport = srv->transport = &pipe_transport;
+    cli->transport_data = srv->transport_data = p;
+    cli->cb = cb;
+    cli->user_data = udata;
+    cli->timeout = timeout;
+    connection_add(server,cli);
+    connection_add(server,srv);
+    // the server side goes through the listener path
+    accept_connection(server,srv);
+    // a memory pipe is connected at once
+    connection_cb(NET_EV_CONNECT,0,cli);
+    return cli;
+}
+
 // timer and socket
 struct net_connection* net_timer( struct net_server* server , net_ccb_func cb , void* udata , int timeout ) {
     struct net_connection* conn = connection_create(invalid_socket_handler);
@@ -816,6 +980,33 @@ void net_post( struct net_connection* conn , int ev ) {
     conn->pending_event = ev;
 }
 
+int net_try_flush( struct net_connection* conn ) {
+    int ec;
+    int snd;
+    // never touch the buffers of a pipe peer off the reactor thread
+    if( conn->transport != &socket_transport )
+        return -1;
+    snd = do_write(conn,&ec);
+    if( snd < 0 && ec != 0 )
+        return -1;
+    return cast(int,net_buffer_readable_size(&(conn->out)));
+}
+
+unsigned int net_peer_addr( struct net_connection* conn ) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if( conn->transport != &socket_transport || conn->socket_fd == invalid_socket_handler )
+        return 0;
+    if( getpeername(conn->socket_fd,cast(struct sockaddr*,&addr),&len) != 0 ||
+        addr.sin_family != AF_INET )
+        return 0;
+    return ntohl(addr.sin_addr.s_addr);
+}
+
+int net_time_millisec() {
+    return get_time_millisec();
+}
+
 // platform problem
 void net_init() {
 #ifdef _WIN32
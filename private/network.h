@@ -54,11 +54,26 @@ struct net_connection;
 
 typedef int (*net_ccb_func)( int , int , struct net_connection* );
 
+// Transport of a connection. The reactor only moves bytes through these
+// functions, so a connection doesn't have to be backed by a kernel socket.
+// read/write return the transferred bytes, 0 for EOF and -1 for error with
+// error_code set ( 0 means the operation would block ). ready returns the
+// subset of NET_EV_READ/NET_EV_WRITE in ev that won't block; a NULL ready
+// means the transport lives on socket_fd and select tells the readiness.
+struct net_transport {
+    int (*read)( struct net_connection* , void* buf , size_t sz , int* error_code );
+    int (*write)( struct net_connection* , const void* buf , size_t sz , int* error_code );
+    void (*close)( struct net_connection* );
+    int (*ready)( struct net_connection* , int ev );
+};
+
 struct net_connection {
     struct net_connection* next;
     struct net_connection* prev;
     void* user_data;
     socket_t socket_fd;
+    const struct net_transport* transport;
+    void* transport_data;
     struct net_buffer in; // in buffer is the buffer for reading
     struct net_buffer out;// out buffer is the buffer for sending
     net_ccb_func cb;
@@ -82,8 +97,16 @@ struct net_server {
 
 void net_init();
 
+// millisecond clock used by the reactor , it wraps around so only the
+// difference of 2 readings is meaningful
+int net_time_millisec();
+
 // server function
 int net_server_create( struct net_server* , const char* addr , net_acb_func cb );
+// same as net_server_create but several servers , one per thread , may listen
+// on the same address and the kernel spreads the connections among them. It
+// fails where SO_REUSEPORT is not available
+int net_server_create_shared( struct net_server* , const char* addr , net_acb_func cb );
 void net_server_destroy( struct net_server* );
 int net_server_poll( struct net_server* ,int , int* );
 int net_server_wakeup( struct net_server* );
@@ -103,6 +126,15 @@ int net_non_block_connect( struct net_connection* conn , const char* addr , int
 struct net_connection* net_make_connection( struct net_server* server , net_ccb_func cb , 
     const char* addr , int timeout );
 
+// in-process memory pipe. The returned connection is the client end and it is
+// connected at once ( cb receives NET_EV_CONNECT before this function returns ).
+// The other end is handed to the server accept callback just like a socket from
+// the listener. Both ends must be driven by the same server. The timeout is left
+// on the client end , there is no connect to bound , the callback keeps
+// NET_EV_TIMEOUT in its events to bound the exchange with it.
+struct net_connection* net_make_pipe( struct net_server* server , net_ccb_func cb , void* udata ,
+    int timeout );
+
 // timer and other socket function
 struct net_connection* net_timer( struct net_server* server , net_ccb_func cb , void* udata , int timeout );
 struct net_connection* net_fd( struct net_server* server , net_ccb_func cb , void* udata , socket_t fd , int pending_event );
@@ -112,10 +144,23 @@ struct net_connection* net_fd( struct net_server* server , net_ccb_func cb , voi
 void net_stop( struct net_connection* conn );
 void net_post( struct net_connection* conn , int ev );
 
+// Send the output buffer from a thread other than the reactor one. The caller
+// must own the connection , which means the reactor doesn't watch it ( NET_EV_IDLE ).
+// Only socket connections are supported , a memory pipe writes into the input
+// buffer of its peer which the reactor reads without a lock , so it must be
+// flushed by the reactor. It returns the bytes left in the buffer, -1 on error
+// or unsupported transport , the caller hands the buffer back to the reactor.
+int net_try_flush( struct net_connection* conn );
+
+// IPv4 address of the remote peer in host order, 0 when it is not a socket
+unsigned int net_peer_addr( struct net_connection* conn );
+
 // buffer function
 void* net_buffer_consume( struct net_buffer* , size_t* );
 void* net_buffer_peek( struct net_buffer*  , size_t* );
 void net_buffer_produce( struct net_buffer* , const void* data , size_t );
+// reserve size bytes at the produce end , the caller fills them in place
+void* net_buffer_reserve( struct net_buffer* , size_t );
 struct net_buffer* net_buffer_create( size_t cap , struct net_buffer* );
 void net_buffer_free( struct net_buffer* );
 #define net_buffer_readable_size(b) ((b)->produce_pos - (b)->consume_pos)
@@ -0,0 +1,68 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* Once max_queue_depth requests wait in the queue the IO thread answers the
+ * new ones with MRPC_EC_OVERLOADED at once , without queueing them */
+
+#define DEPTH 2
+#define BURST 6
+
+static int LEFT;
+static int OK;
+static int OVERLOADED;
+static int EXECUTED;
+
+static
+void res_cb( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK )
+        ++OK;
+    else if( res != NULL && res->error_code == MRPC_EC_OVERLOADED )
+        ++OVERLOADED;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+static
+void
+fast_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    ++EXECUTED;
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+/* the only worker is held while the burst comes in */
+static
+void
+slow_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    int i;
+    for( i = 0 ; i < BURST ; ++i )
+        mrpc_request_async(res_cb,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Fast","");
+    test_sleep(200);
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+int main() {
+    struct mrpc_service* service;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    mrpc_set_admission(DEPTH,0,0);
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,fast_cb,"Fast",NULL);
+    mrpc_service_add(service,slow_cb,"Slow",NULL);
+    CHECK( mrpc_service_run_remote(service,1) == 0 );
+
+    LEFT = BURST+1;
+    mrpc_request_async(res_cb,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Slow","");
+    mrpc_run();
+
+    CHECK( OK == DEPTH+1 && EXECUTED == DEPTH );
+    CHECK( OVERLOADED == BURST-DEPTH );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
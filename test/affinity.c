@@ -0,0 +1,93 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* sched_getaffinity */
+#include <sched.h>
+#endif /* __linux__ */
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* The workers following the IO thread end up on the CPUs it is pinned to */
+
+#define ROUND 8
+
+static int LEFT;
+static int OK;
+static int CPU;
+
+/* 1 when the calling thread may only run on CPU */
+static
+int pinned() {
+#ifdef __linux__
+    cpu_set_t set;
+    CHECK( sched_getaffinity(0,sizeof(set),&set) == 0 );
+    return CPU_COUNT(&set) == 1 && CPU_ISSET(CPU,&set);
+#else
+    return 1;
+#endif /* __linux__ */
+}
+
+static
+void
+where_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+          int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,pinned());
+    *error_code = MRPC_EC_OK;
+}
+
+/* it runs on the IO thread */
+static
+void res_cb( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK && res->result.value.uinteger == 1 &&
+        pinned() )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    int cpus[MRPC_MAX_AFFINITY_CPU];
+    int bad = -1;
+    int i;
+
+    /* the last CPU the test may run on */
+    CPU = 0;
+#ifdef __linux__
+    {
+        cpu_set_t set;
+        CHECK( sched_getaffinity(0,sizeof(set),&set) == 0 );
+        for( i = 0 ; i < CPU_SETSIZE ; ++i ) {
+            if( CPU_ISSET(i,&set) )
+                CPU = i;
+        }
+    }
+#endif /* __linux__ */
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    CHECK( mrpc_get_io_affinity(cpus,MRPC_MAX_AFFINITY_CPU) == 0 );
+    CHECK( mrpc_set_io_affinity(&bad,1) != 0 );
+    CHECK( mrpc_set_io_affinity(&CPU,1) == 0 );
+    CHECK( mrpc_get_io_affinity(cpus,MRPC_MAX_AFFINITY_CPU) == 1 && cpus[0] == CPU );
+
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,where_cb,"Where",NULL);
+    CHECK( mrpc_service_add_pool(service,"Pool",1) == 0 );
+    CHECK( mrpc_service_add(service,where_cb,"PoolWhere",NULL) == 0 );
+    CHECK( mrpc_service_bind_pool(service,"PoolWhere","Pool") == 0 );
+    CHECK( mrpc_service_set_affinity(service,&bad,1) != 0 );
+    CHECK( mrpc_service_set_affinity(service,NULL,0) == 0 );
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    LEFT = ROUND*2;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_request_async(res_cb,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Where","");
+        mrpc_request_async(res_cb,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"PoolWhere","");
+    }
+    mrpc_run();
+
+    CHECK( OK == ROUND*2 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
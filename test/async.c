@@ -0,0 +1,75 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* An async method calls a downstream method of the same service and completes
+ * its request from the response callback. With one worker this only works if
+ * the worker is free once the async callback returns */
+
+#define ROUND 32
+
+static int LEFT;
+static int OK;
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger);
+    *error_code = MRPC_EC_OK;
+}
+
+/* the downstream response completes the deferred request */
+static
+void downstream_res( const struct mrpc_response* res , void* data ) {
+    struct mrpc_service_token* token = (struct mrpc_service_token*)data;
+    struct mrpc_val result;
+    if( res == NULL || res->error_code != MRPC_EC_OK ) {
+        mrpc_service_complete(token,NULL,MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE);
+    } else {
+        mrpc_val_uint(&result,res->result.value.uinteger*2);
+        mrpc_service_complete(token,&result,MRPC_EC_OK);
+    }
+}
+
+/* twice the sum , taken from the Add method */
+static
+void
+double_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+           struct mrpc_service_token* token ) {
+    mrpc_request_async(downstream_res,token,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Add","%u%u",
+                       req->par[0].value.uinteger,req->par[1].value.uinteger);
+}
+
+static
+void double_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK &&
+        res->result.value.uinteger == (unsigned int)((size_t)data) )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,add_cb,"Add",NULL);
+    CHECK( mrpc_service_add_async(service,double_cb,"Double",NULL) == 0 );
+    CHECK( mrpc_service_run_remote(service,1) == 0 );
+
+    LEFT = ROUND;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_request_async(double_res,(void*)(4*i+2),5000,MRPC_LOOPBACK_ADDR,
+                           MRPC_FUNCTION,"Double","%u%u",(unsigned int)i,(unsigned int)(i+1));
+    }
+    mrpc_run();
+
+    CHECK( OK == ROUND );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
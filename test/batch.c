@@ -0,0 +1,76 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* Batch methods group their requests and answer each one on its own
+ * connection , the other methods keep being served meanwhile */
+
+#define ROUND 64
+#define MAX_BATCH 8
+
+static int LEFT;
+static int OK;
+static int CALLS;
+static size_t LARGEST;
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void
+double_cb( struct mrpc_service* service , const struct mrpc_request* reqs , size_t n ,
+           void* udata , int* ecs , struct mrpc_val* results ) {
+    size_t i;
+    CHECK( n > 0 && n <= MAX_BATCH );
+    ++CALLS;
+    if( n > LARGEST )
+        LARGEST = n;
+    for( i = 0 ; i < n ; ++i ) {
+        mrpc_val_uint(results+i,reqs[i].par[0].value.uinteger*2);
+        ecs[i] = MRPC_EC_OK;
+    }
+}
+
+static
+void res_cb( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK &&
+        res->result.value.uinteger == (unsigned int)((size_t)data) )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,add_cb,"Add",NULL);
+    CHECK( mrpc_service_add_batch(service,double_cb,"Double",MAX_BATCH,20,NULL) == 0 );
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    LEFT = ROUND;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        if( i % 4 == 0 )
+            mrpc_request_async(res_cb,(void*)(i+i+1),1000,MRPC_LOOPBACK_ADDR,
+                               MRPC_FUNCTION,"Add","%u%u",(unsigned int)i,(unsigned int)(i+1));
+        else
+            mrpc_request_async(res_cb,(void*)(i*2),1000,MRPC_LOOPBACK_ADDR,
+                               MRPC_FUNCTION,"Double","%u",(unsigned int)i);
+    }
+    mrpc_run();
+
+    CHECK( OK == ROUND );
+    /* the requests are grouped , not run one by one */
+    CHECK( LARGEST > 1 && CALLS < ROUND*3/4 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
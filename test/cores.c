@@ -0,0 +1,109 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* The thread per core mode runs the methods on the cores , a batch method
+ * runs each request alone and a deferred method is not supported there. The
+ * replica of a core follows the methods added and removed at runtime */
+
+#define ADDR "127.0.0.1:23573"
+#define CORES 2
+#define ROUND 16
+
+static struct mrpc_service* SERVICE;
+static int LEFT;
+static int OK;
+static int CHANGED;
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void
+async_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+          struct mrpc_service_token* token ) {
+    abort();
+}
+
+/* the result is the size of the batch */
+static
+void
+batch_cb( struct mrpc_service* service , const struct mrpc_request* reqs , size_t n ,
+          void* udata , int* ecs , struct mrpc_val* results ) {
+    size_t i;
+    for( i = 0 ; i < n ; ++i ) {
+        mrpc_val_uint(results+i,(unsigned int)n);
+        ecs[i] = MRPC_EC_OK;
+    }
+}
+
+static void expect_res( const struct mrpc_response* res , void* data );
+static void error_res( const struct mrpc_response* res , void* data );
+
+/* once every core served the first round , the table is changed and the
+ * replicas must follow it */
+static
+void done() {
+    if( --LEFT != 0 )
+        return;
+    if( CHANGED || OK != ROUND*3 ) {
+        mrpc_interrupt();
+        return;
+    }
+    CHECK( mrpc_service_add(SERVICE,add_cb,"Late",NULL) == 0 );
+    CHECK( mrpc_service_remove(SERVICE,"Add") == 0 );
+    CHANGED = 1;
+    LEFT = 2;
+    mrpc_request_async(expect_res,(void*)7,5000,ADDR,MRPC_FUNCTION,"Late","%u%u",3,4);
+    mrpc_request_async(error_res,(void*)MRPC_EC_FUNCTION_NOT_FOUND,5000,ADDR,
+                       MRPC_FUNCTION,"Add","%u%u",3,4);
+}
+
+static
+void expect_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK &&
+        res->result.value.uinteger == (unsigned int)((size_t)data) )
+        ++OK;
+    done();
+}
+
+static
+void error_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == (int)((size_t)data) )
+        ++OK;
+    done();
+}
+
+int main() {
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,NULL,1) == 0 );
+    SERVICE = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(SERVICE,add_cb,"Add",NULL);
+    mrpc_service_add_async(SERVICE,async_cb,"Async",NULL);
+    mrpc_service_add_batch(SERVICE,batch_cb,"Batch",8,1000,NULL);
+    CHECK( mrpc_service_run_cores(SERVICE,ADDR,0) != 0 );
+    CHECK( mrpc_service_run_cores(SERVICE,ADDR,CORES) == 0 );
+
+    LEFT = ROUND*3;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_request_async(expect_res,(void*)(i+i+1),5000,ADDR,
+                           MRPC_FUNCTION,"Add","%u%u",(unsigned int)i,(unsigned int)(i+1));
+        mrpc_request_async(expect_res,(void*)1,5000,ADDR,MRPC_FUNCTION,"Batch","%u",(unsigned int)i);
+        mrpc_request_async(error_res,(void*)MRPC_EC_FUNCTION_NOT_SUPPORTED,5000,ADDR,
+                           MRPC_FUNCTION,"Async","");
+    }
+    mrpc_run();
+
+    CHECK( OK == ROUND*3+2 );
+    mrpc_service_quit(SERVICE);
+    mrpc_service_destroy(SERVICE);
+    mrpc_clean();
+    return 0;
+}
+
@@ -0,0 +1,78 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* A request whose deadline is over by the time a worker takes it is answered
+ * with MRPC_EC_DEADLINE_EXCEEDED instead of being executed. It goes through a
+ * socket , the loopback pipe would give up at the deadline on the client side */
+
+#define ADDR "127.0.0.1:23571"
+#define SLOW 200
+
+static int LEFT;
+static int OK;
+static int EXECUTED;
+
+static
+void done() {
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+static
+void expired_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_DEADLINE_EXCEEDED )
+        ++OK;
+    done();
+}
+
+static
+void ok_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK )
+        ++OK;
+    done();
+}
+
+static
+void
+fast_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    ++EXECUTED;
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+/* the only worker is held while the other requests wait in the queue */
+static
+void
+slow_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    mrpc_request_async(expired_res,NULL,SLOW/4,ADDR,MRPC_FUNCTION,"Fast","");
+    mrpc_request_async(ok_res,NULL,SLOW*10,ADDR,MRPC_FUNCTION,"Fast","");
+    mrpc_request_async(ok_res,NULL,SLOW*20,ADDR,MRPC_FUNCTION,"Fast","");
+    test_sleep(SLOW);
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+int main() {
+    struct mrpc_service* service;
+
+    CHECK( mrpc_init(TEST_LOG,ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,fast_cb,"Fast",NULL);
+    mrpc_service_add(service,slow_cb,"Slow",NULL);
+    CHECK( mrpc_service_run_remote(service,1) == 0 );
+
+    LEFT = 4;
+    mrpc_request_async(ok_res,NULL,SLOW*10,ADDR,MRPC_FUNCTION,"Slow","");
+    mrpc_run();
+
+    CHECK( OK == 4 );
+    /* the expired one never ran */
+    CHECK( EXECUTED == 2 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
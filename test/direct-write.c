@@ -0,0 +1,70 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* The workers send the responses straight to the socket. A small response
+ * leaves in one write , a large one is cut short by the socket buffer and its
+ * rest is flushed by the IO thread. Every response must reach its caller whole */
+
+#define ADDR "127.0.0.1:23574"
+#define ROUND 32
+#define LARGE (4<<20)
+
+static int LEFT;
+static int OK;
+
+/* the result is a string of the asked length , filled with one letter */
+static
+void
+fill_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    size_t len = req->par[0].value.uinteger;
+    char* str = malloc(len+1);
+    memset(str,'a'+req->par[1].value.uinteger,len);
+    str[len] = 0;
+    mrpc_val_varchar(result,str,0);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void fill_res( const struct mrpc_response* res , void* data ) {
+    size_t i = (size_t)data;
+    size_t len = i % 2 ? LARGE : i+4;
+    size_t k;
+    if( res != NULL && res->error_code == MRPC_EC_OK &&
+        res->result.type == MRPC_VARCHAR && res->result.value.varchar.len == len ) {
+        for( k = 0 ; k < len ; ++k ) {
+            if( res->result.value.varchar.val[k] != (char)('a'+i%26) )
+                break;
+        }
+        if( k == len )
+            ++OK;
+    }
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,fill_cb,"Fill",NULL);
+    CHECK( mrpc_service_run_remote(service,4) == 0 );
+
+    LEFT = ROUND;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_request_async(fill_res,(void*)i,5000,ADDR,MRPC_FUNCTION,"Fill","%u%u",
+                           (unsigned int)(i % 2 ? LARGE : i+4),(unsigned int)(i%26));
+    }
+    mrpc_run();
+
+    CHECK( OK == ROUND );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
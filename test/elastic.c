@@ -0,0 +1,58 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* The elastic pool starts with one thread and spawns more once a worker
+ * picks up a request that has been queued longer than min_slp_time */
+
+#define ROUND 8
+#define SLOW 100
+
+static int LEFT;
+static int OK;
+static unsigned int LONGEST;
+
+/* the result is how long the request has been queued */
+static
+void
+slow_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,(unsigned int)mrpc_request_elapsed(req));
+    test_sleep(SLOW);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void res_cb( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK ) {
+        ++OK;
+        if( res->result.value.uinteger > LONGEST )
+            LONGEST = res->result.value.uinteger;
+    }
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    int i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,10,50,NULL);
+    mrpc_service_add(service,slow_cb,"Slow",NULL);
+    CHECK( mrpc_service_run_elastic(service,2,1) != 0 );
+    CHECK( mrpc_service_run_elastic(service,1,4) == 0 );
+
+    LEFT = ROUND;
+    for( i = 0 ; i < ROUND ; ++i )
+        mrpc_request_async(res_cb,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Slow","");
+    mrpc_run();
+
+    CHECK( OK == ROUND );
+    /* a single thread would keep the last one queued for (ROUND-1)*SLOW */
+    CHECK( LONGEST < ROUND*SLOW/2 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* A fiber method makes two sequential downstream calls to the same service.
+ * There is one worker , so the calls are only answered if a parked fiber
+ * frees the thread , and many fibers must be parked at once */
+
+#define ROUND 32
+
+static int LEFT;
+static int OK;
+/* only touched by the one worker */
+static int PARKED;
+static int MAX_PARKED;
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+int add( const struct mrpc_request* req , unsigned int a , unsigned int b , unsigned int* sum ) {
+    struct mrpc_response res;
+    int ret;
+    if( ++PARKED > MAX_PARKED )
+        MAX_PARKED = PARKED;
+    ret = mrpc_service_fiber_request(req,&res,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,
+                                     "Add","%u%u",a,b);
+    --PARKED;
+    if( ret != 0 || res.error_code != MRPC_EC_OK )
+        return -1;
+    *sum = res.result.value.uinteger;
+    return 0;
+}
+
+/* the sum of three parameters in two calls of the Add method */
+static
+void
+sum_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    unsigned int sum;
+    if( add(req,req->par[0].value.uinteger,req->par[1].value.uinteger,&sum) != 0 ||
+        add(req,sum,req->par[2].value.uinteger,&sum) != 0 ) {
+        *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE;
+        return;
+    }
+    mrpc_val_uint(result,sum);
+    *error_code = MRPC_EC_OK;
+}
+
+/* outside of a fiber the call fails at once */
+static
+void
+plain_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+          int* error_code , struct mrpc_val* result ) {
+    struct mrpc_response res;
+    mrpc_val_int(result,mrpc_service_fiber_request(req,&res,5000,MRPC_LOOPBACK_ADDR,
+                                                   MRPC_FUNCTION,"Add","%u%u",1,2));
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void done() {
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+static
+void sum_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK &&
+        res->result.value.uinteger == (unsigned int)((size_t)data) )
+        ++OK;
+    done();
+}
+
+static
+void plain_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK && res->result.value.integer == -1 )
+        ++OK;
+    done();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,add_cb,"Add",NULL);
+    mrpc_service_add(service,plain_cb,"Plain",NULL);
+    CHECK( mrpc_service_add_fiber(service,sum_cb,"Sum",NULL) == 0 );
+    CHECK( mrpc_service_run_remote(service,1) == 0 );
+
+    LEFT = ROUND+1;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_request_async(sum_res,(void*)(3*i+3),5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Sum",
+                           "%u%u%u",(unsigned int)i,(unsigned int)(i+1),(unsigned int)(i+2));
+    }
+    mrpc_request_async(plain_res,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Plain","");
+    mrpc_run();
+
+    CHECK( OK == ROUND+1 );
+    CHECK( MAX_PARKED > 1 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* The requests above the in-flight cap are parked on the IO thread and queued
+ * in the order they came in once a slot is free */
+
+#define ROUND 16
+#define MAX_INFLIGHT 2
+
+static int LEFT;
+static int OK;
+static unsigned int ORDER[ROUND];
+static size_t RUN;
+static size_t DEEPEST;
+
+/* a single worker runs the requests in the order they are queued */
+static
+void
+echo_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    size_t depth = mrpc_queue_size(NULL);
+    if( depth > DEEPEST )
+        DEEPEST = depth;
+    ORDER[RUN++] = req->par[0].value.uinteger;
+    test_sleep(5);
+    mrpc_val_uint(result,req->par[0].value.uinteger);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void res_cb( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK &&
+        res->result.value.uinteger == (unsigned int)((size_t)data) )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    mrpc_set_flow_control(MAX_INFLIGHT);
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,echo_cb,"Echo",NULL);
+    CHECK( mrpc_service_run_remote(service,1) == 0 );
+
+    LEFT = ROUND;
+    for( i = 0 ; i < ROUND ; ++i )
+        mrpc_request_async(res_cb,(void*)i,5000,MRPC_LOOPBACK_ADDR,
+                           MRPC_FUNCTION,"Echo","%u",(unsigned int)i);
+    mrpc_run();
+
+    CHECK( OK == ROUND && RUN == ROUND );
+    /* the one running counts , so no more than MAX_INFLIGHT-1 wait in the queue */
+    CHECK( DEEPEST < MAX_INFLIGHT );
+    for( i = 0 ; i < ROUND ; ++i )
+        CHECK( ORDER[i] == i );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
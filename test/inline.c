@@ -0,0 +1,89 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* An inline method runs on the IO thread as soon as its request is read , so
+ * it is answered while every worker is busy */
+
+#define ROUND 8
+#define SLOW 300
+
+static int LEFT;
+static int OK;
+static volatile int SLOW_DONE;
+
+static
+void done() {
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void
+slow_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    test_sleep(SLOW);
+    SLOW_DONE = 1;
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void
+async_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+          struct mrpc_service_token* token ) {
+    mrpc_service_complete(token,NULL,MRPC_EC_FUNCTION_NOT_SUPPORTED);
+}
+
+static
+void add_res( const struct mrpc_response* res , void* data ) {
+    size_t i = (size_t)data;
+    if( res != NULL && res->error_code == MRPC_EC_OK && !SLOW_DONE &&
+        res->result.value.uinteger == i+i+1 )
+        ++OK;
+    done();
+}
+
+static
+void slow_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK )
+        ++OK;
+    done();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,add_cb,"Add",NULL);
+    mrpc_service_add(service,slow_cb,"Slow",NULL);
+    mrpc_service_add_async(service,async_cb,"Async",NULL);
+    CHECK( mrpc_service_set_inline(service,"Add") == 0 );
+    /* a deferred completion has no way back to the IO thread */
+    CHECK( mrpc_service_set_inline(service,"Async") != 0 );
+    CHECK( mrpc_service_set_inline(service,"Nope") != 0 );
+    CHECK( mrpc_service_run_remote(service,1) == 0 );
+
+    LEFT = ROUND+1;
+    mrpc_request_async(slow_res,NULL,SLOW*10,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Slow","");
+    for( i = 0 ; i < ROUND ; ++i )
+        mrpc_request_async(add_res,(void*)i,SLOW*10,MRPC_LOOPBACK_ADDR,
+                           MRPC_FUNCTION,"Add","%u%u",(unsigned int)i,(unsigned int)(i+1));
+    mrpc_run();
+
+    CHECK( OK == ROUND+1 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* The requests carrying the same key run on the same worker , so a per key
+ * counter updated without a lock never loses an update , even though the
+ * handler sleeps between the read and the write */
+
+#define KEYS 4
+#define ROUND 64
+
+static int LEFT;
+static int OK;
+static unsigned int COUNT[KEYS];
+
+static
+void
+count_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+          int* error_code , struct mrpc_val* result ) {
+    unsigned int key = req->par[0].value.uinteger;
+    unsigned int count = COUNT[key];
+    test_sleep(2);
+    COUNT[key] = count+1;
+    mrpc_val_uint(result,count+1);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void count_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,count_cb,"Count",NULL);
+    CHECK( mrpc_service_set_key_affinity(service,"Count",MRPC_MAX_PARAMETER_SIZE) != 0 );
+    CHECK( mrpc_service_set_key_affinity(service,"Count",0) == 0 );
+    CHECK( mrpc_service_run_remote(service,4) == 0 );
+
+    LEFT = ROUND;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_request_async(count_res,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Count",
+                           "%u",(unsigned int)(i%KEYS));
+    }
+    mrpc_run();
+
+    CHECK( OK == ROUND );
+    for( i = 0 ; i < KEYS ; ++i )
+        CHECK( COUNT[i] == ROUND/KEYS );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+#include <string.h>
+
+/* Parameters read on demand from the frame , through the loopback */
+
+#define ROUND 32
+#define TEXT "a string long enough to span more than a few bytes"
+
+static int LEFT;
+static int OK;
+
+/* returns the last parameter plus the length of the second one */
+static
+void
+lazy_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    struct mrpc_param_iter iter;
+    struct mrpc_val a , b , c;
+    int n = 0;
+
+    *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_SIZE;
+    if( req->par_size != 0 )
+        return;
+    mrpc_req_param_iter(req,&iter);
+    /* out of order , then back */
+    if( mrpc_req_param_at(&iter,2,&c) != 0 ||
+        mrpc_req_param_at(&iter,0,&a) != 0 ||
+        mrpc_req_param_at(&iter,1,&b) != 0 )
+        return;
+    if( mrpc_req_param_at(&iter,3,&a) == 0 ||
+        mrpc_req_param_at(&iter,MRPC_MAX_PARAMETER_SIZE,&a) == 0 )
+        return;
+    while( mrpc_req_next_param(&iter,&a) == 1 )
+        ++n;
+    if( n != 3 )
+        return;
+    *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE;
+    if( b.type != MRPC_VARCHAR || b.value.varchar.len != sizeof(TEXT)-1 ||
+        memcmp(b.value.varchar.val,TEXT,b.value.varchar.len) != 0 )
+        return;
+    mrpc_val_uint(result,c.value.uinteger+b.value.varchar.len);
+    *error_code = MRPC_EC_OK;
+}
+
+/* a full parameter list , parsed up front and read again on demand */
+static
+void
+full_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    struct mrpc_param_iter iter;
+    struct mrpc_val last;
+
+    *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_SIZE;
+    if( req->par_size != MRPC_MAX_PARAMETER_SIZE )
+        return;
+    mrpc_req_param_iter(req,&iter);
+    if( mrpc_req_param_at(&iter,MRPC_MAX_PARAMETER_SIZE-1,&last) != 0 ||
+        last.value.uinteger != req->par[MRPC_MAX_PARAMETER_SIZE-1].value.uinteger ||
+        mrpc_req_param_at(&iter,MRPC_MAX_PARAMETER_SIZE,&last) == 0 )
+        return;
+    mrpc_val_uint(result,req->par[0].value.uinteger+sizeof(TEXT)-1);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void res_cb( const struct mrpc_response* res , void* data ) {
+    size_t i = (size_t)data;
+    if( res != NULL && res->error_code == MRPC_EC_OK &&
+        res->result.value.uinteger == i+sizeof(TEXT)-1 )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,lazy_cb,"Lazy",NULL);
+    mrpc_service_add(service,full_cb,"Full",NULL);
+    CHECK( mrpc_service_set_lazy(service,"Lazy") == 0 );
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    LEFT = 2*ROUND;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_set_wire_version(i % 2 ? 1 : 2);
+        mrpc_request_async(res_cb,(void*)i,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Lazy",
+                           "%d%s%u",-1,TEXT,(unsigned int)i);
+        /* MRPC_MAX_PARAMETER_SIZE parameters */
+        mrpc_request_async(res_cb,(void*)i,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Full",
+                           "%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u%u",(unsigned int)i,
+                           1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    }
+    mrpc_run();
+
+    CHECK( OK == 2*ROUND );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* The limiter answers the requests over its limit with MRPC_EC_OVERLOADED ,
+ * and the limit shrinks once the latency shows the requests pile up */
+
+#define HOLD 3
+#define WORK 16
+
+static int LEFT;
+static int OK;
+static int OVERLOADED;
+
+static
+void
+sleep_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+          int* error_code , struct mrpc_val* result ) {
+    test_sleep((int)((size_t)udata));
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void res_cb( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK )
+        ++OK;
+    else if( res != NULL && res->error_code == MRPC_EC_OVERLOADED )
+        ++OVERLOADED;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+/* the second worker finds the limit of 1 taken while the first one sleeps */
+static
+void hold_res( const struct mrpc_response* res , void* data ) {
+    int i;
+    res_cb(res,data);
+    if( LEFT != WORK )
+        return;
+    /* a burst queued on 2 workers , the later requests wait longer and longer */
+    for( i = 0 ; i < WORK ; ++i )
+        mrpc_request_async(res_cb,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Work","");
+}
+
+int main() {
+    struct mrpc_service* service;
+    int i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,sleep_cb,"Hold",(void*)100);
+    mrpc_service_add(service,sleep_cb,"Work",(void*)20);
+    CHECK( mrpc_service_get_limit(service,"Hold") == -1 );
+    CHECK( mrpc_service_set_limiter(service,"Hold",1,1) == 0 );
+    CHECK( mrpc_service_set_limiter(service,"Work",1,16) == 0 );
+    CHECK( mrpc_service_set_limiter(service,"Work",2,1) != 0 );
+    CHECK( mrpc_service_get_limit(service,"Hold") == 1 );
+    CHECK( mrpc_service_get_limit(service,"Work") == 8 );
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    LEFT = HOLD+WORK;
+    for( i = 0 ; i < HOLD ; ++i )
+        mrpc_request_async(hold_res,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Hold","");
+    mrpc_run();
+
+    CHECK( OK == 1+WORK );
+    CHECK( OVERLOADED == HOLD-1 );
+    CHECK( mrpc_service_get_limit(service,"Work") < 8 );
+    CHECK( mrpc_service_get_limit(service,"Work") >= 1 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
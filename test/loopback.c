@@ -0,0 +1,84 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* Requests through the loopback pipe , the timeout of the caller bounds the
+ * wait for the response since the pipe connects at once */
+
+#define ROUND 32
+#define SLOW 300
+
+static int LEFT;
+static int OK;
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void
+slow_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    test_sleep(SLOW);
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void done() {
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+static
+void add_res( const struct mrpc_response* res , void* data ) {
+    size_t i = (size_t)data;
+    if( res != NULL && res->error_code == MRPC_EC_OK && res->result.value.uinteger == i+i+1 )
+        ++OK;
+    done();
+}
+
+/* the caller gives up long before the handler is done */
+static
+void slow_res( const struct mrpc_response* res , void* data ) {
+    if( res == NULL )
+        ++OK;
+    done();
+}
+
+/* a timeout longer than the handler leaves the call alone */
+static
+void patient_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK )
+        ++OK;
+    done();
+}
+
+int main() {
+    struct mrpc_service* service;
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,add_cb,"Add",NULL);
+    mrpc_service_add(service,slow_cb,"Slow",NULL);
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    LEFT = ROUND+2;
+    for( i = 0 ; i < ROUND ; ++i )
+        mrpc_request_async(add_res,(void*)i,1000,MRPC_LOOPBACK_ADDR,
+                           MRPC_FUNCTION,"Add","%u%u",(unsigned int)i,(unsigned int)(i+1));
+    mrpc_request_async(slow_res,NULL,SLOW/6,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Slow","");
+    mrpc_request_async(patient_res,NULL,SLOW*10,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Slow","");
+    mrpc_run();
+
+    CHECK( OK == ROUND+2 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
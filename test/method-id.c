@@ -0,0 +1,92 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* A method id asked with MRPC_METHOD_ID_QUERY is called through the loopback */
+
+#define ROUND 64
+
+static int LEFT;
+static int OK;
+static int ID = -1;
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    if( req->par_size != 2 ) {
+        *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_SIZE;
+        return;
+    }
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void done() {
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+static
+void add_res( const struct mrpc_response* res , void* data ) {
+    size_t i = (size_t)data;
+    if( res != NULL && res->error_code == MRPC_EC_OK && res->result.value.uinteger == i+i+1 )
+        ++OK;
+    done();
+}
+
+static
+void not_found_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_FUNCTION_NOT_FOUND )
+        ++OK;
+    done();
+}
+
+/* the calls go out once the id is known */
+static
+void id_res( const struct mrpc_response* res , void* data ) {
+    size_t i;
+    if( res != NULL && res->error_code == MRPC_EC_OK && res->result.type == MRPC_UINT ) {
+        ID = (int)res->result.value.uinteger;
+        ++OK;
+        for( i = 0 ; i < ROUND ; ++i ) {
+            mrpc_set_wire_version(i % 2 ? 1 : 2);
+            mrpc_request_async_id(add_res,(void*)i,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,ID,
+                                  "%u%u",(unsigned int)i,(unsigned int)(i+1));
+        }
+        /* an id nobody registered */
+        mrpc_request_async_id(not_found_res,NULL,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,
+                              MRPC_MAX_METHOD_ID-1,"%u%u",1,2);
+    } else {
+        /* nothing else is coming */
+        LEFT = 1;
+    }
+    done();
+}
+
+int main() {
+    struct mrpc_service* service;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,add_cb,"Foo",NULL);
+    mrpc_service_add(service,add_cb,"Add",NULL);
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    LEFT = ROUND+3;
+    mrpc_request_async(not_found_res,NULL,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,
+                       MRPC_METHOD_ID_QUERY,"%s","Nope");
+    mrpc_request_async(id_res,NULL,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,
+                       MRPC_METHOD_ID_QUERY,"%s","Add");
+    mrpc_run();
+
+    /* the ids are shared by the process , the server answers the local one */
+    CHECK( ID == mrpc_method_id("Add") );
+    CHECK( ID != mrpc_method_id("Foo") );
+    CHECK( OK == ROUND+3 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include "test.h"
+#include "private/mq.h"
+
+/* Deficit round robin among the flows of a lane */
+
+/* data can't be NULL */
+#define ID(flow,i) (((flow)+1)*100+(i))
+#define DATA(flow,i) ((void*)(size_t)ID(flow,i))
+
+static
+size_t take( struct mq* mq ) {
+    void* data;
+    CHECK( mq_try_dequeue(mq,&data) == 0 );
+    return (size_t)data;
+}
+
+int main() {
+    struct mq* mq = mq_create();
+    void* data;
+    int i;
+
+    /* a flow is a FIFO */
+    for( i = 0 ; i < 4 ; ++i )
+        mq_enqueue(mq,DATA(0,i));
+    for( i = 0 ; i < 4 ; ++i )
+        CHECK( take(mq) == ID(0,i) );
+
+    /* flow 1 has twice the weight of flow 2 , it is served twice per round
+     * until it runs dry */
+    mq_set_quantum(mq,10);
+    mq_set_weight(mq,1,2);
+    for( i = 0 ; i < 6 ; ++i ) {
+        mq_enqueue_flow(mq,DATA(1,i),0,1,10);
+        mq_enqueue_flow(mq,DATA(2,i),0,2,10);
+    }
+    for( i = 0 ; i < 3 ; ++i ) {
+        CHECK( take(mq) == ID(1,2*i) );
+        CHECK( take(mq) == ID(1,2*i+1) );
+        CHECK( take(mq) == ID(2,i) );
+    }
+    for( i = 3 ; i < 6 ; ++i )
+        CHECK( take(mq) == ID(2,i) );
+    CHECK( mq_try_dequeue(mq,&data) == -1 );
+
+    /* the share follows the cost , not the count : a flow of costly data
+     * waits for the credit of several rounds */
+    mq_set_weight(mq,1,1);
+    for( i = 0 ; i < 2 ; ++i )
+        mq_enqueue_flow(mq,DATA(1,i),0,1,30);
+    for( i = 0 ; i < 6 ; ++i )
+        mq_enqueue_flow(mq,DATA(2,i),0,2,10);
+    CHECK( take(mq) == ID(2,0) );
+    CHECK( take(mq) == ID(2,1) );
+    CHECK( take(mq) == ID(1,0) );
+    CHECK( take(mq) == ID(2,2) );
+    CHECK( take(mq) == ID(2,3) );
+    CHECK( take(mq) == ID(2,4) );
+    CHECK( take(mq) == ID(1,1) );
+    CHECK( take(mq) == ID(2,5) );
+    CHECK( mq_size(mq) == 0 );
+
+    mq_destroy(mq);
+    return 0;
+}
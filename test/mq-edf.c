@@ -0,0 +1,59 @@
+#include "test.h"
+#include "private/mq.h"
+#include <limits.h>
+
+/* Earliest deadline first order of mq_enqueue_deadline */
+
+#define DATA(i) ((void*)(size_t)(i))
+
+static
+size_t take( struct mq* mq ) {
+    void* data;
+    CHECK( mq_try_dequeue(mq,&data) == 0 );
+    return (size_t)data;
+}
+
+int main() {
+    struct mq* mq = mq_create();
+    void* data;
+
+    /* the earliest deadline goes first */
+    mq_enqueue_deadline(mq,DATA(3),0,0,0,300);
+    mq_enqueue_deadline(mq,DATA(1),0,0,0,100);
+    mq_enqueue_deadline(mq,DATA(2),0,0,0,200);
+    CHECK( mq_size(mq) == 3 );
+    CHECK( take(mq) == 1 );
+    CHECK( take(mq) == 2 );
+    CHECK( take(mq) == 3 );
+    CHECK( mq_try_dequeue(mq,&data) == -1 );
+
+    /* equal deadlines keep their order */
+    mq_enqueue_deadline(mq,DATA(1),0,0,0,100);
+    mq_enqueue_deadline(mq,DATA(2),0,0,0,100);
+    CHECK( take(mq) == 1 );
+    CHECK( take(mq) == 2 );
+
+    /* data without a deadline is never passed */
+    mq_enqueue_flow(mq,DATA(1),0,0,0);
+    mq_enqueue_deadline(mq,DATA(2),0,0,0,100);
+    mq_enqueue_deadline(mq,DATA(3),0,0,0,50);
+    CHECK( take(mq) == 1 );
+    CHECK( take(mq) == 3 );
+    CHECK( take(mq) == 2 );
+
+    /* the deadlines are compared as a wrapping clock */
+    mq_enqueue_deadline(mq,DATA(2),0,0,0,INT_MIN);
+    mq_enqueue_deadline(mq,DATA(1),0,0,0,INT_MAX);
+    CHECK( take(mq) == 1 );
+    CHECK( take(mq) == 2 );
+
+    /* a deadline only reorders its own flow */
+    mq_enqueue_deadline(mq,DATA(1),0,1,0,300);
+    mq_enqueue_deadline(mq,DATA(2),0,2,0,100);
+    CHECK( take(mq) == 1 );
+    CHECK( take(mq) == 2 );
+    CHECK( mq_size(mq) == 0 );
+
+    mq_destroy(mq);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "test.h"
+#include "private/mq.h"
+
+/* Strict priority among the lanes and the starvation limit */
+
+/* data can't be NULL */
+#define ID(lane,i) (((lane)+1)*100+(i))
+#define DATA(lane,i) ((void*)(size_t)ID(lane,i))
+
+static
+size_t take( struct mq* mq ) {
+    void* data;
+    CHECK( mq_try_dequeue(mq,&data) == 0 );
+    return (size_t)data;
+}
+
+int main() {
+    struct mq* mq = mq_create();
+    void* data;
+    int i;
+
+    /* a higher lane goes first whatever the arrival order */
+    mq_set_starvation_limit(mq,0);
+    mq_enqueue_flow(mq,DATA(2,0),2,0,0);
+    mq_enqueue_flow(mq,DATA(1,0),1,0,0);
+    mq_enqueue_flow(mq,DATA(0,0),0,0,0);
+    CHECK( mq_lane_size(mq,0) == 1 );
+    CHECK( mq_lane_size(mq,1) == 1 );
+    CHECK( mq_lane_size(mq,2) == 1 );
+    CHECK( take(mq) == ID(0,0) );
+    CHECK( take(mq) == ID(1,0) );
+    CHECK( take(mq) == ID(2,0) );
+    CHECK( mq_try_dequeue(mq,&data) == -1 );
+
+    /* with no limit the low lane waits for the high one to run dry */
+    for( i = 0 ; i < 5 ; ++i )
+        mq_enqueue_flow(mq,DATA(0,i),0,0,0);
+    mq_enqueue_flow(mq,DATA(2,0),2,0,0);
+    for( i = 0 ; i < 5 ; ++i )
+        CHECK( take(mq) == ID(0,i) );
+    CHECK( take(mq) == ID(2,0) );
+
+    /* a lane passed over limit times in a row is served once ahead */
+    mq_set_starvation_limit(mq,2);
+    for( i = 0 ; i < 5 ; ++i )
+        mq_enqueue_flow(mq,DATA(0,i),0,0,0);
+    mq_enqueue_flow(mq,DATA(2,0),2,0,0);
+    mq_enqueue_flow(mq,DATA(2,1),2,0,0);
+    CHECK( take(mq) == ID(0,0) );
+    CHECK( take(mq) == ID(0,1) );
+    CHECK( take(mq) == ID(2,0) );
+    CHECK( take(mq) == ID(0,2) );
+    CHECK( take(mq) == ID(0,3) );
+    CHECK( take(mq) == ID(2,1) );
+    CHECK( take(mq) == ID(0,4) );
+    CHECK( mq_lane_size(mq,0) == 0 );
+    CHECK( mq_lane_size(mq,2) == 0 );
+    CHECK( mq_size(mq) == 0 );
+
+    mq_destroy(mq);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+
+/* A method bound to a bulkhead pool runs on the threads of that pool only ,
+ * so it stalling doesn't hold back the methods of the shared workers */
+
+#define ROUND 8
+#define SLOW 300
+
+static int LEFT;
+static int OK;
+static volatile int SLOW_DONE;
+
+static
+void done() {
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+static
+void
+fast_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void
+slow_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    test_sleep(SLOW);
+    SLOW_DONE = 1;
+    mrpc_val_uint(result,0);
+    *error_code = MRPC_EC_OK;
+}
+
+/* the shared worker answers while the pool is still stalled */
+static
+void fast_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK && !SLOW_DONE )
+        ++OK;
+    done();
+}
+
+static
+void slow_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK )
+        ++OK;
+    done();
+}
+
+int main() {
+    struct mrpc_service* service;
+    int i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,fast_cb,"Fast",NULL);
+    mrpc_service_add(service,slow_cb,"Slow",NULL);
+    CHECK( mrpc_service_add_pool(service,"Backend",1) == 0 );
+    CHECK( mrpc_service_bind_pool(service,"Slow","Backend") == 0 );
+    CHECK( mrpc_service_bind_pool(service,"Nope","Backend") != 0 );
+    CHECK( mrpc_service_bind_pool(service,"Fast","Nope") != 0 );
+    CHECK( mrpc_service_run_remote(service,1) == 0 );
+
+    LEFT = ROUND+1;
+    mrpc_request_async(slow_res,NULL,SLOW*10,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Slow","");
+    for( i = 0 ; i < ROUND ; ++i )
+        mrpc_request_async(fast_res,NULL,SLOW*10,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Fast","");
+    mrpc_run();
+
+    CHECK( OK == ROUND+1 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+#include <string.h>
+
+/* Prepared calls of both frame versions , by name and by id , through the
+ * loopback */
+
+#define ROUND 64
+
+static int LEFT;
+static int OK;
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    if( req->par_size != 3 || req->par[2].type != MRPC_VARCHAR ) {
+        *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_SIZE;
+        return;
+    }
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger+
+                         req->par[2].value.varchar.len);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void add_res( const struct mrpc_response* res , void* data ) {
+    size_t i = (size_t)data;
+    /* the response comes in the version of the request */
+    int version = i % 3 == 0 ? 1 : 2;
+    if( res != NULL && res->error_code == MRPC_EC_OK && res->version == version &&
+        res->result.value.uinteger == i+i+1+3 )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    struct mrpc_prepared* p[3];
+    char buf[256];
+    size_t sz;
+    size_t i;
+
+    /* a short buffer is left untouched and the largest size is returned ,
+     * which fits the retry whatever stream id it gets */
+    p[0] = mrpc_prepare(MRPC_FUNCTION,"Add","%u%u%s");
+    CHECK( p[0] != NULL );
+    memset(buf,0x7f,sizeof(buf));
+    sz = mrpc_call_prepared(p[0],buf,4,0,1u,2u,"abc");
+    CHECK( sz > 4 && sz < sizeof(buf) );
+    for( i = 0 ; i < sizeof(buf) ; ++i )
+        CHECK( buf[i] == 0x7f );
+    for( i = 0 ; i < 64 ; ++i )
+        CHECK( mrpc_call_prepared(p[0],buf,sz,0,1u,2u,"abc") <= sz );
+    mrpc_prepared_destroy(p[0]);
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,add_cb,"Add",NULL);
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    /* a prepared call keeps the version it is prepared with */
+    mrpc_set_wire_version(1);
+    p[0] = mrpc_prepare(MRPC_FUNCTION,"Add","%u%u%s");
+    mrpc_set_wire_version(2);
+    p[1] = mrpc_prepare(MRPC_FUNCTION,"Add","%u%u%s");
+    p[2] = mrpc_prepare_id(MRPC_FUNCTION,mrpc_method_id("Add"),"%u%u%s");
+    CHECK( p[0] != NULL && p[1] != NULL && p[2] != NULL );
+
+    LEFT = ROUND;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_request_async_prepared(add_res,(void*)i,1000,MRPC_LOOPBACK_ADDR,p[i%3],
+                                    (unsigned int)i,(unsigned int)(i+1),"abc");
+    }
+    mrpc_run();
+
+    CHECK( OK == ROUND );
+    for( i = 0 ; i < 3 ; ++i )
+        mrpc_prepared_destroy(p[i]);
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+#include <stdlib.h>
+
+/* Every worker gets its own state , the handlers count the requests in it
+ * without a lock and mrpc_service_foreach_state sums the counters up */
+
+#define WORKERS 3
+#define ROUND 64
+
+struct counter {
+    void* udata;
+    unsigned int calls;
+};
+
+static int LEFT;
+static int OK;
+static int DESTROYED;
+
+static
+void* state_init( struct mrpc_service* service , void* udata ) {
+    struct counter* c = malloc(sizeof(*c));
+    c->udata = udata;
+    c->calls = 0;
+    return c;
+}
+
+static
+void state_destroy( struct mrpc_service* service , void* state , void* udata ) {
+    free(state);
+    ++DESTROYED;
+}
+
+static
+void state_sum( struct mrpc_service* service , void* state , void* data ) {
+    unsigned int* sum = (unsigned int*)data;
+    sum[0] += ((struct counter*)state)->calls;
+    ++sum[1];
+}
+
+static
+void
+count_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+          int* error_code , struct mrpc_val* result ) {
+    struct counter* c = (struct counter*)mrpc_service_get_state(service);
+    if( c == NULL || c->udata != udata ) {
+        *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE;
+        return;
+    }
+    ++c->calls;
+    mrpc_val_uint(result,c->calls);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void count_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    unsigned int sum[2] = {0,0};
+    size_t i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,count_cb,"Count",&OK);
+    CHECK( mrpc_service_set_state(service,state_init,state_destroy,&OK) == 0 );
+    CHECK( mrpc_service_run_remote(service,WORKERS) == 0 );
+    /* not a worker */
+    CHECK( mrpc_service_get_state(service) == NULL );
+
+    LEFT = ROUND;
+    for( i = 0 ; i < ROUND ; ++i )
+        mrpc_request_async(count_res,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Count","");
+    mrpc_run();
+
+    CHECK( OK == ROUND );
+    mrpc_service_foreach_state(service,state_sum,sum);
+    CHECK( sum[0] == ROUND );
+    /* a worker that has not started yet has no state */
+    CHECK( sum[1] >= 1 && sum[1] <= WORKERS );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    /* every worker has initialized its state by the time it quits */
+    CHECK( DESTROYED == WORKERS );
+    mrpc_clean();
+    return 0;
+}
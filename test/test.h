@@ -0,0 +1,31 @@
+#ifndef TEST_H_
+#define TEST_H_
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#define test_sleep(msec) Sleep(msec)
+#else
+#include <unistd.h>
+#define test_sleep(msec) usleep((msec)*1000)
+#endif /* _WIN32 */
+
+/* The tests are run by make test from the top directory , each one is a
+ * program returning 0 when it passes */
+
+#define TEST_LOG "test/test.log"
+
+/* The loopback transport is served by the listener of mrpc_init , any free
+ * port does */
+#define TEST_ADDR "127.0.0.1:0"
+
+/* Stop the test at the first failed check */
+#define CHECK(x) \
+    do { \
+        if( !(x) ) { \
+            fprintf(stderr,"%s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#x); \
+            exit(1); \
+        } \
+    } while(0)
+
+#endif /* TEST_H_ */
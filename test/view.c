@@ -0,0 +1,87 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+#include <string.h>
+
+/* A method parsed as a view gets its name and its strings in place in the
+ * frame , a short string included , and they are read by their length */
+
+#define ROUND 16
+#define SHORT "key"
+#define LONG "a string long enough to be kept out of the local buffer"
+
+static int LEFT;
+static int OK;
+
+static
+int same( const struct mrpc_val* val , const char* str ) {
+    return val->type == MRPC_VARCHAR && val->value.varchar.len == strlen(str) &&
+           memcmp(val->value.varchar.val,str,val->value.varchar.len) == 0;
+}
+
+/* the result is the length of both strings */
+static
+void
+view_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE;
+    if( !req->view || req->method_name_len != 4 || memcmp(req->method,"View",4) != 0 )
+        return;
+    if( req->par_size != 2 || !same(req->par,SHORT) || !same(req->par+1,LONG) )
+        return;
+    /* in place , not in the small string buffer */
+    if( req->par[0].value.varchar.val == req->par[0].value.varchar.buf )
+        return;
+    mrpc_val_uint(result,(unsigned int)(req->par[0].value.varchar.len+req->par[1].value.varchar.len));
+    *error_code = MRPC_EC_OK;
+}
+
+/* without a view the strings are copied and null terminated */
+static
+void
+copy_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_TYPE;
+    if( req->view || strcmp(req->method_name,"Copy") != 0 )
+        return;
+    if( req->par_size != 2 || strcmp(req->par[0].value.varchar.val,SHORT) != 0 ||
+        strcmp(req->par[1].value.varchar.val,LONG) != 0 )
+        return;
+    mrpc_val_uint(result,(unsigned int)(req->par[0].value.varchar.len+req->par[1].value.varchar.len));
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void len_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_OK &&
+        res->result.value.uinteger == strlen(SHORT)+strlen(LONG) )
+        ++OK;
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+int main() {
+    struct mrpc_service* service;
+    int i;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,view_cb,"View",NULL);
+    mrpc_service_add(service,copy_cb,"Copy",NULL);
+    CHECK( mrpc_service_set_view(service,"View") == 0 );
+    CHECK( mrpc_service_set_view(service,"None") != 0 );
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    LEFT = ROUND*2;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_request_async(len_res,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"View","%s%s",SHORT,LONG);
+        mrpc_request_async(len_res,NULL,5000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Copy","%s%s",SHORT,LONG);
+    }
+    mrpc_run();
+
+    CHECK( OK == ROUND*2 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}
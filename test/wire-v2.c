@@ -0,0 +1,102 @@
+#include "test.h"
+#include "minirpc.h"
+#include "minirpc-service.h"
+#include <string.h>
+
+/* Round trip of the version 1 and version 2 frames through the loopback */
+
+#define ROUND 64
+
+static int LEFT;
+static int OK;
+
+static
+void
+add_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+        int* error_code , struct mrpc_val* result ) {
+    if( req->par_size != 2 ) {
+        *error_code = MRPC_EC_FUNCTION_INVALID_PARAMETER_SIZE;
+        return;
+    }
+    /* the version the request came in travels back with the sum */
+    mrpc_val_uint(result,req->par[0].value.uinteger+req->par[1].value.uinteger+req->version*1000);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void
+echo_cb( struct mrpc_service* service , const struct mrpc_request* req , void* udata ,
+         int* error_code , struct mrpc_val* result ) {
+    mrpc_val_varchar(result,req->par[0].value.varchar.val,0);
+    *error_code = MRPC_EC_OK;
+}
+
+static
+void done() {
+    if( --LEFT == 0 )
+        mrpc_interrupt();
+}
+
+static
+void add_res( const struct mrpc_response* res , void* data ) {
+    size_t i = (size_t)data;
+    int version = i % 2 ? 1 : 2;
+    if( res != NULL && res->error_code == MRPC_EC_OK && res->version == version &&
+        res->result.value.uinteger == i+i+1+version*1000 )
+        ++OK;
+    done();
+}
+
+static
+void echo_res( const struct mrpc_response* res , void* data ) {
+    const char* str = (const char*)data;
+    if( res != NULL && res->error_code == MRPC_EC_OK && res->result.type == MRPC_VARCHAR &&
+        res->result.value.varchar.len == strlen(str) &&
+        memcmp(res->result.value.varchar.val,str,strlen(str)) == 0 )
+        ++OK;
+    done();
+}
+
+static
+void not_found_res( const struct mrpc_response* res , void* data ) {
+    if( res != NULL && res->error_code == MRPC_EC_FUNCTION_NOT_FOUND &&
+        res->version == (int)((size_t)data) )
+        ++OK;
+    done();
+}
+
+int main() {
+    struct mrpc_service* service;
+    char big[1000];
+    size_t i;
+
+    memset(big,'x',sizeof(big)-1);
+    big[sizeof(big)-1] = 0;
+
+    CHECK( mrpc_init(TEST_LOG,TEST_ADDR,1) == 0 );
+    service = mrpc_service_create(16,0,50,NULL);
+    mrpc_service_add(service,add_cb,"Add",NULL);
+    mrpc_service_add(service,echo_cb,"Echo",NULL);
+    CHECK( mrpc_service_run_remote(service,2) == 0 );
+
+    LEFT = ROUND+4;
+    for( i = 0 ; i < ROUND ; ++i ) {
+        mrpc_set_wire_version(i % 2 ? 1 : 2);
+        mrpc_request_async(add_res,(void*)i,1000,MRPC_LOOPBACK_ADDR,
+                           MRPC_FUNCTION,"Add","%u%u",(unsigned int)i,(unsigned int)(i+1));
+    }
+    /* a long body needs more than one byte of varint length */
+    mrpc_set_wire_version(2);
+    mrpc_request_async(echo_res,big,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Echo","%s",big);
+    mrpc_request_async(not_found_res,(void*)2,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Nope","");
+    mrpc_set_wire_version(1);
+    mrpc_request_async(echo_res,big,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Echo","%s",big);
+    mrpc_request_async(not_found_res,(void*)1,1000,MRPC_LOOPBACK_ADDR,MRPC_FUNCTION,"Nope","");
+    mrpc_run();
+
+    CHECK( OK == ROUND+4 );
+    mrpc_service_quit(service);
+    mrpc_service_destroy(service);
+    mrpc_clean();
+    return 0;
+}